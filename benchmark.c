@@ -0,0 +1,255 @@
+#include "interface.h"
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/* Benchmark for the query path, runs without a smart meter or inverter.
+
+   Dispatch mode measures per command the time needed to find the command
+   (registry lookup only) and to run handleCommand completely, using a built
+   in telegram and SunSpec register block. It also measures decoding a
+   SunSpec register block, which is done once per modbus reply, and adding a
+   sample to the history, which is done once per telegram.
+
+   Replay mode (-R) runs the measurement program itself on replayed
+   telegrams and modbus replies, with UDP and TCP clients querying it, see
+   replay.h.
+ */
+
+#define BUFFSIZE 4096
+
+static const char sampleTelegram[]=
+        "/ISk5\\2MT382-1000\r\n\r\n"
+        "1-3:0.2.8(50)\r\n"
+        "0-0:1.0.0(231017120000W)\r\n"
+        "0-0:96.1.1(4B384547303034303436333935353037)\r\n"
+        "1-0:1.8.1(123456.789*kWh)\r\n"
+        "1-0:1.8.2(123456.789*kWh)\r\n"
+        "1-0:2.8.1(001234.567*kWh)\r\n"
+        "1-0:2.8.2(002345.678*kWh)\r\n"
+        "0-0:96.14.0(0002)\r\n"
+        "1-0:1.7.0(01.193*kW)\r\n"
+        "1-0:2.7.0(00.000*kW)\r\n"
+        "0-0:96.7.21(00004)\r\n"
+        "1-0:32.7.0(230.1*V)\r\n"
+        "1-0:52.7.0(231.2*V)\r\n"
+        "1-0:72.7.0(229.3*V)\r\n"
+        "1-0:31.7.0(003*A)\r\n"
+        "1-0:51.7.0(002*A)\r\n"
+        "1-0:71.7.0(001*A)\r\n"
+        "1-0:21.7.0(00.503*kW)\r\n"
+        "1-0:41.7.0(00.400*kW)\r\n"
+        "1-0:61.7.0(00.290*kW)\r\n"
+        "1-0:22.7.0(00.000*kW)\r\n"
+        "1-0:42.7.0(00.000*kW)\r\n"
+        "1-0:62.7.0(00.000*kW)\r\n"
+        "0-1:24.1.0(003)\r\n"
+        "0-1:24.2.1(231017120000S)(01234.567*m3)\r\n"
+        "!B1D0\r\n";
+
+static const char* replayCommands[]={
+        "VL1", "json", "40084", "use.avg.15m", "VL1,VL2,PL1+,40084", 0
+};
+
+static const char* defaultCommands[]={
+        "help", "10s", "pcurnet", "all", "VL1", "PL3-", "timestamp",
+        "json", "consumption", "40072", "40084", "40104", "sum:40084", "lastday",
+        "net.max.24h", "VL1,VL2,PL1+,40084", "doesnotexist", 0
+};
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void usage(const char* toolname)
+{
+        printf("Usage: %s [-n iterations] [command ...]\n",toolname);
+        printf("   Measure command dispatch and handling time per command.\n");
+        printf("       %s -R [-b <program>] [-f <telegram file>] [-r <register file>] [-x <speed>] [-D <s>]\n",toolname);
+        printf("          [-u <rate>] [-T <rate>] [-t <n>] [-p <port>] [command ...]\n");
+        printf("   Replay telegrams and modbus replies to the measurement program, and measure\n");
+        printf("   its throughput, latency and CPU time while the commands are queried.\n");
+        printf("   -b <program> the program to run, default ./measurement.\n");
+        printf("   -f <file> captured telegrams to replay, default a built in telegram.\n");
+        printf("   -r <file> register image for the fake modbus server, lines '<address> <value>...'.\n");
+        printf("   -x <speed> telegrams per second, 1 to 1000, default 1.\n");
+        printf("   -D <s> duration of the run, default 10.\n");
+        printf("   -u <rate> UDP queries per second, default 100. -T <rate> TCP queries per second,\n");
+        printf("      default 10. -t <n> TCP clients receiving telegrams, default 4, at most 64.\n");
+        printf("   -p <port> port of the program, default 19012; the modbus server uses the next one.\n");
+}
+
+static void fillModbusData(uint16_t* modbusData)
+{
+        int i;
+        for (i=0;i<modbusRegCount;i++) modbusData[i]=htons(i);
+}
+
+static int benchDispatch(const long iterations, const char** commands)
+{
+        InitializationData id;
+        P1Telegram p1;
+        ModbusDeviceConfig config;
+        ModbusClient modbus;
+        Measurements m;
+        TimeSeries history;
+        HistoryStore store;
+        double sample[SERIES_COUNT];
+        char buffer[BUFFSIZE];
+        TextBuf answer;
+        const char** c;
+        long i;
+
+        bzero(&id,sizeof(id));
+        bzero(&m,sizeof(m));
+        bzero(&config,sizeof(config));
+        strcpy(config.name,"bench");
+        if (modbusInit(&modbus,&config,0)) return 1;
+        fillModbusData(modbus.data);
+        modbus.activeData=modbus.data;
+        modbus.activeValues=modbus.values;
+        decodeSunSpec(modbus.activeData,modbus.activeValues);
+        clock_gettime(CLOCK_REALTIME,&modbus.updateTime);
+        parseP1Telegram(sampleTelegram,strlen(sampleTelegram),&p1);
+        m.p1=&p1;
+        m.p1UpdateTime=modbus.updateTime;
+        m.modbus=&modbus;
+        m.modbusCount=1;
+        m.device=DEVICE_DEFAULT;
+        /* A day of history, one sample per second */
+        if (timeSeriesInit(&history,SERIES_COUNT,86400)) return 1;
+        for (i=0;i<86400;i++)
+        {
+                for (int s=0;s<SERIES_COUNT;s++) sample[s]=(i*7919+s*104729)%5000;
+                timeSeriesAppend(&history,m.p1UpdateTime.tv_sec-86400+i,sample);
+        }
+        m.history=&history;
+        bzero(&store,sizeof(store));
+        m.store=&store;
+
+        if (initCommandRegistry())
+        {
+                fprintf(stderr,"Failed to setup command table\n");
+                return 1;
+        }
+
+        printf("%-14s %12s %12s\n","command","lookup ns","handle ns");
+        for (c=commands;*c;c++)
+        {
+                const size_t len=strlen(*c);
+                const RegistryEntry* volatile e=0;
+                double start=now();
+                for (i=0;i<iterations;i++)
+                {
+                        e=findCommand(*c,len);
+                }
+                const double lookup=(now()-start)/iterations;
+                start=now();
+                for (i=0;i<iterations;i++)
+                {
+                        textBufInit(&answer,buffer,sizeof(buffer));
+                        handleCommand(&id,&m,*c,&answer);
+                }
+                const double handle=(now()-start)/iterations;
+                printf("%-14s %12.1f %12.1f\n",*c,lookup*1e9,handle*1e9);
+                (void)e;
+        }
+        double start=now();
+        for (i=0;i<iterations;i++)
+        {
+                decodeSunSpec(modbus.activeData,modbus.values+sunSpecParamCount);
+        }
+        printf("%-14s %12s %12.1f\n","(decode)","",(now()-start)/iterations*1e9);
+        start=now();
+        for (i=0;i<iterations;i++)
+        {
+                timeSeriesAppend(&history,m.p1UpdateTime.tv_sec+i,sample);
+        }
+        printf("%-14s %12s %12.1f\n","(append)","",(now()-start)/iterations*1e9);
+        timeSeriesFree(&history);
+        modbusFree(&modbus);
+        return 0;
+}
+
+int main(int argc, char** argv)
+{
+        extern char* optarg;
+        extern int optind;
+        long iterations=100000;
+        int replay=0;
+        int opt;
+        ReplayOptions options;
+        bzero(&options,sizeof(options));
+        options.binary="./measurement";
+        options.defaultTelegram=sampleTelegram;
+        options.speed=1;
+        options.duration=10;
+        options.udpRate=100;
+        options.tcpRate=10;
+        options.tcpClients=4;
+        options.port=19012;
+
+        while ((opt=getopt(argc,argv,"n:Rb:f:r:x:D:u:T:t:p:"))!=-1)
+        {
+                switch(opt)
+                {
+                        case 'n':
+                                iterations=atol(optarg);
+                                break;
+                        case 'R':
+                                replay=1;
+                                break;
+                        case 'b':
+                                options.binary=optarg;
+                                break;
+                        case 'f':
+                                options.telegramFile=optarg;
+                                break;
+                        case 'r':
+                                options.registerFile=optarg;
+                                break;
+                        case 'x':
+                                options.speed=atof(optarg);
+                                break;
+                        case 'D':
+                                options.duration=atof(optarg);
+                                break;
+                        case 'u':
+                                options.udpRate=atof(optarg);
+                                break;
+                        case 'T':
+                                options.tcpRate=atof(optarg);
+                                break;
+                        case 't':
+                                options.tcpClients=atoi(optarg);
+                                break;
+                        case 'p':
+                                options.port=atoi(optarg);
+                                break;
+                        default:
+                                usage(argv[0]);
+                                return 0;
+                }
+        }
+        if (iterations<=0) iterations=1;
+
+        if (replay)
+        {
+                if (options.speed<1) options.speed=1;
+                if (options.speed>1000) options.speed=1000;
+                if (options.tcpClients<0) options.tcpClients=0;
+                if (options.tcpClients>64) options.tcpClients=64;
+                options.commands=optind<argc?(const char**)argv+optind:replayCommands;
+                return replayRun(&options)?1:0;
+        }
+        return benchDispatch(iterations,optind<argc?(const char**)argv+optind:defaultCommands);
+}
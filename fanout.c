@@ -0,0 +1,376 @@
+#define _GNU_SOURCE /* accept4 */
+
+#include "fanout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static void releaseTelegram(Fanout* f, SharedTelegram* t)
+{
+        if (--t->refs==0) poolRelease(&f->telegrams,t);
+}
+
+static SharedTelegram* newTelegram(Fanout* f, const char* data, const int len)
+{
+        if (len>FANOUT_MESSAGESIZE) return 0;
+        SharedTelegram* t=poolAlloc(&f->telegrams);
+        if (!t) return 0;
+        t->refs=1;
+        t->len=len;
+        memcpy(t->data,data,len);
+        return t;
+}
+
+int fanoutInit(Fanout* f, const int maxClients, const int queueLen, const enum QueuePolicy policy, const size_t stateSize, const int debug)
+{
+        int i;
+        memset(f,0,sizeof(*f));
+        f->maxClients=maxClients;
+        /* Dropping needs room for a partly written telegram and a newer one */
+        f->queueLen=queueLen<2?2:(queueLen>FANOUT_MAXQUEUE?FANOUT_MAXQUEUE:queueLen);
+        f->policy=policy;
+        f->debug=debug;
+        f->clients=calloc(maxClients,sizeof(FanoutClient));
+        if (!f->clients) return -1;
+        for (i=0;i<maxClients;i++) f->clients[i].fd=-1;
+        /* Every queued telegram may be a different one, plus the one being
+         * published. A client has a reply and a subscription, and a new
+         * subscription while replacing one. */
+        if (poolInit(&f->telegrams,"telegrams",sizeof(SharedTelegram)+FANOUT_MESSAGESIZE,maxClients*f->queueLen+1)) return -1;
+        if (poolInit(&f->chunks,"chunks",FANOUT_CHUNKSIZE,maxClients)) return -1;
+        if (poolInit(&f->states,"states",stateSize,3*maxClients)) return -1;
+        return 0;
+}
+
+static void dropQueued(Fanout* f, FanoutClient* c, const int keep)
+{
+        /* Release the queued telegrams after the first keep */
+        while (c->count>keep)
+        {
+                c->count--;
+                releaseTelegram(f,c->queue[(c->head+c->count)%FANOUT_MAXQUEUE]);
+        }
+}
+
+static void endReply(Fanout* f, FanoutClient* c)
+{
+        poolRelease(&f->states,c->reply.state);
+        c->reply.fill=0;
+        c->reply.state=0;
+        c->chunkLen=0;
+        c->chunkOffset=0;
+}
+
+static void closeClient(Fanout* f, FanoutClient* c)
+{
+        if (f->debug) fprintf(stderr,"closing tcp connection fd=%i\n",c->fd);
+        close(c->fd);
+        c->fd=-1;
+        dropQueued(f,c,0);
+        c->head=0;
+        c->offset=0;
+        endReply(f,c);
+        poolRelease(&f->chunks,c->chunk);
+        c->chunk=0;
+        c->requestLen=0;
+        c->requested=0;
+        poolRelease(&f->states,c->subscription);
+        c->subscription=0;
+}
+
+void fanoutFree(Fanout* f)
+{
+        int i;
+        for (i=0;i<f->maxClients;i++)
+        {
+                if (f->clients[i].fd>=0) closeClient(f,&f->clients[i]);
+        }
+        free(f->clients);
+        f->clients=0;
+        poolFree(&f->telegrams);
+        poolFree(&f->chunks);
+        poolFree(&f->states);
+}
+
+FanoutClient* fanoutAccept(Fanout* f, const int listenfd)
+{
+        int i;
+        const int newsock=accept4(listenfd,0,0,SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (newsock==-1) return 0;
+
+        for (i=0;i<f->maxClients && f->clients[i].fd!=-1;i++);
+        if (i==f->maxClients)
+        {
+                /* Too many open sockets, reject */
+                close(newsock);
+                return 0;
+        }
+        f->clients[i].fd=newsock;
+        f->clients[i].generation++;
+        f->clients[i].dropped=0;
+        return &f->clients[i];
+}
+
+void fanoutHandover(Fanout* f, Handover* h, const size_t subscriptionSize)
+{
+        /* A client record holds whether it sent requests, and what was read
+         * of the next one */
+        char data[sizeof(int)+FANOUT_REQUESTSIZE];
+        int i, j;
+        for (i=0;i<f->maxClients;i++)
+        {
+                FanoutClient* c=&f->clients[i];
+                if (c->fd<0 || c->reply.fill) continue;
+                memcpy(data,&c->requested,sizeof(int));
+                memcpy(data+sizeof(int),c->request,c->requestLen);
+                if (handoverPut(h,HANDOVER_CLIENT,c->fd,data,sizeof(int)+c->requestLen)) return;
+                for (j=0;j<c->count;j++)
+                {
+                        const SharedTelegram* t=c->queue[(c->head+j)%FANOUT_MAXQUEUE];
+                        const int skip=j?0:c->offset;
+                        handoverPut(h,HANDOVER_QUEUED,-1,t->data+skip,t->len-skip);
+                }
+                if (c->subscription) handoverPut(h,HANDOVER_SUBSCRIPTION,-1,c->subscription,subscriptionSize);
+        }
+}
+
+FanoutClient* fanoutAdopt(Fanout* f, const HandoverRecord* r)
+{
+        int i;
+        int requested;
+        const int requestLen=r->len-sizeof(int);
+        if (requestLen<0 || requestLen>FANOUT_REQUESTSIZE)
+        {
+                close(r->fd);
+                return 0;
+        }
+        for (i=0;i<f->maxClients && f->clients[i].fd!=-1;i++);
+        if (i==f->maxClients)
+        {
+                close(r->fd);
+                return 0;
+        }
+        /* Still non-blocking, close-on-exec was cleared for the handover */
+        fcntl(r->fd,F_SETFD,FD_CLOEXEC);
+        FanoutClient* c=&f->clients[i];
+        c->fd=r->fd;
+        c->generation++;
+        c->dropped=0;
+        memcpy(&requested,r->data,sizeof(int));
+        c->requested=requested;
+        memcpy(c->request,r->data+sizeof(int),requestLen);
+        c->requestLen=requestLen;
+        return c;
+}
+
+static int sendSome(Fanout* f, FanoutClient* c, struct iovec* iov, const int count)
+{
+        /* Returns the number of bytes written, -1 if the socket is full or
+         * the client was closed */
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_iov=iov;
+        msg.msg_iovlen=count;
+        const int written=sendmsg(c->fd,&msg,MSG_NOSIGNAL);
+        if (written<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) closeClient(f,c);
+        if (written>=0) f->writes++;
+        return written;
+}
+
+static void flushClient(Fanout* f, FanoutClient* c)
+{
+        /* Write until the socket is full. A reply is written completely
+         * before queued telegrams, unless a telegram was partly written. */
+        struct iovec iov[FANOUT_MAXQUEUE];
+        for (;;)
+        {
+                if (c->reply.fill && !c->offset)
+                {
+                        if (c->chunkOffset==c->chunkLen)
+                        {
+                                c->chunkLen=c->reply.fill(c->reply.state,c->chunk,FANOUT_CHUNKSIZE);
+                                c->chunkOffset=0;
+                                if (c->chunkLen==0)
+                                {
+                                        endReply(f,c);
+                                        continue;
+                                }
+                        }
+                        iov[0].iov_base=c->chunk+c->chunkOffset;
+                        iov[0].iov_len=c->chunkLen-c->chunkOffset;
+                        const int written=sendSome(f,c,iov,1);
+                        if (written<0) return;
+                        c->chunkOffset+=written;
+                } else if (c->count) {
+                        /* All queued telegrams at once, straight from the
+                         * shared buffers */
+                        int i;
+                        for (i=0;i<c->count;i++)
+                        {
+                                SharedTelegram* t=c->queue[(c->head+i)%FANOUT_MAXQUEUE];
+                                const int skip=i?0:c->offset;
+                                iov[i].iov_base=t->data+skip;
+                                iov[i].iov_len=t->len-skip;
+                        }
+                        int written=sendSome(f,c,iov,c->count);
+                        if (written<0) return;
+                        /* Release the telegrams written completely */
+                        while (c->count && written>=c->queue[c->head]->len-c->offset)
+                        {
+                                written-=c->queue[c->head]->len-c->offset;
+                                releaseTelegram(f,c->queue[c->head]);
+                                c->head=(c->head+1)%FANOUT_MAXQUEUE;
+                                c->count--;
+                                c->offset=0;
+                        }
+                        c->offset+=written;
+                        if (c->offset) return;
+                } else {
+                        return;
+                }
+        }
+}
+
+static int fillNothing(void* state, char* buffer, const int size)
+{
+        /* The answer is in the chunk already */
+        return 0;
+}
+
+static void startReply(Fanout* f, FanoutClient* c, const char* line)
+{
+        if (f->debug) fprintf(stderr,"tcp request fd=%i '%s'\n",c->fd,line);
+        if (!c->chunk && !(c->chunk=poolAlloc(&f->chunks)))
+        {
+                closeClient(f,c);
+                return;
+        }
+        if (!c->requested)
+        {
+                /* No more telegrams, a partly written one is completed first */
+                c->requested=1;
+                dropQueued(f,c,c->offset?1:0);
+        }
+        f->requests++;
+        c->reply=f->onRequest(f->context,c,line);
+        if (!c->reply.fill)
+        {
+                /* No state for the reply, the client is not to wait for it */
+                f->busy++;
+                c->chunkLen=strlen(FANOUT_BUSY);
+                memcpy(c->chunk,FANOUT_BUSY,c->chunkLen);
+                c->reply.fill=fillNothing;
+        }
+        flushClient(f,c);
+}
+
+static void readRequests(Fanout* f, FanoutClient* c)
+{
+        /* Handle the request lines one at a time, while a reply is being
+         * written the rest waits. Otherwise read until EAGAIN, as there is
+         * no new event for data that is left. */
+        for (;;)
+        {
+                char* end;
+                while (c->fd>=0 && !c->reply.fill && (end=memchr(c->request,'\n',c->requestLen)))
+                {
+                        const int lineLen=end-c->request+1;
+                        *end='\0';
+                        if (end>c->request && end[-1]=='\r') end[-1]='\0';
+                        startReply(f,c,c->request);
+                        c->requestLen-=lineLen;
+                        memmove(c->request,c->request+lineLen,c->requestLen);
+                }
+                if (c->fd<0 || c->reply.fill) return;
+                if (c->requestLen==FANOUT_REQUESTSIZE)
+                {
+                        syslog(LOG_INFO,"tcp request too long, disconnecting");
+                        closeClient(f,c);
+                        return;
+                }
+                const int bytesRead=read(c->fd,c->request+c->requestLen,FANOUT_REQUESTSIZE-c->requestLen);
+                if (bytesRead==0 || (bytesRead<0 && errno!=EAGAIN && errno!=EWOULDBLOCK))
+                {
+                        closeClient(f,c);
+                        return;
+                }
+                if (bytesRead<0) return;
+                /* Without a request handler clients have nothing to say */
+                if (f->onRequest) c->requestLen+=bytesRead;
+        }
+}
+
+static int enqueue(Fanout* f, FanoutClient* c, SharedTelegram* t)
+{
+        /* Returns -1 if the client was closed */
+        if (c->count==f->queueLen)
+        {
+                if (f->policy==QUEUE_DISCONNECT)
+                {
+                        syslog(LOG_INFO,"tcp client %i telegrams behind, disconnecting",c->count);
+                        f->disconnects++;
+                        closeClient(f,c);
+                        return -1;
+                }
+                /* Drop the oldest telegram not being written, so the stream
+                 * only ever contains complete telegrams */
+                const int drop=c->offset?1:0;
+                int i;
+                releaseTelegram(f,c->queue[(c->head+drop)%FANOUT_MAXQUEUE]);
+                for (i=drop;i<c->count-1;i++)
+                {
+                        c->queue[(c->head+i)%FANOUT_MAXQUEUE]=c->queue[(c->head+i+1)%FANOUT_MAXQUEUE];
+                }
+                c->count--;
+                c->dropped++;
+                f->dropped++;
+        }
+        c->queue[(c->head+c->count)%FANOUT_MAXQUEUE]=t;
+        c->count++;
+        t->refs++;
+        return 0;
+}
+
+void fanoutPublish(Fanout* f, const char* data, const int len)
+{
+        int i;
+        SharedTelegram* t=0;
+        for (i=0;i<f->maxClients;i++)
+        {
+                FanoutClient* c=&f->clients[i];
+                if (c->fd<0 || c->requested) continue;
+                /* Only copied when there is someone to send it to */
+                if (!t && !(t=newTelegram(f,data,len))) return;
+                if (enqueue(f,c,t)==0) flushClient(f,c);
+        }
+        f->published++;
+        if (t) releaseTelegram(f,t);
+}
+
+void fanoutSend(Fanout* f, FanoutClient* c, const char* data, const int len)
+{
+        SharedTelegram* t=newTelegram(f,data,len);
+        if (!t) return;
+        if (enqueue(f,c,t)==0) flushClient(f,c);
+        releaseTelegram(f,t);
+}
+
+void fanoutHandleEvents(Fanout* f, FanoutClient* c, const uint32_t revents)
+{
+        if (revents & (POLLHUP|POLLERR))
+        {
+                closeClient(f,c);
+                return;
+        }
+        if (revents & POLLOUT) flushClient(f,c);
+        /* Also after a reply was written, requests may be waiting */
+        if (c->fd>=0 && (revents & POLLIN || c->requested)) readRequests(f,c);
+}
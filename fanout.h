@@ -0,0 +1,133 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "handover.h"
+#include "pool.h"
+
+#include <stdint.h>
+
+/* Copies of each P1 telegram for the TCP clients. A telegram is stored once,
+   in a reference counted buffer, and queued to every client. Sockets are
+   non-blocking: what a client can not take now is written when it becomes
+   writable again. When a client is queueLen telegrams behind, either its
+   oldest unsent telegram is dropped or the client is disconnected. The
+   telegrams queued to a client are written with one sendmsg, each straight
+   from its shared buffer. (MSG_ZEROCOPY does not pay for a telegram of about
+   1 kB: pinning the pages and reaping the completions costs more than the
+   copy into the socket.)
+
+   A client may also send request lines. From its first request on it no
+   longer gets telegrams, only replies, and what is sent to it alone with
+   fanoutSend, which is queued like telegrams. A reply is produced in chunks,
+   each when the previous one was written, and the next request is handled
+   when the reply is complete.
+
+   Telegrams, reply chunks and the states of replies and subscriptions come
+   from pools sized for maxClients, so serving clients needs no heap.
+ */
+
+#define FANOUT_MAXQUEUE    64
+#define FANOUT_REQUESTSIZE 256  /* Longest request line */
+#define FANOUT_CHUNKSIZE   4096
+#define FANOUT_MESSAGESIZE 4096 /* Longest telegram, or data for one client */
+#define FANOUT_BUSY        "busy\n" /* Answer when there is no room for a reply */
+
+enum QueuePolicy { QUEUE_DROP_OLDEST, QUEUE_DISCONNECT };
+
+typedef struct
+{
+        int  refs;
+        int  len;
+        char data[];
+} SharedTelegram;
+
+/* Writes the next chunk of a reply, at most size bytes, and returns the
+   number of bytes written, 0 when the reply is complete */
+typedef int (*FanoutFill)(void* state, char* buffer, const int size);
+
+typedef struct
+{
+        FanoutFill fill;        /* 0 if there is no reply */
+        void*      state;       /* From states, released when the reply is complete */
+} FanoutReply;
+
+struct FanoutClient;
+
+/* Starts the reply to a request line of client c. A reply without fill, when
+   no state was available, is answered with FANOUT_BUSY. */
+typedef FanoutReply (*FanoutRequest)(void* context, struct FanoutClient* c, const char* line);
+
+typedef struct FanoutClient
+{
+        int             fd;     /* -1 if not in use */
+        SharedTelegram* queue[FANOUT_MAXQUEUE];
+        int             head;
+        int             count;
+        int             offset; /* Bytes of queue[head] written */
+        unsigned        generation;     /* Incremented for each new connection in this slot */
+        unsigned long   dropped;
+
+        /* Requests */
+        char            request[FANOUT_REQUESTSIZE];
+        int             requestLen;
+        int             requested;      /* Sent a request, gets no telegrams */
+        FanoutReply     reply;
+        char*           chunk;          /* FANOUT_CHUNKSIZE, from chunks on the first request */
+        int             chunkLen;
+        int             chunkOffset;
+        void*           subscription;   /* Set by the request handler from states, released on close */
+} FanoutClient;
+
+typedef struct
+{
+        FanoutClient*    clients;
+        int              maxClients;
+        int              queueLen;
+        enum QueuePolicy policy;
+        int              debug;
+        FanoutRequest    onRequest;     /* 0 if requests are not handled */
+        void*            context;       /* Passed to onRequest */
+        Pool             telegrams;     /* SharedTelegram of FANOUT_MESSAGESIZE */
+        Pool             chunks;
+        Pool             states;        /* Reply states and subscriptions */
+
+        /* Statistics */
+        unsigned long    published;
+        unsigned long    dropped;       /* Telegrams dropped for slow clients */
+        unsigned long    disconnects;   /* Clients disconnected for being slow */
+        unsigned long    requests;
+        unsigned long    busy;          /* Requests answered with FANOUT_BUSY */
+        unsigned long    writes;        /* sendmsg calls that wrote to a client */
+} Fanout;
+
+/* stateSize is the largest reply state or subscription. Returns -1 if no
+   memory is available. */
+int fanoutInit(Fanout* f, const int maxClients, const int queueLen, const enum QueuePolicy policy, const size_t stateSize, const int debug);
+void fanoutFree(Fanout* f);
+
+/* Accept a connection on the listening socket, it is closed right away when
+   there are too many clients. Returns the new client or 0. */
+FanoutClient* fanoutAccept(Fanout* f, const int listenfd);
+
+/* Put the clients in the state for a new instance of the program, with
+   what is queued to them and their subscription of subscriptionSize bytes.
+   A client in the middle of a reply can not be continued and is left out,
+   it is closed on the exec. */
+void fanoutHandover(Fanout* f, Handover* h, const size_t subscriptionSize);
+
+/* Take over a client from the HANDOVER_CLIENT record of the previous
+   instance; the records after it are for this client. Returns the client, or
+   0 if there are too many clients and it was closed. */
+FanoutClient* fanoutAdopt(Fanout* f, const HandoverRecord* r);
+
+/* Queue a telegram to all clients, and write as much of it as possible */
+void fanoutPublish(Fanout* f, const char* data, const int len);
+
+/* Queue data to client c only, like a telegram. May close the client. */
+void fanoutSend(Fanout* f, FanoutClient* c, const char* data, const int len);
+
+/* Handle (edge triggered) epoll events on the client's fd, may close the
+   client */
+void fanoutHandleEvents(Fanout* f, FanoutClient* c, const uint32_t revents);
+
+#endif // FANOUT_H
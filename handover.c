@@ -0,0 +1,243 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "handover.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define HANDOVER_MAGIC "P1HO"
+#define HANDOVER_ALIGN 8
+
+typedef struct
+{
+        char     magic[4];
+        uint32_t version;
+} StateHeader;
+
+typedef struct
+{
+        uint32_t type;
+        int32_t  fd;
+        uint32_t len;
+        uint32_t taken;
+} RecordHeader;
+
+static size_t padded(const size_t len)
+{
+        return (len+HANDOVER_ALIGN-1)&~(size_t)(HANDOVER_ALIGN-1);
+}
+
+int handoverCreate(Handover* h)
+{
+        memset(h,0,sizeof(*h));
+        h->fd=memfd_create("handover",0);
+        if (h->fd<0)
+        {
+                perror("Creating handover state");
+                return -1;
+        }
+        StateHeader header;
+        memcpy(header.magic,HANDOVER_MAGIC,sizeof(header.magic));
+        header.version=HANDOVER_VERSION;
+        if (write(h->fd,&header,sizeof(header))!=sizeof(header))
+        {
+                perror("Writing handover state");
+                close(h->fd);
+                h->fd=-1;
+                return -1;
+        }
+        return 0;
+}
+
+int handoverPut(Handover* h, const enum HandoverType type, const int fd, const void* data, const uint32_t len)
+{
+        static const char zeros[HANDOVER_ALIGN];
+        RecordHeader header={type,fd,len,0};
+        struct iovec iov[3]=
+        {
+                {&header,sizeof(header)},
+                {(void*)data,len},
+                {(void*)zeros,padded(len)-len},
+        };
+        const ssize_t size=sizeof(header)+padded(len);
+        if (h->fd<0) return -1;
+        /* The fd is to survive the exec */
+        if ((fd>=0 && fcntl(fd,F_SETFD,0)<0) || writev(h->fd,iov,3)!=size)
+        {
+                /* A partial state would lose what is missing, drop it all */
+                perror("Writing handover state");
+                close(h->fd);
+                h->fd=-1;
+                return -1;
+        }
+        return 0;
+}
+
+static int recordAt(const Handover* h, const size_t offset, RecordHeader** header);
+
+static void keepFds(Handover* h)
+{
+        /* The exec failed, the fds of the state are this instance's again
+         * and are not to leak into programs it may start */
+        RecordHeader* header;
+        size_t offset=sizeof(StateHeader);
+        int size;
+        struct stat st;
+        if (fstat(h->fd,&st)<0) return;
+        h->memory=mmap(0,st.st_size,PROT_READ,MAP_SHARED,h->fd,0);
+        if (h->memory==MAP_FAILED)
+        {
+                h->memory=0;
+                return;
+        }
+        h->size=st.st_size;
+        for (;(size=recordAt(h,offset,&header));offset+=size)
+        {
+                if (header->fd>=0) fcntl(header->fd,F_SETFD,FD_CLOEXEC);
+        }
+        munmap(h->memory,h->size);
+        h->memory=0;
+}
+
+void handoverExec(Handover* h, char* const* argv)
+{
+        char number[16];
+        if (h->fd<0)
+        {
+                syslog(LOG_ERR,"Reload failed, no state to hand over");
+                return;
+        }
+        snprintf(number,sizeof(number),"%d",h->fd);
+        setenv(HANDOVER_ENV,number,1);
+        execvp(argv[0],argv);
+        syslog(LOG_ERR,"Reload failed, executing %s: %m",argv[0]);
+        perror("Reloading");
+        unsetenv(HANDOVER_ENV);
+        keepFds(h);
+        close(h->fd);
+        h->fd=-1;
+}
+
+int handoverOpen(Handover* h)
+{
+        const char* number=getenv(HANDOVER_ENV);
+        struct stat st;
+        memset(h,0,sizeof(*h));
+        h->fd=-1;
+        if (!number) return 0;
+        /* Not for processes started later */
+        unsetenv(HANDOVER_ENV);
+        const int fd=atoi(number);
+        if (fstat(fd,&st)<0 || st.st_size<(off_t)sizeof(StateHeader))
+        {
+                syslog(LOG_WARNING,"No state handed over in fd %s",number);
+                return 0;
+        }
+        /* Private, so taking records can be marked */
+        char* memory=mmap(0,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+        if (memory==MAP_FAILED)
+        {
+                perror("Mapping handover state");
+                close(fd);
+                return 0;
+        }
+        StateHeader header;
+        memcpy(&header,memory,sizeof(header));
+        if (memcmp(header.magic,HANDOVER_MAGIC,sizeof(header.magic)) || header.version!=HANDOVER_VERSION)
+        {
+                syslog(LOG_WARNING,"Ignoring handover state of version %u",header.version);
+                munmap(memory,st.st_size);
+                close(fd);
+                return 0;
+        }
+        h->fd=fd;
+        h->memory=memory;
+        h->size=st.st_size;
+        h->next=sizeof(StateHeader);
+        return 1;
+}
+
+static int recordAt(const Handover* h, const size_t offset, RecordHeader** header)
+{
+        /* Size of the record at offset, 0 at the end */
+        if (!h->memory || offset+sizeof(RecordHeader)>h->size) return 0;
+        *header=(RecordHeader*)(h->memory+offset);
+        const size_t size=sizeof(RecordHeader)+padded((*header)->len);
+        return offset+size<=h->size?size:0;
+}
+
+static void take(RecordHeader* header, HandoverRecord* r)
+{
+        r->type=header->type;
+        r->fd=header->fd;
+        r->len=header->len;
+        r->data=(const char*)(header+1);
+        header->fd=-1;
+        header->taken=1;
+}
+
+int handoverHasFd(const Handover* h, const int fd)
+{
+        RecordHeader* header;
+        size_t offset=sizeof(StateHeader);
+        int size;
+        if (h->fd<0) return 0;
+        if (fd==h->fd) return 1;
+        for (;(size=recordAt(h,offset,&header));offset+=size)
+        {
+                if (header->fd==fd) return 1;
+        }
+        return 0;
+}
+
+int handoverNext(Handover* h, HandoverRecord* r)
+{
+        RecordHeader* header;
+        int size;
+        while ((size=recordAt(h,h->next,&header)))
+        {
+                h->next+=size;
+                if (header->taken) continue;
+                take(header,r);
+                return 1;
+        }
+        return 0;
+}
+
+int handoverFind(Handover* h, const enum HandoverType type, HandoverRecord* r)
+{
+        RecordHeader* header;
+        size_t offset=sizeof(StateHeader);
+        int size;
+        for (;(size=recordAt(h,offset,&header));offset+=size)
+        {
+                if (header->type==type && !header->taken)
+                {
+                        take(header,r);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+void handoverClose(Handover* h)
+{
+        RecordHeader* header;
+        size_t offset=sizeof(StateHeader);
+        int size;
+        if (h->fd<0) return;
+        for (;(size=recordAt(h,offset,&header));offset+=size)
+        {
+                if (header->fd>=0) close(header->fd);
+        }
+        munmap(h->memory,h->size);
+        close(h->fd);
+        h->memory=0;
+        h->fd=-1;
+}
@@ -0,0 +1,77 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reloading without dropping anything. On SIGHUP the program executes
+   itself again, so a new binary and the configuration are read, and hands
+   its state to the new instance. Sockets and the serial device are inherited
+   across the exec: clients do not notice. The rest goes in records in a
+   memfd whose number is passed in the environment.
+
+   A record has a type, an fd (-1 if none) and data. The new instance takes
+   the records it can use; fds of records it did not take are closed by
+   handoverClose. A state of another version is ignored, and the program
+   starts afresh.
+ */
+
+#define HANDOVER_ENV     "POWERMONITOR_HANDOVER"
+#define HANDOVER_VERSION 1
+
+enum HandoverType
+{
+        HANDOVER_UDP,           /* Query socket */
+        HANDOVER_LISTEN,        /* TCP listening socket */
+        HANDOVER_METRICS,       /* Metrics listening socket */
+        HANDOVER_SERIAL,        /* Device name, 0, data read after the last telegram */
+        HANDOVER_TELEGRAM,      /* struct timespec received, telegram */
+        HANDOVER_CLIENT,        /* TCP client, see fanoutHandover */
+        HANDOVER_QUEUED,        /* Data queued to the preceding client */
+        HANDOVER_SUBSCRIPTION,  /* Of the preceding client */
+        HANDOVER_SAMPLES,       /* Samples of the time windows */
+};
+
+typedef struct
+{
+        uint32_t    type;
+        int         fd;
+        uint32_t    len;
+        const char* data;       /* In the state, valid until handoverClose */
+} HandoverRecord;
+
+typedef struct
+{
+        int     fd;             /* memfd, -1 if there is none */
+        char*   memory;         /* Mapped state of the previous instance */
+        size_t  size;
+        size_t  next;           /* Offset of the next record to read */
+} Handover;
+
+/* Writing, by the running instance. Return -1 on failure, the state is then
+   dropped and handoverExec does not execute. */
+int handoverCreate(Handover* h);
+int handoverPut(Handover* h, const enum HandoverType type, const int fd, const void* data, const uint32_t len);
+
+/* Execute argv with the state, returns only if that failed; the state is
+   dropped then and the program keeps running */
+void handoverExec(Handover* h, char* const* argv);
+
+/* Reading, by the new instance: 1 if a state was handed over, else 0 */
+int handoverOpen(Handover* h);
+
+/* The fd belongs to the state, to keep open while starting */
+int handoverHasFd(const Handover* h, const int fd);
+
+/* Next record in order not taken yet, 0 at the end. Its fd is now the
+   caller's. */
+int handoverNext(Handover* h, HandoverRecord* r);
+
+/* First record of type not taken yet, 0 if there is none. Its fd is now
+   the caller's. */
+int handoverFind(Handover* h, const enum HandoverType type, HandoverRecord* r);
+
+/* Close the fds not taken and the state */
+void handoverClose(Handover* h);
+
+#endif // HANDOVER_H
@@ -0,0 +1,70 @@
+#include "histogram.h"
+
+#define HALF (HISTOGRAM_SUBBUCKETS/2)
+
+static int bucketOf(const uint64_t value)
+{
+        if (value<HISTOGRAM_SUBBUCKETS) return value;
+        /* The top HISTOGRAM_SUBBITS bits of value select the bucket */
+        const int shift=63-__builtin_clzll(value)-(HISTOGRAM_SUBBITS-1);
+        return HISTOGRAM_SUBBUCKETS+(shift-1)*HALF+(int)(value>>shift)-HALF;
+}
+
+static uint64_t highestOf(const int bucket)
+{
+        /* Highest value counted in bucket */
+        if (bucket<HISTOGRAM_SUBBUCKETS) return bucket;
+        const int shift=(bucket-HISTOGRAM_SUBBUCKETS)/HALF+1;
+        const uint64_t sub=(bucket-HISTOGRAM_SUBBUCKETS)%HALF+HALF;
+        return ((sub+1)<<shift)-1;
+}
+
+void histogramRecordN(Histogram* h, uint64_t value, const uint64_t n)
+{
+        if (!n) return;
+        if (value>HISTOGRAM_MAXVALUE) value=HISTOGRAM_MAXVALUE;
+        h->counts[bucketOf(value)]+=n;
+        if (!h->count || value<h->min) h->min=value;
+        if (value>h->max) h->max=value;
+        h->count+=n;
+        h->sum+=value*n;
+}
+
+void histogramRecord(Histogram* h, const uint64_t value)
+{
+        histogramRecordN(h,value,1);
+}
+
+void histogramRecordInterval(Histogram* h, const struct timespec* start, const struct timespec* end)
+{
+        const int64_t ns=(int64_t)(end->tv_sec-start->tv_sec)*1000000000+(end->tv_nsec-start->tv_nsec);
+        histogramRecord(h,ns>0?ns:0);
+}
+
+void histogramRecordSince(Histogram* h, const struct timespec* start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        histogramRecordInterval(h,start,&now);
+}
+
+uint64_t histogramPercentile(const Histogram* h, const double percentile)
+{
+        /* The first bucket where the running count reaches the percentile */
+        const double wanted=h->count*percentile/100;
+        uint64_t seen=0;
+        int i;
+        if (!h->count) return 0;
+        for (i=0;i<HISTOGRAM_BUCKETS;i++)
+        {
+                seen+=h->counts[i];
+                if (seen>0 && seen>=wanted) break;
+        }
+        const uint64_t value=i<HISTOGRAM_BUCKETS?highestOf(i):h->max;
+        return value<h->max?(value>h->min?value:h->min):h->max;
+}
+
+double histogramMean(const Histogram* h)
+{
+        return h->count?(double)h->sum/h->count:0;
+}
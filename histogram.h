@@ -0,0 +1,44 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* HDR style histogram of durations in ns, or of counts. Values below
+   HISTOGRAM_SUBBUCKETS have a bucket each; above that every power of two is
+   split into HISTOGRAM_SUBBUCKETS/2 buckets, so a value is known within about
+   3% from 1 ns up to HISTOGRAM_MAXVALUE (18 minutes). Recording a value is a
+   few instructions and the size is fixed, so histograms can be kept up to
+   date all the time.
+ */
+
+#define HISTOGRAM_SUBBITS     5
+#define HISTOGRAM_SUBBUCKETS  (1<<HISTOGRAM_SUBBITS)
+#define HISTOGRAM_MAXBITS     40
+#define HISTOGRAM_MAXVALUE    ((1ull<<HISTOGRAM_MAXBITS)-1)     /* Larger values are counted as this */
+#define HISTOGRAM_BUCKETS     (HISTOGRAM_SUBBUCKETS+(HISTOGRAM_MAXBITS-HISTOGRAM_SUBBITS)*HISTOGRAM_SUBBUCKETS/2)
+
+typedef struct
+{
+        uint32_t counts[HISTOGRAM_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+} Histogram;
+
+/* Record n times value */
+void histogramRecordN(Histogram* h, uint64_t value, const uint64_t n);
+void histogramRecord(Histogram* h, const uint64_t value);
+
+/* Record the time from start to end, or since start (CLOCK_MONOTONIC) in ns */
+void histogramRecordInterval(Histogram* h, const struct timespec* start, const struct timespec* end);
+void histogramRecordSince(Histogram* h, const struct timespec* start);
+
+/* Highest value of the bucket holding the given percentile (0..100), at most
+   the maximum recorded. 0 if nothing was recorded. */
+uint64_t histogramPercentile(const Histogram* h, const double percentile);
+
+double histogramMean(const Histogram* h);
+
+#endif // HISTOGRAM_H
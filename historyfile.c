@@ -0,0 +1,282 @@
+#include "historyfile.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HISTORY_MAGIC   0x48503153      /* "S1PH" */
+#define HISTORY_VERSION 1
+
+const char* seriesNames[SERIES_COUNT]={ "use", "prod", "net", "sunspec", "consumption" };
+const char* energyNames[ENERGY_COUNT]={ "usedtariff1", "usedtariff2", "producedtariff1", "producedtariff2", "sunspecenergy", "gas" };
+const int tierSeconds[TIER_COUNT]={ 0, 60, 15*60, 3600 };
+const char* tierNames[TIER_COUNT]={ "raw", "1m", "15m", "1h" };
+
+static uint32_t checksum(const RecordHeader* r, const uint32_t recordSize)
+{
+        /* FNV-1a over everything after the checksum field */
+        const unsigned char* p=(const unsigned char*)&r->time;
+        const unsigned char* end=(const unsigned char*)r+recordSize;
+        uint32_t h=2166136261u;
+        for (;p<end;p++)
+        {
+                h^=*p;
+                h*=16777619u;
+        }
+        return h;
+}
+
+static RecordHeader* record(const HistoryFile* h, const uint64_t n)
+{
+        return (RecordHeader*)(h->records+(n%h->header->capacity)*h->header->recordSize);
+}
+
+static int validRecord(const HistoryFile* h, const uint64_t n)
+{
+        const RecordHeader* r=record(h,n);
+        return r->seq==(uint32_t)n && r->checksum==checksum(r,h->header->recordSize);
+}
+
+static void recover(HistoryFile* h)
+{
+        /* Forget the newest records if they did not make it to disk */
+        HistoryHeader* hdr=h->header;
+        const uint64_t count=hdr->count;
+        while (hdr->count>historyOldest(h) && !validRecord(h,hdr->count-1)) hdr->count--;
+        if (hdr->count!=count) syslog(LOG_INFO,"history: dropped %llu incomplete records",(unsigned long long)(count-hdr->count));
+}
+
+int historyOpen(HistoryFile* h, const char* path, const uint32_t recordSize, const uint32_t capacity)
+{
+        struct stat st;
+        HistoryHeader hdr;
+        memset(h,0,sizeof(*h));
+        h->fd=open(path,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+        if (h->fd==-1 || fstat(h->fd,&st)==-1)
+        {
+                perror(path);
+                return -1;
+        }
+        if (st.st_size==0)
+        {
+                /* New file */
+                memset(&hdr,0,sizeof(hdr));
+                hdr.magic=HISTORY_MAGIC;
+                hdr.version=HISTORY_VERSION;
+                hdr.recordSize=recordSize;
+                hdr.capacity=capacity;
+                if (pwrite(h->fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) ||
+                                ftruncate(h->fd,sizeof(hdr)+(off_t)capacity*recordSize)==-1)
+                {
+                        perror(path);
+                        goto fail;
+                }
+        } else if (pread(h->fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || hdr.magic!=HISTORY_MAGIC ||
+                        hdr.version!=HISTORY_VERSION || hdr.recordSize!=recordSize || hdr.capacity==0 ||
+                        st.st_size<(off_t)(sizeof(hdr)+(off_t)hdr.capacity*recordSize)) {
+                fprintf(stderr,"%s: not a history file of this version\n",path);
+                goto fail;
+        }
+        if (hdr.capacity!=capacity) syslog(LOG_INFO,"history: %s keeps its capacity of %u records",path,hdr.capacity);
+
+        h->mapSize=sizeof(hdr)+(size_t)hdr.capacity*recordSize;
+        void* map=mmap(0,h->mapSize,PROT_READ|PROT_WRITE,MAP_SHARED,h->fd,0);
+        if (map==MAP_FAILED)
+        {
+                perror("mmap history");
+                goto fail;
+        }
+        h->header=map;
+        h->records=(unsigned char*)map+sizeof(HistoryHeader);
+        recover(h);
+        return 0;
+fail:
+        close(h->fd);
+        h->fd=-1;
+        return -1;
+}
+
+void historyClose(HistoryFile* h)
+{
+        if (!h->header) return;
+        msync(h->header,h->mapSize,MS_SYNC);
+        munmap(h->header,h->mapSize);
+        close(h->fd);
+        h->header=0;
+        h->records=0;
+        h->fd=-1;
+}
+
+void historyAppend(HistoryFile* h, RecordHeader* r)
+{
+        HistoryHeader* hdr=h->header;
+        const uint64_t n=hdr->count;
+        RecordHeader* dst=record(h,n);
+        r->seq=(uint32_t)n;
+        /* Copied with memcpy so the checksum covers the padding as written */
+        memcpy(dst,r,hdr->recordSize);
+        dst->checksum=checksum(dst,hdr->recordSize);
+        r->checksum=dst->checksum;
+        /* The count only covers the record once it is complete */
+        __atomic_store_n(&hdr->count,n+1,__ATOMIC_RELEASE);
+}
+
+uint64_t historyOldest(const HistoryFile* h)
+{
+        const HistoryHeader* hdr=h->header;
+        return hdr->count>hdr->capacity?hdr->count-hdr->capacity:0;
+}
+
+uint64_t historyCount(const HistoryFile* h)
+{
+        return h->header->count;
+}
+
+const RecordHeader* historyRecord(const HistoryFile* h, const uint64_t n)
+{
+        return record(h,n);
+}
+
+uint64_t historyFind(const HistoryFile* h, const double time)
+{
+        uint64_t low=historyOldest(h);
+        uint64_t high=historyCount(h);
+        while (low<high)
+        {
+                const uint64_t mid=low+(high-low)/2;
+                if (historyRecord(h,mid)->time<time) low=mid+1;
+                else high=mid;
+        }
+        return low;
+}
+
+static void rollupStart(RollupState* st, const double start)
+{
+        int i;
+        memset(st,0,sizeof(*st));
+        st->r.h.time=start;
+        for (i=0;i<SERIES_COUNT;i++)
+        {
+                st->r.min[i]=NAN;
+                st->r.max[i]=NAN;
+        }
+        for (i=0;i<ENERGY_COUNT;i++)
+        {
+                st->r.first[i]=NAN;
+                st->r.last[i]=NAN;
+        }
+}
+
+static void rollupAdd(RollupState* st, const HistoryRecord* r)
+{
+        int i;
+        st->r.samples++;
+        for (i=0;i<SERIES_COUNT;i++)
+        {
+                const float v=r->power[i];
+                if (isnan(v)) continue;
+                if (!(v>=st->r.min[i])) st->r.min[i]=v;
+                if (!(v<=st->r.max[i])) st->r.max[i]=v;
+                st->sum[i]+=v;
+                st->count[i]++;
+        }
+        for (i=0;i<ENERGY_COUNT;i++)
+        {
+                const double v=r->energy[i];
+                if (isnan(v)) continue;
+                if (isnan(st->r.first[i])) st->r.first[i]=v;
+                st->r.last[i]=v;
+        }
+}
+
+static void rollupStore(HistoryFile* f, RollupState* st)
+{
+        int i;
+        for (i=0;i<SERIES_COUNT;i++)
+        {
+                st->r.mean[i]=st->count[i]?st->sum[i]/st->count[i]:NAN;
+        }
+        historyAppend(f,&st->r.h);
+}
+
+static void rollupResume(HistoryStore* s, const int t)
+{
+        /* The period of the newest raw record was not stored yet, unless
+         * the clock went back. Add the raw records of it again, so the next
+         * record continues it. */
+        const HistoryFile* raw=&s->files[TIER_RAW];
+        const HistoryFile* f=&s->files[t];
+        RollupState* st=&s->rollup[t];
+        uint64_t n;
+        if (historyCount(raw)==historyOldest(raw)) return;
+        const double newest=historyRecord(raw,historyCount(raw)-1)->time;
+        const double start=floor(newest/tierSeconds[t])*tierSeconds[t];
+        if (historyCount(f)>historyOldest(f) && historyRecord(f,historyCount(f)-1)->time>=start) return;
+        rollupStart(st,start);
+        for (n=historyFind(raw,start);n<historyCount(raw);n++)
+        {
+                rollupAdd(st,(const HistoryRecord*)historyRecord(raw,n));
+        }
+}
+
+int historyStoreOpen(HistoryStore* s, const char* path, const unsigned* days)
+{
+        int t;
+        memset(s,0,sizeof(*s));
+        for (t=0;t<TIER_COUNT;t++)
+        {
+                s->files[t].fd=-1;
+        }
+        for (t=0;t<TIER_COUNT;t++)
+        {
+                char name[4096];
+                const uint32_t recordSize=t==TIER_RAW?sizeof(HistoryRecord):sizeof(RollupRecord);
+                /* Raw records come in about once a second */
+                const uint32_t capacity=days[t]*(86400/(t==TIER_RAW?1:tierSeconds[t]));
+                if (t==TIER_RAW) snprintf(name,sizeof(name),"%s",path);
+                else snprintf(name,sizeof(name),"%s.%s",path,tierNames[t]);
+                if (historyOpen(&s->files[t],name,recordSize,capacity))
+                {
+                        historyStoreClose(s);
+                        return -1;
+                }
+        }
+        for (t=TIER_RAW+1;t<TIER_COUNT;t++)
+        {
+                rollupResume(s,t);
+        }
+        return 0;
+}
+
+void historyStoreClose(HistoryStore* s)
+{
+        int t;
+        for (t=0;t<TIER_COUNT;t++)
+        {
+                historyClose(&s->files[t]);
+        }
+}
+
+void historyStoreAppend(HistoryStore* s, HistoryRecord* r)
+{
+        int t;
+        historyAppend(&s->files[TIER_RAW],&r->h);
+        for (t=TIER_RAW+1;t<TIER_COUNT;t++)
+        {
+                RollupState* st=&s->rollup[t];
+                const double start=floor(r->h.time/tierSeconds[t])*tierSeconds[t];
+                if (st->r.h.time!=start)
+                {
+                        /* New period, store the previous one */
+                        if (st->r.samples) rollupStore(&s->files[t],st);
+                        rollupStart(st,start);
+                }
+                rollupAdd(st,r);
+        }
+}
@@ -0,0 +1,138 @@
+#ifndef HISTORYFILE_H
+#define HISTORYFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Series kept in the history, one sample per P1 telegram, in W */
+enum HistorySeries
+{
+        SERIES_USE,             /* P1 power used */
+        SERIES_PROD,            /* P1 power produced */
+        SERIES_NET,             /* P1 used - produced */
+        SERIES_SUNSPEC,         /* SunSpec production, all devices */
+        SERIES_CONSUMPTION,     /* Net + SunSpec production */
+        SERIES_COUNT
+};
+
+/* Meter readings stored with each sample */
+enum EnergyCounter
+{
+        ENERGY_USED_TARIFF1,    /* 1-0:1.8.1, kWh */
+        ENERGY_USED_TARIFF2,    /* 1-0:1.8.2, kWh */
+        ENERGY_PRODUCED_TARIFF1,/* 1-0:2.8.1, kWh */
+        ENERGY_PRODUCED_TARIFF2,/* 1-0:2.8.2, kWh */
+        ENERGY_SUNSPEC,         /* I_AC_Energy_WH, all devices, Wh */
+        ENERGY_GAS,             /* 0-1:24.2.1, m3 */
+        ENERGY_COUNT
+};
+
+extern const char* seriesNames[SERIES_COUNT];
+extern const char* energyNames[ENERGY_COUNT];
+
+/* Stored history, in tiers: each telegram, and rollups per minute, quarter
+   and hour. Each tier is kept in its own file, with its own retention. */
+enum HistoryTier { TIER_RAW, TIER_1M, TIER_15M, TIER_1H, TIER_COUNT };
+
+extern const int tierSeconds[TIER_COUNT];      /* 0 for TIER_RAW */
+extern const char* tierNames[TIER_COUNT];
+
+/* History file: a header followed by a ring of fixed size records, mapped
+   into memory. A record is written first, then the record count in the
+   header is incremented. Each record carries its own number and a checksum,
+   so after a crash a record whose page did not reach the disk is recognised
+   and the count is set back. The records are in time order, so a time range
+   is found by binary search.
+ */
+
+/* Start of every record */
+typedef struct
+{
+        uint32_t seq;           /* Low 32 bits of the record number */
+        uint32_t checksum;      /* FNV-1a of the record from time on */
+        double   time;          /* Seconds, CLOCK_REALTIME */
+} RecordHeader;
+
+/* TIER_RAW: one record per telegram */
+typedef struct
+{
+        RecordHeader h;
+        float    power[SERIES_COUNT];
+        double   energy[ENERGY_COUNT];      /* NAN if unknown */
+} HistoryRecord;
+
+/* Other tiers: one record per period, h.time is the start of the period */
+typedef struct
+{
+        RecordHeader h;
+        uint32_t samples;
+        float    min[SERIES_COUNT];
+        float    max[SERIES_COUNT];
+        float    mean[SERIES_COUNT];
+        double   first[ENERGY_COUNT];       /* Meter readings at start and end */
+        double   last[ENERGY_COUNT];
+} RollupRecord;
+
+typedef struct
+{
+        uint32_t magic;
+        uint32_t version;
+        uint32_t recordSize;
+        uint32_t capacity;      /* Records in the ring */
+        uint64_t count;         /* Records written, the newest is count-1 */
+        uint8_t  reserved[40];  /* Header is 64 bytes */
+} HistoryHeader;
+
+typedef struct
+{
+        int            fd;
+        size_t         mapSize;
+        HistoryHeader* header;  /* 0 if no file is open */
+        unsigned char* records;
+} HistoryFile;
+
+/* Open or create a file of records of recordSize bytes, starting with a
+   RecordHeader. An existing file keeps its capacity. Returns -1 on failure. */
+int historyOpen(HistoryFile* h, const char* path, const uint32_t recordSize, const uint32_t capacity);
+void historyClose(HistoryFile* h);
+
+/* Store r as the newest record, seq and checksum are filled in. Clear r with
+   memset before filling it, the padding is part of the checksum. */
+void historyAppend(HistoryFile* h, RecordHeader* r);
+
+/* Numbers of the oldest record and one past the newest */
+uint64_t historyOldest(const HistoryFile* h);
+uint64_t historyCount(const HistoryFile* h);
+
+const RecordHeader* historyRecord(const HistoryFile* h, const uint64_t n);
+
+/* Number of the first record at or after time, historyCount() if none */
+uint64_t historyFind(const HistoryFile* h, const double time);
+
+/* Period being rolled up for a tier */
+typedef struct
+{
+        RollupRecord r;
+        double       sum[SERIES_COUNT];
+        uint32_t     count[SERIES_COUNT];
+} RollupState;
+
+/* All tiers, the files are named <path>, <path>.1m, <path>.15m, <path>.1h */
+typedef struct
+{
+        HistoryFile files[TIER_COUNT];
+        RollupState rollup[TIER_COUNT];
+} HistoryStore;
+
+/* Open the files, days gives the retention of each tier for new files. The
+   periods being rolled up are rebuilt from the raw records, so after a
+   restart they are continued rather than lost or stored twice. Returns -1 on
+   failure. */
+int historyStoreOpen(HistoryStore* s, const char* path, const unsigned* days);
+void historyStoreClose(HistoryStore* s);
+
+/* Store a telegram's record, and add it to the periods being rolled up. A
+   period is stored when the first record of the next one arrives. */
+void historyStoreAppend(HistoryStore* s, HistoryRecord* r);
+
+#endif // HISTORYFILE_H
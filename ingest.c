@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "ingest.h"
+#include "interface.h"
+
+/* Set in latest while the slot there was not taken yet */
+#define INGEST_FRESH 4
+#define INGEST_SLOT  3
+
+static void publish(SerialIngest* in)
+{
+        /* The slot being filled becomes the latest, the thread continues
+         * with the one that was latest. Replaced while fresh means the event
+         * loop never saw it. */
+        const unsigned old=atomic_exchange(&in->latest,(unsigned)in->writing|INGEST_FRESH);
+        if (old&INGEST_FRESH) atomic_fetch_add(&in->replaced,1);
+        in->writing=old&INGEST_SLOT;
+        const uint64_t one=1;
+        if (write(in->eventfd,&one,sizeof(one))!=sizeof(one) && in->debug) perror("eventfd write");
+}
+
+static void completeTelegram(SerialIngest* in, const struct timespec* start)
+{
+        /* Move the telegram to a snapshot and parse it there, data read
+         * after it stays in the buffer */
+        P1Snapshot* s=&in->slots[in->writing];
+        const int len=in->reader.end;
+        s->start=*start;
+        clock_gettime(CLOCK_MONOTONIC,&s->end);
+        clock_gettime(CLOCK_REALTIME,&s->received);
+        memcpy(s->data,in->buffer,len);
+        s->data[len]='\0';
+        in->count-=len;
+        memmove(in->buffer,in->buffer+len,in->count);
+        p1ReaderReset(&in->reader);
+        parseP1Telegram(s->data,len,&s->telegram);
+        clock_gettime(CLOCK_MONOTONIC,&s->parsed);
+        atomic_store(&in->telegrams,in->reader.telegrams);
+        if (in->debug) fprintf(stderr,"Data complete:\n%s\n",s->data);
+        publish(in);
+}
+
+static void dropTelegram(SerialIngest* in)
+{
+        /* Remove the telegram from the buffer, keeping what was read after it */
+        in->count-=in->reader.end;
+        memmove(in->buffer,in->buffer+in->reader.end,in->count);
+        p1ReaderReset(&in->reader);
+        atomic_store(&in->crcErrors,in->reader.crcErrors);
+}
+
+static void reopen(SerialIngest* in)
+{
+        /* Keep trying, a USB serial adapter may take a while to come back.
+         * Cancelled only while sleeping: halfway through opening there is
+         * an fd or memory that would leak. */
+        while (in->fd<0)
+        {
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,0);
+                sleep(INGEST_RETRY);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,0);
+                in->fd=openP1Device(in->deviceName);
+        }
+        if (in->lost)
+        {
+                /* Not the first open when the device was missing at the start */
+                atomic_fetch_add(&in->reopens,1);
+                in->lost=0;
+                syslog(LOG_INFO,"P1 serial device %s opened again",in->deviceName);
+        } else {
+                syslog(LOG_INFO,"P1 serial device %s opened",in->deviceName);
+        }
+}
+
+static void* ingestThread(void* arg)
+{
+        SerialIngest* in=arg;
+        struct timespec start, readTime;
+        /* Cancelled only while waiting for the device, never halfway
+         * through a telegram or holding a lock */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,0);
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        while (1)
+        {
+                if (in->fd<0) reopen(in);
+                int bytesToRead=INGEST_BUFSIZE-1-in->count;
+                if (bytesToRead==0)
+                {
+                        // Buffer fully read but still nothing, start again
+                        in->count=0;
+                        p1ReaderReset(&in->reader);
+                        bytesToRead=INGEST_BUFSIZE-1;
+                        syslog(LOG_INFO,"corrupted data read from p1 port");
+                }
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,0);
+                const int bytesRead=read(in->fd,in->buffer+in->count,bytesToRead);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,0);
+                if (in->debug) fprintf(stderr,"Got %i bytes from serial port\n",bytesRead);
+                if (bytesRead<=0)
+                {
+                        /* Something went wrong. Close the serial port and open it again. */
+                        syslog(LOG_INFO,"P1 serial device closed, reopening %s",bytesRead?strerror(errno):"");
+                        close(in->fd);
+                        in->fd=-1;
+                        in->lost=1;
+                        in->count=0;
+                        p1ReaderReset(&in->reader);
+                        continue;
+                }
+                /* A telegram starts with the first bytes kept in an empty buffer */
+                clock_gettime(CLOCK_MONOTONIC,&readTime);
+                if (!in->count) start=readTime;
+                in->count+=bytesRead;
+                /* Several telegrams may have been read at once */
+                while (in->count>0)
+                {
+                        const enum DataComplete status=p1ReaderScan(&in->reader,in->buffer,&in->count);
+                        if (status==COMPLETE)
+                        {
+                                completeTelegram(in,&start);
+                                start=readTime;
+                        } else if (status==COMPLETE_WITH_ERROR) {
+                                syslog(LOG_INFO,"checksum error in telegram from p1 port, dropped");
+                                if (in->debug) fprintf(stderr,"Checksum error, dropping telegram\n");
+                                dropTelegram(in);
+                        } else {
+                                if (in->debug) fprintf(stderr,"Data not yet complete\n");
+                                break;
+                        }
+                }
+        }
+        return 0;
+}
+
+int ingestInit(SerialIngest* in, const char* deviceName, const int fd, const int debug)
+{
+        bzero(in,sizeof(*in));
+        in->slots=calloc(INGEST_SLOTS,sizeof(P1Snapshot));
+        if (!in->slots)
+        {
+                perror("malloc");
+                return -1;
+        }
+        /* Before the first telegram the event loop holds an empty one */
+        strcpy(in->slots[0].data,"Uninitialized\n");
+        parseP1Telegram(in->slots[0].data,strlen(in->slots[0].data),&in->slots[0].telegram);
+        in->reading=0;
+        atomic_init(&in->latest,1);
+        in->writing=2;
+        in->deviceName=deviceName;
+        in->fd=fd;
+        in->debug=debug;
+        p1ReaderReset(&in->reader);
+        in->eventfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+        if (in->eventfd==-1)
+        {
+                perror("eventfd");
+                free(in->slots);
+                return -1;
+        }
+        return 0;
+}
+
+void ingestRestore(SerialIngest* in, const char* telegram, const int len, const struct timespec* received, const char* pending, const int pendingLen)
+{
+        P1Snapshot* s=&in->slots[in->reading];
+        if (len>0 && len<INGEST_BUFSIZE)
+        {
+                memcpy(s->data,telegram,len);
+                s->data[len]='\0';
+                parseP1Telegram(s->data,len,&s->telegram);
+                s->received=*received;
+                clock_gettime(CLOCK_MONOTONIC,&s->end);
+                s->start=s->parsed=s->end;
+        }
+        if (pendingLen>0 && pendingLen<INGEST_BUFSIZE)
+        {
+                memcpy(in->buffer,pending,pendingLen);
+                in->count=pendingLen;
+        }
+}
+
+int ingestRun(SerialIngest* in)
+{
+        /* Without a device there is just the empty telegram */
+        if (!in->deviceName || in->running) return 0;
+        /* Parsing converts the timestamps, load the time zone before
+         * running rather than on the first telegram */
+        tzset();
+        errno=pthread_create(&in->thread,0,ingestThread,in);
+        if (errno)
+        {
+                perror("pthread_create");
+                return -1;
+        }
+        in->running=1;
+        return 0;
+}
+
+void ingestPause(SerialIngest* in)
+{
+        if (!in->running) return;
+        pthread_cancel(in->thread);
+        pthread_join(in->thread,0);
+        in->running=0;
+        /* A telegram read partly is scanned again when running again */
+        p1ReaderReset(&in->reader);
+}
+
+void ingestStop(SerialIngest* in)
+{
+        ingestPause(in);
+        if (in->fd>=0) close(in->fd);
+        close(in->eventfd);
+        free(in->slots);
+}
+
+int ingestPending(SerialIngest* in)
+{
+        return (atomic_load(&in->latest)&INGEST_FRESH)!=0;
+}
+
+const P1Snapshot* ingestTake(SerialIngest* in)
+{
+        /* Clear the wakeup first, a snapshot published after this wakes
+         * the event loop again */
+        uint64_t n;
+        if (read(in->eventfd,&n,sizeof(n))==-1 && errno!=EAGAIN) perror("eventfd read");
+        if (!(atomic_load(&in->latest)&INGEST_FRESH)) return 0;
+        in->reading=atomic_exchange(&in->latest,(unsigned)in->reading)&INGEST_SLOT;
+        return &in->slots[in->reading];
+}
@@ -0,0 +1,90 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "p1telegram.h"
+
+/* Reading the P1 serial port on a thread of its own, so a busy event loop
+   can never delay the read and let the tty buffer overflow. The thread
+   frames the telegrams, checks the CRC and parses them.
+
+   Each telegram becomes a snapshot in one of three slots: one the thread
+   fills, one holding the latest published telegram, and one the event loop
+   uses. Publishing and taking are a single atomic exchange of the slot
+   index, no locks; the snapshot the event loop holds stays valid until it
+   takes the next one. When the event loop is slow the thread replaces the
+   published snapshot, so it always gets the latest telegram. The event loop
+   is woken through an eventfd.
+ */
+
+#define INGEST_BUFSIZE 4096     /* Longest telegram */
+#define INGEST_SLOTS   3
+#define INGEST_RETRY   1        /* s between attempts to open the device */
+
+typedef struct
+{
+        P1Telegram      telegram;       /* Parsed, raw points to data */
+        char            data[INGEST_BUFSIZE];
+        struct timespec received;       /* CLOCK_REALTIME when complete */
+        struct timespec start;          /* CLOCK_MONOTONIC of the first bytes */
+        struct timespec end;            /* CLOCK_MONOTONIC when complete */
+        struct timespec parsed;         /* CLOCK_MONOTONIC after parsing */
+} P1Snapshot;
+
+typedef struct
+{
+        P1Snapshot*     slots;          /* INGEST_SLOTS */
+        atomic_uint     latest;         /* Slot published last, INGEST_FRESH until taken */
+        int             reading;        /* Slot of the event loop */
+        int             eventfd;        /* Readable when a snapshot was published */
+        pthread_t       thread;
+        int             running;        /* The thread was started */
+
+        /* Owned by the thread */
+        const char*     deviceName;
+        int             fd;
+        int             lost;           /* The device failed after it was open */
+        int             writing;        /* Slot being filled */
+        P1Reader        reader;
+        char            buffer[INGEST_BUFSIZE];
+        int             count;
+        int             debug;
+
+        /* Statistics, updated by the thread */
+        atomic_ulong    telegrams;      /* Telegrams received with valid (or no) CRC */
+        atomic_ulong    crcErrors;      /* Telegrams dropped because of a wrong CRC */
+        atomic_ulong    replaced;       /* Published but replaced before they were taken */
+        atomic_ulong    reopens;        /* Times the device was opened again after an error */
+} SerialIngest;
+
+/* Prepare reading fd, which was opened from deviceName and may be -1 (it is
+   opened again every INGEST_RETRY s). Returns -1 on failure. */
+int ingestInit(SerialIngest* in, const char* deviceName, const int fd, const int debug);
+
+/* Continue where a previous instance of the program stopped, before
+   ingestRun: telegram becomes the snapshot the event loop holds, and pending
+   is serial data that was read after it */
+void ingestRestore(SerialIngest* in, const char* telegram, const int len, const struct timespec* received, const char* pending, const int pendingLen);
+
+/* Start the thread, or start it again after ingestPause. Without deviceName
+   there is no thread. Returns -1 on failure. */
+int ingestRun(SerialIngest* in);
+
+/* Stop the thread. The device stays open, in->fd, and what was read after
+   the last telegram stays in in->buffer. */
+void ingestPause(SerialIngest* in);
+void ingestStop(SerialIngest* in);
+
+/* A snapshot was published that the event loop did not take yet */
+int ingestPending(SerialIngest* in);
+
+/* Called when in->eventfd is readable: the newest snapshot if there is one
+   the event loop has not taken yet, else 0. The previous snapshot may be
+   reused by the thread from now on. */
+const P1Snapshot* ingestTake(SerialIngest* in);
+
+#endif // INGEST_H
@@ -6,6 +6,8 @@
 const int modbusBase=40001;
 const int modbusRegCount=109;
 
+#define MAXPARAMREGS 128 /* At least modbusRegCount */
+
 SunSpecValue params[] = {
         /*        {40070,    0,      1,     "C_SunSpec_DID",    "",     uint16},    */
         /*        {40071,    0,      1,     "C_SunSpec_Length",    "",     uint16}, */
@@ -34,51 +36,76 @@ SunSpecValue params[] = {
         {0, 0, 0, 0, 0, 0},
 };
 
+const int sunSpecParamCount=sizeof(params)/sizeof(params[0])-1;
+
+
+/* Powers of ten for the SunSpec scale factors, which range from -10 to 10 */
+#define MAXSCALE 10
+static const double pow10Table[MAXSCALE+1]={
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10
+};
+
+static double applyScale(const double val, const int16_t scale)
+{
+        /* Dividing by an exact power of ten rounds once, repeated division
+         * by 10 or multiplying by an inexact 0.01 does not */
+        if (scale>=0 && scale<=MAXSCALE) return val*pow10Table[scale];
+        if (scale<0 && scale>=-MAXSCALE) return val/pow10Table[-scale];
+        return NAN; /* 0x8000 means not implemented */
+}
 
 double int16ToDouble(const uint16_t* data, const int scaleOffset)
 {
-        short tenPower=ntohs((short)*(data+scaleOffset));
-        double val=ntohs(*(short*)data);
-        while (tenPower>0) { val*=10; tenPower--; }
-        while (tenPower<0) { val/=10; tenPower++; }
-        return val;
+        return applyScale((int16_t)data[0],(int16_t)data[scaleOffset]);
 }
 
 double uint16ToDouble(const uint16_t* data, const int scaleOffset)
 {
-        short tenPower=ntohs((short)*(data+scaleOffset));
-        double val=ntohs(*data);
-        while (tenPower>0) { val*=10; tenPower--; }
-        while (tenPower<0) { val/=10; tenPower++; }
-        return val;
+        return applyScale(data[0],(int16_t)data[scaleOffset]);
 }
 
 double acc32ToDouble(const uint16_t* data, const int scaleOffset)
 {
-        short tenPower=(short)data[scaleOffset];
-        uint32_t intVal=ntohs(data[0]);
-        intVal<<=16;
-        intVal+=ntohs(data[1]);
-        double val=intVal;
-        while (tenPower>0) { val*=10; tenPower--; }
-        while (tenPower<0) { val/=10; tenPower++; }
-        return val;
+        const uint32_t intVal=((uint32_t)data[0]<<16)|data[1];
+        return applyScale(intVal,(int16_t)data[scaleOffset]);
+}
+
+void decodeSunSpec(const uint16_t* data, double* values)
+{
+        /* Registers to host order in one pass, then each parameter once */
+        uint16_t regs[MAXPARAMREGS];
+        int i;
+        for (i=0;i<modbusRegCount;i++) regs[i]=ntohs(data[i]);
+        for (i=0;i<sunSpecParamCount;i++)
+        {
+                const SunSpecValue* ssv=&params[i];
+                values[i]=ssv->calcFn(regs+ssv->valueFieldNr-modbusBase,ssv->scaleFieldOffset);
+        }
 }
 
 SunSpecValue* getParam(int nr)
 {
+        /* Register number to parameter, filled on first use so a lookup
+         * does not need to walk params[] */
+        static SunSpecValue* paramIndex[MAXPARAMREGS];
+        static int indexed=0;
         if (nr==0) return params;
-        for (SunSpecValue* ssv=params; ssv->valueFieldNr;ssv++)
+        if (!indexed)
         {
-                if (ssv->valueFieldNr==nr) return ssv;
+                for (SunSpecValue* ssv=params; ssv->valueFieldNr;ssv++)
+                {
+                        paramIndex[ssv->valueFieldNr-modbusBase]=ssv;
+                }
+                indexed=1;
         }
-        return 0;
+        if (nr<modbusBase || nr>=modbusBase+modbusRegCount) return 0;
+        return paramIndex[nr-modbusBase];
 }
 
-double getSunSpecValue(const uint16_t* data, int nr)
+double getSunSpecValue(const double* values, int nr)
 {
         double value=NAN;
         SunSpecValue* ssv=getParam(nr);
-        if (data && ssv) value=ssv->calcFn(data+ssv->valueFieldNr-modbusBase,ssv->scaleFieldOffset);
+        if (values && ssv) value=values[ssv-params];
         return value;
 }
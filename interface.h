@@ -4,33 +4,66 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
-/* The struct below contains some "global" data:
-    - datapipe, for transferring data from the measurement thread to worker thread
-    - fd for the serial device, used by measurement thread
-    - pointer to first PowerTimeStamps struct
-    - pointer to current PowerTimeStamps struct. Current means the one to write the first
-      following measurement to
-    - counter: pointer to the number of measurements done, this is written into the data
-      file and used to quickly find 'current'
-    - udpport: port to listen to data
+#include "p1telegram.h"
+#include "registry.h"
+#include "modbus.h"
+#include "fanout.h"
+#include "timeseries.h"
+#include "historyfile.h"
+#include "textbuf.h"
+#include "handover.h"
+
+/* InitializationData contains the settings from the command line:
+    - the modbus devices to poll, and how often
+    - fd and name of the serial device
+    - port: port to listen on, for UDP queries and TCP telegram copies
+    - historyFile: file to store a record for each telegram in, if given,
+      the rollups are stored next to it
+    - metricsPort: port to serve metrics to Prometheus on over HTTP, 0 if none
+    - argv: the command line, executed again to reload
+    - handover: the state of the previous instance after a reload, else 0
  */
 
+/* Decodes a value from registers in host byte order */
 typedef double (*CalculateValue)(const uint16_t* data, const int scaleOffset);
 
 typedef struct
 {
-        struct sockaddr* modbusAddr;
-        socklen_t        modbusAddrlen;
-        int              ai_family;
-        int              ai_socktype;
-        int              ai_protocol;
+        ModbusDeviceConfig modbusDevices[MODBUS_MAXDEVICES];
+        int              modbusDeviceCount;
         int              debug;
         int              serialDeviceFd;
         const char*      serialDeviceName;
         unsigned         port;
+        int              modbusPeriodMs;
+        int              maxConns;      /* TCP clients */
+        int              tcpQueueLen;   /* Telegrams a TCP client may be behind */
+        enum QueuePolicy tcpQueuePolicy;
+        const char*      historyFile;
+        unsigned         historyDays[TIER_COUNT];       /* Retention of new history files */
+        unsigned         metricsPort;
+        char**           argv;
+        Handover*        handover;
 } InitializationData;
 
+#define DEVICE_DEFAULT -2       /* No device given in the query */
+#define DEVICE_SUM     -1       /* Sum over all devices */
+
+/* Latest data available to queries */
+typedef struct
+{
+        const P1Telegram*   p1;
+        struct timespec     p1UpdateTime;
+        const ModbusClient* modbus;     /* Array of modbusCount clients */
+        int                 modbusCount;
+        int                 device;     /* Device selected by the query */
+        const TimeSeries*   history;    /* Recent samples of the HistorySeries */
+        const HistoryStore* store;      /* Stored records, headers 0 if there is no file */
+} Measurements;
+
 typedef struct
 {
         int valueFieldNr;
@@ -45,14 +78,27 @@ int openP1Device(const char* p_device);
 
 int reporter(InitializationData* id);
 
-const int modbusBase;
-const int modbusRegCount;
+int initCommandRegistry();
+const RegistryEntry* findCommand(const char* name, const size_t len);
+/* Answer a request of one command, or several separated by commas, up to
+   the end of the line. The answer may refer to cached text, which stays
+   valid until the next telegram or modbus reply. */
+void handleCommand(const InitializationData* id, const Measurements* m, const char* request, TextBuf* answer);
+
+extern const int modbusBase;
+extern const int modbusRegCount;
+extern const int sunSpecParamCount;
 
 double int16ToDouble(const uint16_t* data, const int scaleOffset);
 double uint16ToDouble(const uint16_t* data, const int scaleOffset);
 double acc32ToDouble(const uint16_t* data, const int scaleOffset);
 SunSpecValue* getParam(int nr); /* Specify 0 for the first, loop until valueFieldNr==0 */
 
-double getSunSpecValue(const uint16_t* data, int fieldnr);
+/* Decode all parameters from a block of modbusRegCount registers in network
+   byte order into values[sunSpecParamCount], done once per poll */
+void decodeSunSpec(const uint16_t* data, double* values);
+
+/* Decoded value of a field, NAN if there is no data */
+double getSunSpecValue(const double* values, int fieldnr);
 
 #endif // INTERFACE_H
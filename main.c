@@ -18,27 +18,38 @@
 
 void usage(const char* toolname)
 {
-        printf("Usage: %s -s <serial device> [-d] [-p port] [-H <sunspechost> -P <sunspecport>]\n",toolname);
+        printf("Usage: %s -s <serial device> [-d] [-p port] [-H [name=]<sunspechost> [-P <sunspecport>] [-U <unitid>]]... [-c <configfile>] [-i <ms>] [-f <file> [-r [<tier>=]<days>]...] [-m <n>] [-q <n>] [-Q drop|disconnect] [-M <port>]\n",toolname);
         printf("   Monitor P1 port of power meter. Provide copy via TCP for Domoticz");
         printf("   and simple queries on UDP, default on port 9012.\n");
-        printf("   SIGHUP makes the program restart.\n");
+        printf("   SIGHUP makes the program reload: it executes itself again, reading the\n");
+        printf("   configuration, and keeps its sockets, TCP clients and recent samples.\n");
         printf("   -d shows debug output.\n");
-        printf("   -H <sunspechost> -P <sunspecport> read out data from sunspec modbus device.\n");
+        printf("   -H [name=]<sunspechost> -P <sunspecport> -U <unitid> read out data from sunspec modbus device,\n");
+        printf("      may be repeated for several devices. -P and -U apply to the preceding -H,\n");
+        printf("      or to all devices when given before the first -H. Default port 502, unit id 1.\n");
+        printf("   -c <configfile> read devices from a file, with lines 'device <name> <host> [port] [unitid]'.\n");
+        printf("   -i <ms> sunspec poll period in ms, default 1000, minimum 100.\n");
+        printf("   -f <file> store a record for each telegram in file, and per minute, quarter\n");
+        printf("      and hour the minimum, maximum and mean power in <file>.1m, <file>.15m, <file>.1h.\n");
+        printf("   -r [<tier>=]<days> days a new history file of tier raw, 1m, 15m or 1h holds,\n");
+        printf("      default 7, 90, 730 and 3650. Without a tier it applies to raw.\n");
+        printf("   -m <n> maximum number of TCP clients, default 1000.\n");
+        printf("   -q <n> telegrams a TCP client may be behind, default 4.\n");
+        printf("   -Q drop|disconnect what to do with a TCP client that is further behind: drop its\n");
+        printf("      oldest telegram (default) or disconnect it.\n");
+        printf("   -M <port> serve metrics for Prometheus over HTTP on port, at /metrics.\n");
         printf("\n");
         printf("   Example: %s -s /dev/ttyAMA0 -p 12345\n",toolname);
 }
 
-static char** cmdlineArgs;
-
-static void restartTool(int p_signal)
-{
-        execvp(cmdlineArgs[0],cmdlineArgs);
-}
-
-static void closeConnections()
+static void closeConnections(const Handover* handover)
 {
+        /* Except what the previous instance handed over */
         int i;
-        for (i=3;i<1024;++i) close(i);
+        for (i=3;i<1024;++i)
+        {
+                if (!handoverHasFd(handover,i)) close(i);
+        }
 }
 
 static void closeTty()
@@ -53,9 +64,8 @@ static void closeTty()
         if (nullfd>2) close(nullfd);
 }
 
-static int getModbusAddr(const char* hostname, const char* port, InitializationData* id)
+static int addModbusDevice(InitializationData* id, const char* name, const char* hostname, const char* port, const int unitId)
 {
-        int error=0;
         struct addrinfo hints;
         bzero(&hints,sizeof(struct addrinfo));
 
@@ -65,51 +75,132 @@ static int getModbusAddr(const char* hostname, const char* port, InitializationD
 
         struct addrinfo* addresses;
 
-        if (getaddrinfo(hostname, port, &hints, &addresses))
+        if (id->modbusDeviceCount>=MODBUS_MAXDEVICES)
         {
-                perror("getaddrinfo for modbus server");
+                fprintf(stderr,"Too many modbus devices, maximum is %i\n",MODBUS_MAXDEVICES);
                 return 1;
         }
-
-        if (!(id->modbusAddr=malloc(addresses->ai_addrlen)))
+        const int res=getaddrinfo(hostname, port, &hints, &addresses);
+        if (res)
         {
-                error=1;
-        } else {
-                id->modbusAddrlen=addresses->ai_addrlen;
-                memcpy(id->modbusAddr,addresses->ai_addr,addresses->ai_addrlen);
-                id->ai_family=addresses->ai_family;
-                id->ai_socktype=addresses->ai_socktype;
-                id->ai_protocol=addresses->ai_protocol;
+                fprintf(stderr,"getaddrinfo for modbus server %s port %s: %s\n",hostname,port,gai_strerror(res));
+                return 1;
         }
 
+        ModbusDeviceConfig* dev=&id->modbusDevices[id->modbusDeviceCount++];
+        bzero(dev,sizeof(*dev));
+        snprintf(dev->name,MODBUS_NAMESIZE,"%s",name?name:hostname);
+        memcpy(&dev->addr,addresses->ai_addr,addresses->ai_addrlen);
+        dev->addrlen=addresses->ai_addrlen;
+        dev->ai_family=addresses->ai_family;
+        dev->ai_socktype=addresses->ai_socktype;
+        dev->ai_protocol=addresses->ai_protocol;
+        dev->unitId=unitId;
+
         freeaddrinfo(addresses);
 
+        return 0;
+}
+
+static int readConfigFile(InitializationData* id, const char* filename)
+{
+        /* Lines: device <name> <host> [port] [unitid], # starts a comment */
+        char line[256];
+        int lineNr=0;
+        int error=0;
+        FILE* f=fopen(filename,"r");
+        if (!f)
+        {
+                perror(filename);
+                return 1;
+        }
+        while (fgets(line,sizeof(line),f))
+        {
+                char keyword[16], name[MODBUS_NAMESIZE], host[128], port[16];
+                int unitId=1;
+                lineNr++;
+                char* hash=strchr(line,'#');
+                if (hash) *hash='\0';
+                strcpy(port,"502");
+                const int fields=sscanf(line,"%15s %31s %127s %15s %i",keyword,name,host,port,&unitId);
+                if (fields<=0) continue;
+                if (fields<3 || strcmp(keyword,"device"))
+                {
+                        fprintf(stderr,"%s:%i: expected 'device <name> <host> [port] [unitid]'\n",filename,lineNr);
+                        error=1;
+                        continue;
+                }
+                error|=addModbusDevice(id,name,host,port,unitId);
+        }
+        fclose(f);
         return error;
 }
 
+static int setRetention(InitializationData* id, const char* arg)
+{
+        /* [<tier>=]<days>, raw when no tier is given */
+        int tier=TIER_RAW;
+        const char* eq=strchr(arg,'=');
+        if (eq)
+        {
+                for (tier=0;tier<TIER_COUNT;tier++)
+                {
+                        if (strlen(tierNames[tier])==(size_t)(eq-arg) && !strncmp(arg,tierNames[tier],eq-arg)) break;
+                }
+                if (tier==TIER_COUNT) return 1;
+                arg=eq+1;
+        }
+        const int days=atoi(arg);
+        id->historyDays[tier]=days<1?1:days;
+        return 0;
+}
+
 int main(int argc, char** argv)
 {
         InitializationData id;
-        char* sunspecHost=0;
-        char* sunspecPort=0;
+        /* Devices from the command line, resolved after all options are read */
+        const char* sunspecHosts[MODBUS_MAXDEVICES];
+        const char* sunspecPorts[MODBUS_MAXDEVICES];
+        int sunspecUnits[MODBUS_MAXDEVICES];
+        int sunspecCount=0;
+        const char* defaultPort="502";
+        int defaultUnit=1;
+        const char* configFile=0;
+        int i;
+        Handover handover;
+        sigset_t hangup;
         id.debug=0;
         id.port=9012;
-        id.modbusAddr=0;
-        id.modbusAddrlen=0;
+        id.modbusDeviceCount=0;
+        id.modbusPeriodMs=1000;
+        id.historyFile=0;
+        id.historyDays[TIER_RAW]=7;
+        id.historyDays[TIER_1M]=90;
+        id.historyDays[TIER_15M]=730;
+        id.historyDays[TIER_1H]=3650;
+        id.maxConns=1000;
+        id.tcpQueueLen=4;
+        id.tcpQueuePolicy=QUEUE_DROP_OLDEST;
+        id.metricsPort=0;
+        id.argv=argv;
 
-        const char* serialDevice;
+        const char* serialDevice=0;
         extern char* optarg;
         int opt;
 
-        cmdlineArgs=argv;
-
-        signal(SIGHUP,restartTool);
+        /* SIGHUP is read by the event loop, blocked before any thread is
+         * started. It stays blocked over a reload, so one arriving while the
+         * new instance starts is not lost. */
+        sigemptyset(&hangup);
+        sigaddset(&hangup,SIGHUP);
+        sigprocmask(SIG_BLOCK,&hangup,0);
 
         /* Cleanup old connections, which may be required in case of restart */
         closelog();
-        closeConnections();
+        id.handover=handoverOpen(&handover)?&handover:0;
+        closeConnections(&handover);
 
-        while ((opt=getopt(argc,argv,"s:dp:H:P:"))!=-1)
+        while ((opt=getopt(argc,argv,"s:dp:H:P:U:c:i:f:r:m:q:Q:M:"))!=-1)
         {
                 switch(opt)
                 {
@@ -123,10 +214,59 @@ int main(int argc, char** argv)
                                 id.port=atoi(optarg);
                                 break;
                         case 'H':
-                                sunspecHost=optarg;
+                                if (sunspecCount==MODBUS_MAXDEVICES)
+                                {
+                                        fprintf(stderr,"Too many modbus devices, maximum is %i\n",MODBUS_MAXDEVICES);
+                                        return 1;
+                                }
+                                sunspecHosts[sunspecCount]=optarg;
+                                sunspecPorts[sunspecCount]=defaultPort;
+                                sunspecUnits[sunspecCount]=defaultUnit;
+                                sunspecCount++;
                                 break;
                         case 'P':
-                                sunspecPort=optarg;
+                                if (sunspecCount) sunspecPorts[sunspecCount-1]=optarg;
+                                else defaultPort=optarg;
+                                break;
+                        case 'U':
+                                if (sunspecCount) sunspecUnits[sunspecCount-1]=atoi(optarg);
+                                else defaultUnit=atoi(optarg);
+                                break;
+                        case 'c':
+                                configFile=optarg;
+                                break;
+                        case 'i':
+                                id.modbusPeriodMs=atoi(optarg);
+                                break;
+                        case 'f':
+                                id.historyFile=optarg;
+                                break;
+                        case 'r':
+                                if (setRetention(&id,optarg))
+                                {
+                                        fprintf(stderr,"Unknown history tier in -r %s\n",optarg);
+                                        usage(argv[0]);
+                                        exit(1);
+                                }
+                                break;
+                        case 'm':
+                                id.maxConns=atoi(optarg);
+                                if (id.maxConns<1) id.maxConns=1;
+                                break;
+                        case 'q':
+                                id.tcpQueueLen=atoi(optarg);
+                                break;
+                        case 'Q':
+                                if (strcmp(optarg,"drop")==0) id.tcpQueuePolicy=QUEUE_DROP_OLDEST;
+                                else if (strcmp(optarg,"disconnect")==0) id.tcpQueuePolicy=QUEUE_DISCONNECT;
+                                else
+                                {
+                                        usage(argv[0]);
+                                        return 1;
+                                }
+                                break;
+                        case 'M':
+                                id.metricsPort=atoi(optarg);
                                 break;
                         default:
                                 usage(argv[0]);
@@ -136,9 +276,23 @@ int main(int argc, char** argv)
                 }
         }
         id.serialDeviceName=serialDevice;
-        id.serialDeviceFd=openP1Device(serialDevice);
+        /* After a reload the reporter continues with the device as it was */
+        id.serialDeviceFd=serialDevice && !id.handover?openP1Device(serialDevice):-1;
+
+        for (i=0;i<sunspecCount;i++)
+        {
+                /* [name=]host, argv is left intact for a restart */
+                const char* host=sunspecHosts[i];
+                char name[MODBUS_NAMESIZE];
+                const char* eq=strchr(host,'=');
+                if (eq)
+                {
+                        snprintf(name,sizeof(name),"%.*s",(int)(eq-host),host);
+                        host=eq+1;
+                }
+                if (addModbusDevice(&id,eq?name:0,host,sunspecPorts[i],sunspecUnits[i])) return 1;
+        }
+        if (configFile && readConfigFile(&id,configFile)) return 1;
 
-        getModbusAddr(sunspecHost,sunspecPort,&id);       
-        
         return reporter(&id);
 }
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE /* accept4, memmem, strcasestr */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define METRICS_CONTENTTYPE "text/plain; version=0.0.4; charset=utf-8"
+
+int metricsInit(MetricsServer* s, MetricsRender render, void* context, const int debug)
+{
+        int i;
+        memset(s,0,sizeof(*s));
+        s->render=render;
+        s->context=context;
+        s->debug=debug;
+        s->stale=1;
+        s->page=malloc(METRICS_PAGESIZE);
+        if (!s->page) return -1;
+        for (i=0;i<METRICS_MAXCLIENTS;i++) s->clients[i].fd=-1;
+        return 0;
+}
+
+static void endResponse(MetricsServer* s, MetricsClient* c)
+{
+        if (c->responding && c->body==s->page) s->pageUsers--;
+        c->responding=0;
+        c->body=0;
+        c->bodyLen=0;
+        c->offset=0;
+}
+
+static void closeClient(MetricsServer* s, MetricsClient* c)
+{
+        if (s->debug) fprintf(stderr,"closing metrics connection fd=%i\n",c->fd);
+        endResponse(s,c);
+        close(c->fd);
+        c->fd=-1;
+        c->requestLen=0;
+}
+
+void metricsFree(MetricsServer* s)
+{
+        int i;
+        for (i=0;i<METRICS_MAXCLIENTS;i++)
+        {
+                if (s->clients[i].fd>=0) closeClient(s,&s->clients[i]);
+        }
+        free(s->page);
+        s->page=0;
+}
+
+MetricsClient* metricsAccept(MetricsServer* s, const int listenfd)
+{
+        MetricsClient* c=0;
+        int i;
+        const int newsock=accept4(listenfd,0,0,SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (newsock==-1) return 0;
+
+        for (i=0;i<METRICS_MAXCLIENTS && s->clients[i].fd!=-1;i++);
+        if (i<METRICS_MAXCLIENTS) c=&s->clients[i];
+        for (i=0;!c && i<METRICS_MAXCLIENTS;i++)
+        {
+                /* All taken, make room by closing the longest idle one */
+                MetricsClient* idle=&s->clients[i];
+                if (idle->responding || idle->requestLen) continue;
+                if (!c || idle->lastRequest<c->lastRequest) c=idle;
+        }
+        if (!c)
+        {
+                close(newsock);
+                return 0;
+        }
+        if (c->fd>=0) closeClient(s,c);
+        c->fd=newsock;
+        c->generation++;
+        c->lastRequest=s->requests;
+        return c;
+}
+
+static void renderPage(MetricsServer* s)
+{
+        TextBuf page;
+        textBufInit(&page,s->page,METRICS_PAGESIZE);
+        s->render(s->context,&page);
+        if (page.truncated)
+        {
+                /* Only complete lines, the rest is missing */
+                char* end=memrchr(s->page,'\n',page.len);
+                page.len=end?end-s->page+1:0;
+                if (s->debug) fprintf(stderr,"metrics page truncated at %i bytes\n",page.len);
+        }
+        s->pageLen=page.len;
+        s->stale=0;
+        s->renders++;
+}
+
+static void startResponse(MetricsServer* s, MetricsClient* c, const int status, const char* reason, const int head)
+{
+        const char* body=reason;
+        int bodyLen=strlen(reason);
+        if (status==200)
+        {
+                /* Rendered again unless another response is writing it */
+                if (s->stale && !s->pageUsers) renderPage(s);
+                body=s->page;
+                bodyLen=s->pageLen;
+                s->pageUsers++;
+                s->scrapes++;
+        }
+        c->headerLen=snprintf(c->header,METRICS_HEADERSIZE,
+                        "HTTP/1.1 %i %s\r\nContent-Type: %s\r\nContent-Length: %i\r\n%s\r\n",
+                        status,status==200?"OK":reason,status==200?METRICS_CONTENTTYPE:"text/plain",
+                        bodyLen,c->keepAlive?"":"Connection: close\r\n");
+        c->body=body;
+        c->bodyLen=head?0:bodyLen;
+        c->offset=0;
+        c->responding=1;
+}
+
+static void handleRequest(MetricsServer* s, MetricsClient* c, const int len)
+{
+        /* The request line and headers are the first len bytes */
+        char text[METRICS_REQUESTSIZE+1];
+        char method[8], path[64], version[16];
+        memcpy(text,c->request,len);
+        text[len]='\0';
+        c->requestLen-=len;
+        memmove(c->request,c->request+len,c->requestLen);
+        s->requests++;
+        c->lastRequest=s->requests;
+        if (s->debug) fprintf(stderr,"metrics request fd=%i '%.*s'\n",c->fd,(int)strcspn(text,"\r\n"),text);
+
+        if (sscanf(text,"%7s %63s %15s",method,path,version)!=3 || strncmp(version,"HTTP/1.",7))
+        {
+                c->keepAlive=0;
+                startResponse(s,c,400,"Bad Request",0);
+                return;
+        }
+        /* HTTP/1.1 connections stay open unless the client closes them */
+        c->keepAlive=!strcmp(version,"HTTP/1.1") && !strcasestr(text,"\nConnection: close");
+        const int head=!strcmp(method,"HEAD");
+        char* query=strchr(path,'?');
+        if (query) *query='\0';
+        if (!head && strcmp(method,"GET")) startResponse(s,c,405,"Method Not Allowed",0);
+        else if (strcmp(path,"/metrics") && strcmp(path,"/")) startResponse(s,c,404,"Not Found",head);
+        else startResponse(s,c,200,"",head);
+}
+
+static int requestLength(const MetricsClient* c)
+{
+        /* Length of the request up to the empty line, 0 if incomplete */
+        const char* end=memmem(c->request,c->requestLen,"\r\n\r\n",4);
+        if (end) return end-c->request+4;
+        end=memmem(c->request,c->requestLen,"\n\n",2);
+        return end?end-c->request+2:0;
+}
+
+static int writeResponse(MetricsServer* s, MetricsClient* c)
+{
+        /* Header and body in one write, sendmsg so a closed peer gives
+         * EPIPE instead of SIGPIPE. Returns 0 when the response is
+         * complete, -1 if the socket is full or the client was closed. */
+        while (c->offset<c->headerLen+c->bodyLen)
+        {
+                struct iovec iov[2];
+                struct msghdr msg;
+                memset(&msg,0,sizeof(msg));
+                msg.msg_iov=iov;
+                if (c->offset<c->headerLen)
+                {
+                        iov[0].iov_base=c->header+c->offset;
+                        iov[0].iov_len=c->headerLen-c->offset;
+                        iov[1].iov_base=(char*)c->body;
+                        iov[1].iov_len=c->bodyLen;
+                        msg.msg_iovlen=c->bodyLen?2:1;
+                } else {
+                        iov[0].iov_base=(char*)c->body+c->offset-c->headerLen;
+                        iov[0].iov_len=c->headerLen+c->bodyLen-c->offset;
+                        msg.msg_iovlen=1;
+                }
+                const int written=sendmsg(c->fd,&msg,MSG_NOSIGNAL);
+                if (written<0)
+                {
+                        if (errno!=EAGAIN && errno!=EWOULDBLOCK) closeClient(s,c);
+                        return -1;
+                }
+                c->offset+=written;
+        }
+        endResponse(s,c);
+        return 0;
+}
+
+static void serveClient(MetricsServer* s, MetricsClient* c)
+{
+        /* Answer the requests one at a time, reading until EAGAIN as there
+         * is no new event for data that is left */
+        for (;;)
+        {
+                if (c->responding)
+                {
+                        if (writeResponse(s,c)) return;
+                        if (!c->keepAlive)
+                        {
+                                closeClient(s,c);
+                                return;
+                        }
+                        continue;
+                }
+                const int len=requestLength(c);
+                if (len)
+                {
+                        handleRequest(s,c,len);
+                        continue;
+                }
+                if (c->requestLen==METRICS_REQUESTSIZE)
+                {
+                        c->keepAlive=0;
+                        c->requestLen=0;
+                        startResponse(s,c,431,"Request Header Fields Too Large",0);
+                        continue;
+                }
+                const int bytesRead=read(c->fd,c->request+c->requestLen,METRICS_REQUESTSIZE-c->requestLen);
+                if (bytesRead==0 || (bytesRead<0 && errno!=EAGAIN && errno!=EWOULDBLOCK))
+                {
+                        closeClient(s,c);
+                        return;
+                }
+                if (bytesRead<0) return;
+                c->requestLen+=bytesRead;
+        }
+}
+
+void metricsHandleEvents(MetricsServer* s, MetricsClient* c, const uint32_t revents)
+{
+        if (revents & (POLLHUP|POLLERR))
+        {
+                closeClient(s,c);
+                return;
+        }
+        serveClient(s,c);
+}
@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "textbuf.h"
+
+#include <stdint.h>
+
+/* Minimal HTTP/1.1 server for Prometheus scrapes. Only GET and HEAD of
+   /metrics (or /) are answered, with the page in the text exposition
+   format. The page is rendered by a callback, at most once per update: the
+   owner sets stale when the data changes, and the next scrape renders the
+   page again. Scrapes in between get the same bytes. The response header
+   and the page are written with one gathered write, straight from the page
+   buffer.
+
+   Connections are kept open between scrapes, unless the client asks
+   otherwise. When all slots are taken, the connection that was idle the
+   longest is closed to make room.
+ */
+
+#define METRICS_MAXCLIENTS  8
+#define METRICS_REQUESTSIZE 2048        /* Request line and headers */
+#define METRICS_HEADERSIZE  192         /* Response header */
+#define METRICS_PAGESIZE    65536
+
+/* Renders the page into page, called with the context given to metricsInit */
+typedef void (*MetricsRender)(void* context, TextBuf* page);
+
+typedef struct
+{
+        int           fd;       /* -1 if not in use */
+        unsigned      generation;       /* Incremented for each new connection in this slot */
+        char          request[METRICS_REQUESTSIZE];
+        int           requestLen;
+        unsigned long lastRequest;      /* Orders the clients by last use */
+
+        /* Response being written */
+        int           responding;
+        int           keepAlive;
+        char          header[METRICS_HEADERSIZE];
+        int           headerLen;
+        const char*   body;     /* The page, or a short error text */
+        int           bodyLen;
+        int           offset;   /* Bytes of header and body written */
+} MetricsClient;
+
+typedef struct
+{
+        MetricsClient clients[METRICS_MAXCLIENTS];
+        char*         page;
+        int           pageLen;
+        int           pageUsers;        /* Responses writing the page, it is not rendered meanwhile */
+        int           stale;            /* Render the page on the next scrape */
+        MetricsRender render;
+        void*         context;
+        int           debug;
+
+        /* Statistics */
+        unsigned long requests;
+        unsigned long scrapes;
+        unsigned long renders;
+} MetricsServer;
+
+/* Returns -1 if no memory is available */
+int metricsInit(MetricsServer* s, MetricsRender render, void* context, const int debug);
+void metricsFree(MetricsServer* s);
+
+/* Accept a connection on the listening socket. Returns the new client, or
+   0 if there is no room. */
+MetricsClient* metricsAccept(MetricsServer* s, const int listenfd);
+
+/* Handle (edge triggered) epoll events on the client's fd, may close the
+   client */
+void metricsHandleEvents(MetricsServer* s, MetricsClient* c, const uint32_t revents);
+
+#endif // METRICS_H
@@ -0,0 +1,483 @@
+#include "modbus.h"
+#include "interface.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MODBUS_MINBACKOFF 500           /* ms, first reconnect delay */
+#define MODBUS_MAXBACKOFF 60000         /* ms */
+#define MODBUS_TIMEOUT    5000          /* ms, reply must be there within this time */
+#define MODBUS_HEADERSIZE 7             /* MBAP header, up to and including unit id */
+#define MODBUS_SPEEDUP    5             /* Polls in time before halving the period */
+#define MODBUS_RATEWINDOW 10000         /* ms, window for computing the achieved rate */
+#define MODBUS_MAXREAD    125           /* Registers in one read request */
+#define SUNSPEC_MERGEGAP  10            /* Reading this many unused registers is cheaper than a request */
+#define SUNSPEC_INVERTER  40070         /* Register number of the inverter model id params[] assume */
+#define SUNSPEC_END       0xFFFF
+
+/* Addresses where the "SunS" marker may be found, in order of likeliness */
+static const uint16_t sunSpecBases[]={ 40000, 50000, 0 };
+
+struct ModbusRequest
+{
+        uint16_t transactionId;
+        uint16_t protocolId;
+        uint16_t length;
+        uint8_t  unitId;
+        uint8_t  functionCode;
+        uint16_t referenceNumber;
+        uint16_t wordCount;
+} __attribute__((packed));
+
+static long msSince(const struct timespec* then, const struct timespec* now)
+{
+        return (now->tv_sec-then->tv_sec)*1000+(now->tv_nsec-then->tv_nsec)/1000000;
+}
+
+static void addMs(struct timespec* t, const int ms)
+{
+        t->tv_sec+=ms/1000;
+        t->tv_nsec+=(ms%1000)*1000000L;
+        if (t->tv_nsec>=1000000000L)
+        {
+                t->tv_sec++;
+                t->tv_nsec-=1000000000L;
+        }
+}
+
+int modbusInit(ModbusClient* c, const ModbusDeviceConfig* config, const int debug)
+{
+        memset(c,0,sizeof(*c));
+        c->config=config;
+        c->debug=debug;
+        c->fd=-1;
+        c->timerfd=-1;
+        c->status=NO_CONNECTION;
+        c->nextTransactionId=1;
+        c->backoffMs=MODBUS_MINBACKOFF;
+        c->data=malloc(2*sizeof(uint16_t)*modbusRegCount);
+        c->values=malloc(2*sizeof(double)*sunSpecParamCount);
+        return (c->data && c->values)?0:-1;
+}
+
+void modbusFree(ModbusClient* c)
+{
+        if (c->fd>=0) close(c->fd);
+        if (c->timerfd>=0) close(c->timerfd);
+        c->fd=-1;
+        c->timerfd=-1;
+        free(c->data);
+        c->data=0;
+        c->activeData=0;
+        free(c->values);
+        c->values=0;
+        c->activeValues=0;
+}
+
+static void closeModbus(ModbusClient* c, const char* reason)
+{
+        /* Drop the connection, and retry after a delay that doubles on each
+         * consecutive failure */
+        if (c->debug) fprintf(stderr,"closing modbus connection %s fd=%i: %s\n",c->config->name,c->fd,reason);
+        if (c->status==CONNECTED) syslog(LOG_INFO,"modbus connection to %s closed: %s",c->config->name,reason);
+        close(c->fd);
+        c->fd=-1;
+        c->status=NO_CONNECTION;
+        c->inFlight=0;
+        c->rxCount=0;
+        c->txCount=0;
+        c->errors++;
+        clock_gettime(CLOCK_MONOTONIC,&c->reconnectAt);
+        addMs(&c->reconnectAt,c->backoffMs);
+        c->backoffMs*=2;
+        if (c->backoffMs>MODBUS_MAXBACKOFF) c->backoffMs=MODBUS_MAXBACKOFF;
+}
+
+static void startConnection(ModbusClient* c)
+{
+        /* Start a non-blocking connect, finished when the fd becomes writable */
+        const ModbusDeviceConfig* cfg=c->config;
+        c->fd=socket(cfg->ai_family, cfg->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, cfg->ai_protocol);
+        if (c->fd<0) return;
+        c->sockets++;
+        if (connect(c->fd,(const struct sockaddr*)&cfg->addr,cfg->addrlen)==0 || errno==EINPROGRESS)
+        {
+                c->status=WAIT_FOR_CONNECTION;
+                if (c->debug) fprintf(stderr,"Initiated new modbus connection to %s: %i\n",cfg->name,c->fd);
+                return;
+        }
+        closeModbus(c,strerror(errno));
+}
+
+static void flushRequests(ModbusClient* c)
+{
+        if (c->txCount==0) return;
+        const int written=write(c->fd,c->txbuf,c->txCount);
+        if (written<0)
+        {
+                if (errno!=EAGAIN && errno!=EWOULDBLOCK) closeModbus(c,strerror(errno));
+                return;
+        }
+        memmove(c->txbuf,c->txbuf+written,c->txCount-written);
+        c->txCount-=written;
+}
+
+static void sendRequest(ModbusClient* c, const uint16_t reference, const uint16_t count, const int range)
+{
+        ModbusPending* p=&c->pending[c->inFlight++];
+        const struct ModbusRequest mbr = {
+                .transactionId=htons(c->nextTransactionId),
+                .protocolId=htons(0),
+                .length=htons(6),
+                .unitId=c->config->unitId,
+                .functionCode=3,
+                .referenceNumber=htons(reference),
+                .wordCount=htons(count)
+        };
+        p->transactionId=c->nextTransactionId++;
+        p->reference=reference;
+        p->count=count;
+        p->range=range;
+        clock_gettime(CLOCK_MONOTONIC,&p->sent);
+        memcpy(c->txbuf+c->txCount,&mbr,sizeof(mbr));
+        c->txCount+=sizeof(mbr);
+        c->requests++;
+        flushRequests(c);
+}
+
+static void pollDevice(ModbusClient* c)
+{
+        int i;
+        c->rangesReceived=0;
+        for (i=0;i<c->rangeCount;i++)
+        {
+                sendRequest(c,c->ranges[i].address,c->ranges[i].count,i);
+        }
+}
+
+static void buildRanges(ModbusClient* c, const int inverterAddress, const int limit)
+{
+        /* Mark the registers params[] need, and read them in as few requests
+         * as possible: close ranges are merged, reading the unused registers
+         * in between */
+        unsigned char needed[modbusRegCount];
+        SunSpecValue* ssv;
+        int i, j;
+        c->rangeCount=0;
+        memset(needed,0,sizeof(needed));
+        for (ssv=getParam(0);ssv->valueFieldNr;ssv++)
+        {
+                const int offset=ssv->valueFieldNr-modbusBase;
+                if (ssv->valueFieldNr<SUNSPEC_INVERTER) continue;
+                for (i=0;i<ssv->valueLength;i++) needed[offset+i]=1;
+                needed[offset+ssv->scaleFieldOffset]=1;
+        }
+        for (i=0;i<modbusRegCount;)
+        {
+                int end=i+1;
+                if (!needed[i])
+                {
+                        i++;
+                        continue;
+                }
+                for (j=end;j<modbusRegCount && j-i<MODBUS_MAXREAD;j++)
+                {
+                        if (!needed[j]) continue;
+                        if (j-end>=SUNSPEC_MERGEGAP) break;
+                        end=j+1;
+                }
+                const int address=inverterAddress+modbusBase+i-SUNSPEC_INVERTER;
+                const int count=(address+end-i>limit)?limit-address:end-i;
+                if (count>0)
+                {
+                        if (c->rangeCount==MODBUS_MAXRANGES)
+                        {
+                                syslog(LOG_INFO,"modbus %s: too many register ranges, ignoring the rest",c->config->name);
+                                break;
+                        }
+                        const ModbusRange r={ .address=address, .count=count, .offset=i };
+                        c->ranges[c->rangeCount++]=r;
+                        if (c->debug) fprintf(stderr,"modbus %s: reading %i registers from %i\n",c->config->name,count,address);
+                }
+                i=end;
+        }
+}
+
+static void finishDiscovery(ModbusClient* c)
+{
+        int i;
+        int inverterAddress=SUNSPEC_INVERTER-1;
+        int limit=0x10000;
+        c->discovery=DISCOVERED;
+        if (c->modelCount)
+        {
+                for (i=0;i<c->modelCount && (c->models[i].id<101 || c->models[i].id>103);i++);
+                if (i==c->modelCount)
+                {
+                        syslog(LOG_INFO,"modbus %s: no SunSpec inverter model found",c->config->name);
+                        c->rangeCount=0;
+                        return;
+                }
+                inverterAddress=c->models[i].address;
+                limit=inverterAddress+2+c->models[i].length;
+        } else {
+                syslog(LOG_INFO,"modbus %s: no SunSpec marker found, assuming the default layout",c->config->name);
+        }
+        buildRanges(c,inverterAddress,limit);
+        pollDevice(c);
+}
+
+static void startDiscovery(ModbusClient* c)
+{
+        c->discovery=DISCOVER_MARKER;
+        c->baseIndex=0;
+        c->modelCount=0;
+        sendRequest(c,sunSpecBases[0],2,-1);
+}
+
+static void handleDiscovery(ModbusClient* c, const ModbusPending* p, const unsigned char* regs, const int ok)
+{
+        /* regs holds the two registers read at p->reference, if ok */
+        const uint16_t r0=ok?(regs[0]<<8)|regs[1]:0;
+        const uint16_t r1=ok?(regs[2]<<8)|regs[3]:0;
+        int next;
+        switch (c->discovery)
+        {
+                case DISCOVER_MARKER:
+                        if (ok && r0==0x5375 && r1==0x6E53) /* "SunS" */
+                        {
+                                c->discovery=DISCOVER_MODELS;
+                                next=p->reference+2;
+                        } else if (++c->baseIndex<(int)(sizeof(sunSpecBases)/sizeof(sunSpecBases[0]))) {
+                                next=sunSpecBases[c->baseIndex];
+                        } else {
+                                return finishDiscovery(c);
+                        }
+                        break;
+                case DISCOVER_MODELS:
+                        if (!ok || r0==SUNSPEC_END || c->modelCount==MODBUS_MAXMODELS) return finishDiscovery(c);
+                        const SunSpecModel m={ .id=r0, .address=p->reference, .length=r1 };
+                        c->models[c->modelCount++]=m;
+                        if (c->debug) fprintf(stderr,"modbus %s: model %i at %i, length %i\n",c->config->name,r0,p->reference,r1);
+                        next=p->reference+2+r1;
+                        if (next+2>0x10000) return finishDiscovery(c);
+                        break;
+                default:
+                        return;
+        }
+        sendRequest(c,next,2,-1);
+}
+
+static int armTimer(ModbusClient* c)
+{
+        struct itimerspec value;
+        value.it_value.tv_sec=c->periodMs/1000;
+        value.it_value.tv_nsec=(c->periodMs%1000)*1000000L;
+        value.it_interval=value.it_value;
+        return timerfd_settime(c->timerfd,0,&value,NULL);
+}
+
+int modbusStartTimer(ModbusClient* c, const int periodMs)
+{
+        c->requestedPeriodMs=periodMs<MODBUS_MINPERIOD?MODBUS_MINPERIOD:periodMs;
+        c->periodMs=c->requestedPeriodMs;
+        clock_gettime(CLOCK_MONOTONIC,&c->windowStart);
+        c->timerfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK);
+        if (c->timerfd==-1)
+        {
+                perror("timerfd_create");
+                return -1;
+        }
+        if (armTimer(c)==-1)
+        {
+                perror("timerfd_settime");
+                return -1;
+        }
+        return 0;
+}
+
+static void setPeriod(ModbusClient* c, int periodMs)
+{
+        if (periodMs<c->requestedPeriodMs) periodMs=c->requestedPeriodMs;
+        if (periodMs>MODBUS_MAXPERIOD) periodMs=MODBUS_MAXPERIOD;
+        if (periodMs==c->periodMs) return;
+        if (c->debug) fprintf(stderr,"modbus poll period %i -> %i ms\n",c->periodMs,periodMs);
+        c->periodMs=periodMs;
+        armTimer(c);
+}
+
+static void updateRate(ModbusClient* c, const struct timespec* now)
+{
+        const long elapsed=msSince(&c->windowStart,now);
+        if (elapsed<MODBUS_RATEWINDOW) return;
+        c->achievedRate=c->windowReplies*1000./elapsed;
+        c->windowReplies=0;
+        c->windowStart=*now;
+}
+
+double modbusAchievedRate(const ModbusClient* c)
+{
+        /* Rate over the last complete window, or over the current one if
+         * there is no complete window yet */
+        struct timespec now;
+        if (c->achievedRate>0) return c->achievedRate;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        const long elapsed=msSince(&c->windowStart,&now);
+        return elapsed>0?c->windowReplies*1000./elapsed:0;
+}
+
+void modbusTimerExpired(ModbusClient* c)
+{
+        struct timespec now;
+        uint64_t expirations;
+        if (read(c->timerfd,&expirations,sizeof(expirations))!=sizeof(expirations)) return;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        updateRate(c,&now);
+        switch (c->status)
+        {
+                case NO_CONNECTION:
+                        if (msSince(&c->reconnectAt,&now)>=0) startConnection(c);
+                        break;
+                case WAIT_FOR_CONNECTION:
+                        break;
+                case CONNECTED:
+                        if (c->inFlight>0 && msSince(&c->pending[0].sent,&now)>MODBUS_TIMEOUT)
+                        {
+                                closeModbus(c,"timeout waiting for reply");
+                                break;
+                        }
+                        if (c->discovery!=DISCOVERED) break;
+                        if (c->inFlight>0)
+                        {
+                                /* Device can't keep up, poll less often */
+                                c->overruns++;
+                                c->onTime=0;
+                                setPeriod(c,2*c->periodMs);
+                                break;
+                        }
+                        if (c->periodMs>c->requestedPeriodMs && ++c->onTime>=MODBUS_SPEEDUP)
+                        {
+                                c->onTime=0;
+                                setPeriod(c,c->periodMs/2);
+                        }
+                        pollDevice(c);
+                        break;
+        }
+}
+
+static void handleReply(ModbusClient* c, const unsigned char* frame, const int len)
+{
+        /* frame holds the MBAP header followed by the PDU */
+        const uint16_t tid=(frame[0]<<8)|frame[1];
+        const unsigned char functionCode=frame[7];
+        int i;
+        for (i=0;i<c->inFlight && c->pending[i].transactionId!=tid;i++);
+        if (i==c->inFlight)
+        {
+                if (c->debug) fprintf(stderr,"modbus: reply with unknown transaction id %i\n",tid);
+                return;
+        }
+        const ModbusPending p=c->pending[i];
+        memmove(c->pending+i,c->pending+i+1,(c->inFlight-i-1)*sizeof(ModbusPending));
+        c->inFlight--;
+        histogramRecordSince(&c->latency,&p.sent);
+
+        const int byteCount=frame[8];
+        const int ok=!(functionCode&0x80) && byteCount==2*p.count && len>=9+byteCount;
+        if (p.range<0) return handleDiscovery(c,&p,frame+9,ok);
+        if (!ok)
+        {
+                c->errors++;
+                if (c->debug) fprintf(stderr,"modbus: exception %i for transaction %i\n",len>8?frame[8]:0,tid);
+                return;
+        }
+        /* Make the data active when all ranges of the poll are in */
+        uint16_t* buf=(c->activeData==c->data)?c->data+modbusRegCount:c->data;
+        memcpy(buf+c->ranges[p.range].offset,frame+9,byteCount);
+        if (++c->rangesReceived<c->rangeCount) return;
+        clock_gettime(CLOCK_REALTIME,&c->updateTime);
+        double* values=(c->activeValues==c->values)?c->values+sunSpecParamCount:c->values;
+        decodeSunSpec(buf,values);
+        c->activeData=buf;
+        c->activeValues=values;
+        c->replies++;
+        c->windowReplies++;
+}
+
+static void readReplies(ModbusClient* c)
+{
+        while (1)
+        {
+                const int bytesRead=read(c->fd,c->rxbuf+c->rxCount,sizeof(c->rxbuf)-c->rxCount);
+                if (bytesRead==0)
+                {
+                        closeModbus(c,"connection closed by peer");
+                        return;
+                }
+                if (bytesRead<0)
+                {
+                        if (errno!=EAGAIN && errno!=EWOULDBLOCK) closeModbus(c,strerror(errno));
+                        return;
+                }
+                c->rxCount+=bytesRead;
+                /* Handle all complete frames in the buffer */
+                int offset=0;
+                while (c->rxCount-offset>=MODBUS_HEADERSIZE)
+                {
+                        const unsigned char* frame=c->rxbuf+offset;
+                        const int length=(frame[4]<<8)|frame[5];
+                        const int frameSize=6+length;
+                        if (length<2 || frameSize>MODBUS_FRAMESIZE)
+                        {
+                                closeModbus(c,"invalid reply");
+                                return;
+                        }
+                        if (c->rxCount-offset<frameSize) break;
+                        handleReply(c,frame,frameSize);
+                        offset+=frameSize;
+                }
+                memmove(c->rxbuf,c->rxbuf+offset,c->rxCount-offset);
+                c->rxCount-=offset;
+        }
+}
+
+void modbusHandleEvents(ModbusClient* c, const uint32_t revents)
+{
+        if (c->debug) fprintf(stderr,"modbusstatus: %i revents %u\n",c->status,revents);
+        switch (c->status)
+        {
+                case WAIT_FOR_CONNECTION:
+                        if (revents & (POLLOUT|POLLERR|POLLHUP))
+                        {
+                                /* connect() finished, check if it succeeded */
+                                int optval=0; socklen_t optlen=sizeof(int);
+                                const int sockoptret=getsockopt(c->fd,SOL_SOCKET,SO_ERROR,&optval,&optlen);
+                                if (sockoptret==0 && optval==0)
+                                {
+                                        if (c->debug) fprintf(stderr,"modbus got connected\n");
+                                        c->status=CONNECTED;
+                                        c->backoffMs=MODBUS_MINBACKOFF;
+                                        c->connects++;
+                                        /* Find the SunSpec layout, the first poll
+                                         * follows without waiting for the timer */
+                                        startDiscovery(c);
+                                } else {
+                                        closeModbus(c,strerror(sockoptret?errno:optval));
+                                }
+                        }
+                        break;
+                case CONNECTED:
+                        if (revents & POLLOUT) flushRequests(c);
+                        if (c->status==CONNECTED && (revents & (POLLIN|POLLERR|POLLHUP))) readReplies(c);
+                        break;
+                default:
+                        break;
+        }
+}
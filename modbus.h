@@ -0,0 +1,151 @@
+#ifndef MODBUS_H
+#define MODBUS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "histogram.h"
+
+/* Modbus TCP client for a SunSpec device. The connection is kept open between
+   polls; requests carry increasing transaction ids and several may be in
+   flight, replies are matched by transaction id. On errors the connection is
+   closed and reopened with an increasing delay.
+
+   Polling is driven by a CLOCK_MONOTONIC timerfd per client. When a poll is
+   due while the previous request is still unanswered, the poll period is
+   doubled; after a number of polls answered in time it is halved again,
+   until it is back at the requested period.
+
+   After connecting, the SunSpec model chain of the device is walked: the
+   "SunS" marker, followed by model id and length pairs up to the end marker.
+   The registers of the inverter model that params[] refer to are then read
+   as a few merged ranges, wherever the model is located on the device.
+ */
+
+#define MODBUS_MAXINFLIGHT 4
+#define MODBUS_FRAMESIZE   260  /* Largest Modbus TCP frame */
+#define MODBUS_MINPERIOD   100  /* ms */
+#define MODBUS_MAXPERIOD   10000 /* ms, upper limit when slowing down */
+#define MODBUS_MAXDEVICES  16
+#define MODBUS_NAMESIZE    32
+#define MODBUS_MAXMODELS   16
+#define MODBUS_MAXRANGES   MODBUS_MAXINFLIGHT   /* All ranges of a poll are sent at once */
+
+/* A device to poll, from the command line or the configuration file */
+typedef struct
+{
+        char             name[MODBUS_NAMESIZE];
+        struct sockaddr_storage addr;
+        socklen_t        addrlen;
+        int              ai_family;
+        int              ai_socktype;
+        int              ai_protocol;
+        uint8_t          unitId;
+} ModbusDeviceConfig;
+
+enum ModBusStatus { NO_CONNECTION, WAIT_FOR_CONNECTION, CONNECTED };
+
+enum SunSpecDiscovery { DISCOVER_MARKER, DISCOVER_MODELS, DISCOVERED };
+
+/* SunSpec model found on the device, address is that of its id register */
+typedef struct
+{
+        uint16_t        id;
+        uint16_t        address;
+        uint16_t        length;
+} SunSpecModel;
+
+/* Registers read on each poll: count registers from address on the device,
+   stored from data[offset] on */
+typedef struct
+{
+        uint16_t        address;
+        uint16_t        count;
+        uint16_t        offset;
+} ModbusRange;
+
+typedef struct
+{
+        uint16_t        transactionId;
+        uint16_t        reference;
+        uint16_t        count;
+        int             range;  /* Index in ranges, -1 for discovery */
+        struct timespec sent;   /* CLOCK_MONOTONIC */
+} ModbusPending;
+
+typedef struct
+{
+        /* Configuration */
+        const ModbusDeviceConfig* config;
+        int              debug;
+
+        /* Scheduling */
+        int              timerfd;
+        int              requestedPeriodMs;
+        int              periodMs;      /* Current period, >= requestedPeriodMs */
+        int              onTime;        /* Consecutive polls answered in time */
+
+        /* Connection state */
+        int              fd;
+        enum ModBusStatus status;
+        uint16_t         nextTransactionId;
+        ModbusPending    pending[MODBUS_MAXINFLIGHT];
+        int              inFlight;
+        unsigned char    rxbuf[2*MODBUS_FRAMESIZE];
+        int              rxCount;
+        unsigned char    txbuf[MODBUS_MAXINFLIGHT*12];
+        int              txCount;
+        struct timespec  reconnectAt;   /* CLOCK_MONOTONIC */
+        int              backoffMs;
+
+        /* SunSpec layout of the device, found after connecting */
+        enum SunSpecDiscovery discovery;
+        int              baseIndex;     /* Marker location being tried */
+        SunSpecModel     models[MODBUS_MAXMODELS];
+        int              modelCount;
+        ModbusRange      ranges[MODBUS_MAXRANGES];
+        int              rangeCount;
+        int              rangesReceived; /* Of the current poll */
+
+        /* Register data: two buffers of modbusRegCount registers, laid out
+         * as params[] expect. One is filled by replies, the other is active.
+         * Registers are kept in network byte order. activeData is 0 until
+         * all ranges of the first poll arrived. */
+        uint16_t*        data;
+        uint16_t*        activeData;
+        double*          values;        /* Two buffers of decoded parameters */
+        double*          activeValues;  /* Belongs to activeData */
+        struct timespec  updateTime;    /* CLOCK_REALTIME of last reply */
+
+        /* Statistics */
+        unsigned long    sockets;       /* Sockets created, identifies the current fd */
+        unsigned long    connects;
+        unsigned long    requests;
+        unsigned long    replies;
+        unsigned long    errors;
+        unsigned long    overruns;      /* Polls due while a request was pending */
+        Histogram        latency;       /* ns from request to reply */
+        unsigned long    windowReplies; /* Replies since windowStart */
+        struct timespec  windowStart;
+        double           achievedRate;  /* Replies per second over the last window */
+} ModbusClient;
+
+/* Returns -1 if no memory is available for the register buffers */
+int modbusInit(ModbusClient* c, const ModbusDeviceConfig* config, const int debug);
+void modbusFree(ModbusClient* c);
+
+/* Create the poll timer, returns -1 on failure */
+int modbusStartTimer(ModbusClient* c, const int periodMs);
+
+/* Called when c->timerfd is readable: (re)connects when needed, and sends a
+   request */
+void modbusTimerExpired(ModbusClient* c);
+
+/* Replies per second actually received */
+double modbusAchievedRate(const ModbusClient* c);
+
+/* Handle epoll events on c->fd */
+void modbusHandleEvents(ModbusClient* c, const uint32_t revents);
+
+#endif // MODBUS_H
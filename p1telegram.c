@@ -0,0 +1,356 @@
+#include "p1telegram.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OBIS reference A-B:C.D.E packed into one number, for quick comparison */
+#define OBIS(a,b,c,d,e) (((uint64_t)(a)<<32)|((uint64_t)(b)<<24)|((c)<<16)|((d)<<8)|(e))
+
+typedef struct
+{
+        uint64_t    key;
+        int         group;      /* Which (...) group on the line holds the value */
+        const char* obis;
+} ObisDefinition;
+
+static const ObisDefinition obisTable[P1_FIELD_COUNT] = {
+        [P1_TIMESTAMP]         = { OBIS(0,0,1,0,0),    0, "0-0:1.0.0"   },
+        [P1_USED_TARIFF1]      = { OBIS(1,0,1,8,1),    0, "1-0:1.8.1"   },
+        [P1_USED_TARIFF2]      = { OBIS(1,0,1,8,2),    0, "1-0:1.8.2"   },
+        [P1_PRODUCED_TARIFF1]  = { OBIS(1,0,2,8,1),    0, "1-0:2.8.1"   },
+        [P1_PRODUCED_TARIFF2]  = { OBIS(1,0,2,8,2),    0, "1-0:2.8.2"   },
+        [P1_TARIFF]            = { OBIS(0,0,96,14,0),  0, "0-0:96.14.0" },
+        [P1_POWER_USED]        = { OBIS(1,0,1,7,0),    0, "1-0:1.7.0"   },
+        [P1_POWER_PRODUCED]    = { OBIS(1,0,2,7,0),    0, "1-0:2.7.0"   },
+        [P1_POWER_FAILURES]    = { OBIS(0,0,96,7,21),  0, "0-0:96.7.21" },
+        [P1_VOLTAGE_L1]        = { OBIS(1,0,32,7,0),   0, "1-0:32.7.0"  },
+        [P1_VOLTAGE_L2]        = { OBIS(1,0,52,7,0),   0, "1-0:52.7.0"  },
+        [P1_VOLTAGE_L3]        = { OBIS(1,0,72,7,0),   0, "1-0:72.7.0"  },
+        [P1_CURRENT_L1]        = { OBIS(1,0,31,7,0),   0, "1-0:31.7.0"  },
+        [P1_CURRENT_L2]        = { OBIS(1,0,51,7,0),   0, "1-0:51.7.0"  },
+        [P1_CURRENT_L3]        = { OBIS(1,0,71,7,0),   0, "1-0:71.7.0"  },
+        [P1_POWER_USED_L1]     = { OBIS(1,0,21,7,0),   0, "1-0:21.7.0"  },
+        [P1_POWER_USED_L2]     = { OBIS(1,0,41,7,0),   0, "1-0:41.7.0"  },
+        [P1_POWER_USED_L3]     = { OBIS(1,0,61,7,0),   0, "1-0:61.7.0"  },
+        [P1_POWER_PRODUCED_L1] = { OBIS(1,0,22,7,0),   0, "1-0:22.7.0"  },
+        [P1_POWER_PRODUCED_L2] = { OBIS(1,0,42,7,0),   0, "1-0:42.7.0"  },
+        [P1_POWER_PRODUCED_L3] = { OBIS(1,0,62,7,0),   0, "1-0:62.7.0"  },
+        [P1_GAS_TIME]          = { OBIS(0,1,24,2,1),   0, "0-1:24.2.1"  },
+        [P1_GAS]               = { OBIS(0,1,24,2,1),   1, "0-1:24.2.1"  },
+};
+
+#define MAXGROUPS 2
+
+static const char* parseNumber(const char* c, const char* end, unsigned* nr)
+{
+        /* Returns pointer after the digits, 0 if there are no digits */
+        const char* start=c;
+        *nr=0;
+        while (c<end && *c>='0' && *c<='9') *nr=*nr*10+(*c++-'0');
+        return c==start?0:c;
+}
+
+static const char* parseObis(const char* c, const char* end, uint64_t* key)
+{
+        /* Parse A-B:C.D.E up to the first '(', returns pointer to the '(' or 0
+         * if the line does not start with an OBIS reference */
+        static const char separators[]="-:..(";
+        unsigned nr[5];
+        int i;
+        for (i=0;i<5;i++)
+        {
+                c=parseNumber(c,end,&nr[i]);
+                if (!c || c>=end || *c!=separators[i] || nr[i]>255) return 0;
+                if (i<4) c++;
+        }
+        *key=OBIS(nr[0],nr[1],nr[2],nr[3],nr[4]);
+        return c;
+}
+
+static time_t toUnixTime(const char* c, const char* end)
+{
+        /* Convert YYMMDDhhmmssX, X is W for winter (CET) and S for summer
+         * (CEST) time */
+        int part[6];
+        int i;
+        if (end-c<13) return 0;
+        for (i=0;i<6;i++,c+=2)
+        {
+                if (c[0]<'0' || c[0]>'9' || c[1]<'0' || c[1]>'9') return 0;
+                part[i]=(c[0]-'0')*10+(c[1]-'0');
+        }
+        struct tm tm;
+        memset(&tm,0,sizeof(tm));
+        tm.tm_year=100+part[0];
+        tm.tm_mon=part[1]-1;
+        tm.tm_mday=part[2];
+        tm.tm_hour=part[3];
+        tm.tm_min=part[4];
+        tm.tm_sec=part[5];
+        return timegm(&tm)-(*c=='S'?7200:3600);
+}
+
+static void storeValue(P1Telegram* t, const enum P1Field field, const char* group, const char* groupEnd)
+{
+        char* numEnd;
+        t->value[field]=strtod(group,&numEnd);
+        if (numEnd==group || numEnd>groupEnd)
+        {
+                t->value[field]=0;
+                return;
+        }
+        t->present|=1u<<field;
+        if (numEnd<groupEnd && *numEnd=='*')
+        {
+                int len=groupEnd-numEnd-1;
+                if (len>=P1_UNITSIZE) len=P1_UNITSIZE-1;
+                memcpy(t->unit[field],numEnd+1,len);
+                t->unit[field][len]='\0';
+        }
+        if (field==P1_TIMESTAMP) t->timestamp=toUnixTime(group,groupEnd);
+        if (field==P1_GAS_TIME) t->gasTimestamp=toUnixTime(group,groupEnd);
+}
+
+int parseP1Telegram(const char* data, const int len, P1Telegram* t)
+{
+        const char* c=data;
+        const char* end=data+len;
+        int found=0;
+
+        memset(t,0,sizeof(*t));
+        t->raw=data;
+        t->rawLen=len;
+
+        while (c<end && *c!='!')
+        {
+                const char* eol=memchr(c,'\n',end-c);
+                if (!eol) eol=end;
+                uint64_t key;
+                const char* brace=parseObis(c,eol,&key);
+                if (brace)
+                {
+                        /* Locate the (...) groups on this line */
+                        const char* group[MAXGROUPS];
+                        const char* groupEnd[MAXGROUPS];
+                        int groups=0;
+                        while (groups<MAXGROUPS && brace && brace<eol && *brace=='(')
+                        {
+                                const char* close=memchr(brace,')',eol-brace);
+                                if (!close) break;
+                                group[groups]=brace+1;
+                                groupEnd[groups]=close;
+                                groups++;
+                                brace=close+1;
+                        }
+                        int f;
+                        for (f=0;f<P1_FIELD_COUNT;f++)
+                        {
+                                if (obisTable[f].key==key && obisTable[f].group<groups)
+                                {
+                                        storeValue(t,f,group[obisTable[f].group],groupEnd[obisTable[f].group]);
+                                        found++;
+                                }
+                        }
+                }
+                c=eol+1;
+        }
+        return found;
+}
+
+double p1Value(const P1Telegram* t, const enum P1Field field)
+{
+        return (t->present & (1u<<field))?t->value[field]:NAN;
+}
+
+const char* p1FieldObis(const enum P1Field field)
+{
+        return obisTable[field].obis;
+}
+
+/* Reader states */
+#define SEEK_START 0    /* Waiting for '/' */
+#define IN_BODY    1    /* Between '/' and '!', CRC is being computed */
+#define IN_CRC     2    /* After '!', waiting for the CRC digits and line feed */
+
+/* Slice-by-8 tables: crcTable[0] is the plain byte-wise table, crcTable[k]
+ * gives the contribution of a byte k positions before the end of an 8 byte
+ * block */
+static uint16_t crcTable[8][256];
+static int crcTableReady=0;
+
+static void initCrcTable()
+{
+        int i, j, k;
+        for (i=0;i<256;i++)
+        {
+                uint16_t crc=i;
+                for (j=0;j<8;j++) crc=(crc&1)?(crc>>1)^0xA001:(crc>>1);
+                crcTable[0][i]=crc;
+        }
+        for (k=1;k<8;k++)
+        {
+                for (i=0;i<256;i++)
+                {
+                        const uint16_t prev=crcTable[k-1][i];
+                        crcTable[k][i]=(prev>>8)^crcTable[0][prev&0xff];
+                }
+        }
+        crcTableReady=1;
+}
+
+static inline uint64_t load64(const unsigned char* p)
+{
+        /* Little endian load, independent of the byte order of the host */
+        return (uint64_t)p[0]|((uint64_t)p[1]<<8)|((uint64_t)p[2]<<16)|((uint64_t)p[3]<<24)|
+                ((uint64_t)p[4]<<32)|((uint64_t)p[5]<<40)|((uint64_t)p[6]<<48)|((uint64_t)p[7]<<56);
+}
+
+static inline uint16_t crcBlock(const uint16_t crc, uint64_t v)
+{
+        v^=crc;
+        return crcTable[7][v&0xff]^crcTable[6][(v>>8)&0xff]^
+                crcTable[5][(v>>16)&0xff]^crcTable[4][(v>>24)&0xff]^
+                crcTable[3][(v>>32)&0xff]^crcTable[2][(v>>40)&0xff]^
+                crcTable[1][(v>>48)&0xff]^crcTable[0][v>>56];
+}
+
+static inline uint16_t crcByte(const uint16_t crc, const unsigned char c)
+{
+        return (crc>>8)^crcTable[0][(crc^c)&0xff];
+}
+
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+/* Non-zero if one of the 8 bytes in x is zero */
+#define HASZERO(x) (((x)-ONES)&~(x)&HIGHS)
+
+static int crcUntilMarker(uint16_t* crc, const unsigned char* p, const int len)
+{
+        /* Update crc with the data up to the first '/' or '!', 8 bytes at a
+         * time as long as the block holds no marker. Returns the offset of
+         * the marker, or len if there is none */
+        uint16_t c=*crc;
+        int i=0;
+        while (i+8<=len)
+        {
+                const uint64_t v=load64(p+i);
+                if (HASZERO(v^(ONES*'!')) || HASZERO(v^(ONES*'/'))) break;
+                c=crcBlock(c,v);
+                i+=8;
+        }
+        for (;i<len;i++)
+        {
+                if (p[i]=='!' || p[i]=='/') break;
+                c=crcByte(c,p[i]);
+        }
+        *crc=c;
+        return i;
+}
+
+uint16_t p1Crc16(uint16_t crc, const char* data, const int len)
+{
+        const unsigned char* p=(const unsigned char*)data;
+        int i=0;
+        if (!crcTableReady) initCrcTable();
+        for (;i+8<=len;i+=8) crc=crcBlock(crc,load64(p+i));
+        for (;i<len;i++) crc=crcByte(crc,p[i]);
+        return crc;
+}
+
+void p1ReaderReset(P1Reader* r)
+{
+        r->scanned=0;
+        r->state=SEEK_START;
+        r->end=0;
+        r->crc=0;
+}
+
+static int hexValue(const char* c, const int len)
+{
+        int i, val=0;
+        for (i=0;i<len;i++)
+        {
+                const char h=c[i];
+                val<<=4;
+                if (h>='0' && h<='9') val|=h-'0';
+                else if (h>='A' && h<='F') val|=h-'A'+10;
+                else if (h>='a' && h<='f') val|=h-'a'+10;
+                else return -1;
+        }
+        return val;
+}
+
+enum DataComplete p1ReaderScan(P1Reader* r, char* buf, int* count)
+{
+        if (!crcTableReady) initCrcTable();
+        while (1)
+        {
+                switch (r->state)
+                {
+                        case SEEK_START:
+                        {
+                                char* start=memchr(buf+r->scanned,'/',*count-r->scanned);
+                                if (!start)
+                                {
+                                        /* Nothing useful read yet, drop it */
+                                        *count=0;
+                                        r->scanned=0;
+                                        return INCOMPLETE;
+                                }
+                                const int skip=start-buf;
+                                if (skip)
+                                {
+                                        memmove(buf,start,*count-skip);
+                                        *count-=skip;
+                                }
+                                r->crc=crcByte(0,'/');
+                                r->scanned=1;
+                                r->state=IN_BODY;
+                                break;
+                        }
+                        case IN_BODY:
+                        {
+                                r->scanned+=crcUntilMarker(&r->crc,(unsigned char*)buf+r->scanned,*count-r->scanned);
+                                if (r->scanned==*count) return INCOMPLETE;
+                                if (buf[r->scanned]=='/')
+                                {
+                                        /* Start of a new telegram before the end of the
+                                         * current one, so that one was truncated: resync
+                                         * on the new one */
+                                        r->state=SEEK_START;
+                                        break;
+                                }
+                                r->crc=crcByte(r->crc,'!');
+                                r->scanned++;
+                                r->state=IN_CRC;
+                                break;
+                        }
+                        case IN_CRC:
+                        {
+                                /* r->scanned stays at the first character after the '!' */
+                                const char* crcText=buf+r->scanned;
+                                const char* lf=memchr(crcText,'\n',*count-r->scanned);
+                                if (!lf)
+                                {
+                                        if (*count-r->scanned<8) return INCOMPLETE;
+                                        r->end=*count;
+                                        r->crcErrors++;
+                                        return COMPLETE_WITH_ERROR;
+                                }
+                                int digits=lf-crcText;
+                                if (digits>0 && lf[-1]=='\r') digits--;
+                                r->end=lf-buf+1;
+                                /* Telegrams before DSMR 4 have no CRC, accept those */
+                                if (digits==0 || (digits==4 && hexValue(crcText,4)==r->crc))
+                                {
+                                        r->telegrams++;
+                                        return COMPLETE;
+                                }
+                                r->crcErrors++;
+                                return COMPLETE_WITH_ERROR;
+                        }
+                }
+        }
+}
@@ -0,0 +1,88 @@
+#ifndef P1TELEGRAM_H
+#define P1TELEGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Fields of a DSMR telegram we are interested in. Each telegram is parsed once
+   when it is complete, the values end up in P1Telegram.value[] indexed by
+   these numbers, so queries do not have to search the telegram text again.
+ */
+enum P1Field
+{
+        P1_TIMESTAMP,           /* 0-0:1.0.0 YYMMDDhhmmssX, as number */
+        P1_USED_TARIFF1,        /* 1-0:1.8.1 */
+        P1_USED_TARIFF2,        /* 1-0:1.8.2 */
+        P1_PRODUCED_TARIFF1,    /* 1-0:2.8.1 */
+        P1_PRODUCED_TARIFF2,    /* 1-0:2.8.2 */
+        P1_TARIFF,              /* 0-0:96.14.0 */
+        P1_POWER_USED,          /* 1-0:1.7.0 */
+        P1_POWER_PRODUCED,      /* 1-0:2.7.0 */
+        P1_POWER_FAILURES,      /* 0-0:96.7.21 */
+        P1_VOLTAGE_L1,          /* 1-0:32.7.0 */
+        P1_VOLTAGE_L2,          /* 1-0:52.7.0 */
+        P1_VOLTAGE_L3,          /* 1-0:72.7.0 */
+        P1_CURRENT_L1,          /* 1-0:31.7.0 */
+        P1_CURRENT_L2,          /* 1-0:51.7.0 */
+        P1_CURRENT_L3,          /* 1-0:71.7.0 */
+        P1_POWER_USED_L1,       /* 1-0:21.7.0 */
+        P1_POWER_USED_L2,       /* 1-0:41.7.0 */
+        P1_POWER_USED_L3,       /* 1-0:61.7.0 */
+        P1_POWER_PRODUCED_L1,   /* 1-0:22.7.0 */
+        P1_POWER_PRODUCED_L2,   /* 1-0:42.7.0 */
+        P1_POWER_PRODUCED_L3,   /* 1-0:62.7.0 */
+        P1_GAS_TIME,            /* 0-1:24.2.1 first value: YYMMDDhhmmssX, as number */
+        P1_GAS,                 /* 0-1:24.2.1 second value */
+        P1_FIELD_COUNT
+};
+
+#define P1_UNITSIZE 8
+
+typedef struct
+{
+        const char* raw;        /* Telegram text the values were parsed from */
+        int         rawLen;
+        unsigned    present;    /* Bit (1<<field) set if field was found */
+        double      value[P1_FIELD_COUNT];     /* 0 if not present */
+        char        unit[P1_FIELD_COUNT][P1_UNITSIZE];
+        time_t      timestamp;      /* P1_TIMESTAMP as unix time, 0 if unknown */
+        time_t      gasTimestamp;   /* P1_GAS_TIME as unix time, 0 if unknown */
+} P1Telegram;
+
+/* Parse telegram text of len bytes into t. Returns the number of fields found.
+   t->raw keeps pointing to data, so data must stay valid as long as t is used. */
+int parseP1Telegram(const char* data, const int len, P1Telegram* t);
+
+/* Value of a field, NAN if the telegram did not contain it */
+double p1Value(const P1Telegram* t, const enum P1Field field);
+
+/* OBIS reference of a field, e.g. "1-0:1.8.1" */
+const char* p1FieldObis(const enum P1Field field);
+
+enum DataComplete { INCOMPLETE, COMPLETE, COMPLETE_WITH_ERROR };
+
+/* Incremental framing of telegrams read from the serial port. Each byte is
+   looked at once: the reader remembers how far it got, finds the '/' and '!'
+   markers and keeps the DSMR CRC16 (poly 0xA001, covering '/' up to and
+   including '!') up to date while data arrives. */
+typedef struct
+{
+        int      scanned;       /* Bytes of the buffer examined so far */
+        int      state;         /* Position within the telegram, see p1telegram.c */
+        int      end;           /* Length of the telegram incl. CRC and CRLF, when complete */
+        uint16_t crc;
+        unsigned long telegrams;        /* Telegrams received with valid (or no) CRC */
+        unsigned long crcErrors;        /* Telegrams dropped because of a wrong CRC */
+} P1Reader;
+
+/* Start looking for a new telegram, the counters are kept */
+void p1ReaderReset(P1Reader* r);
+
+/* Continue scanning buf, which now holds count bytes. Data before the start
+   of a telegram is removed from buf, so count may be decreased. */
+enum DataComplete p1ReaderScan(P1Reader* r, char* buf, int* count);
+
+/* CRC16 as used by DSMR, crc is the CRC of the preceding data, 0 at start */
+uint16_t p1Crc16(uint16_t crc, const char* data, const int len);
+
+#endif // P1TELEGRAM_H
@@ -0,0 +1,51 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_ALIGN 16
+
+int poolInit(Pool* p, const char* name, const size_t blockSize, const int blocks)
+{
+        memset(p,0,sizeof(*p));
+        p->name=name;
+        /* A released block holds the free list link */
+        const size_t size=blockSize<sizeof(void*)?sizeof(void*):blockSize;
+        p->blockSize=(size+POOL_ALIGN-1)&~(size_t)(POOL_ALIGN-1);
+        p->blocks=blocks;
+        /* Large enough to be mapped, pages stay untouched until carved */
+        p->memory=malloc(p->blockSize*(blocks>0?blocks:1));
+        return p->memory?0:-1;
+}
+
+void poolFree(Pool* p)
+{
+        free(p->memory);
+        p->memory=0;
+        p->freeList=0;
+}
+
+void* poolAlloc(Pool* p)
+{
+        void* block;
+        if (p->freeList)
+        {
+                block=p->freeList;
+                memcpy(&p->freeList,block,sizeof(void*));
+        } else if (p->carved<p->blocks) {
+                block=p->memory+p->blockSize*p->carved++;
+        } else {
+                p->exhausted++;
+                return 0;
+        }
+        if (++p->used>p->highWater) p->highWater=p->used;
+        return block;
+}
+
+void poolRelease(Pool* p, void* block)
+{
+        if (!block) return;
+        memcpy(block,&p->freeList,sizeof(void*));
+        p->freeList=block;
+        p->used--;
+}
@@ -0,0 +1,41 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Fixed size blocks for what comes and goes while running: telegrams queued
+   to TCP clients, reply chunks, reply states and subscriptions. A pool
+   reserves its memory once, sized at startup from the configuration for the
+   worst case, so the event loop never needs the heap and memory does not
+   fragment over months of uptime.
+
+   Blocks are carved from the reserved memory when first needed, so pages
+   of blocks that were never used are not touched, and released blocks go
+   to a free list. The high-water mark tells how much of a pool was ever
+   used at once.
+ */
+
+typedef struct
+{
+        const char*   name;
+        size_t        blockSize;        /* Rounded up for alignment */
+        int           blocks;
+        char*         memory;           /* blocks*blockSize */
+        int           carved;           /* Blocks taken from memory so far */
+        void*         freeList;         /* Released blocks */
+        int           used;
+        int           highWater;        /* Most blocks used at once */
+        unsigned long exhausted;        /* Allocations refused, all blocks used */
+} Pool;
+
+/* Returns -1 if no memory is available */
+int poolInit(Pool* p, const char* name, const size_t blockSize, const int blocks);
+void poolFree(Pool* p);
+
+/* A block of p->blockSize bytes, not cleared; 0 if all are in use */
+void* poolAlloc(Pool* p);
+
+/* Return a block to the pool, block may be 0 */
+void poolRelease(Pool* p, void* block);
+
+#endif // POOL_H
@@ -0,0 +1,199 @@
+#include "rangequery.h"
+#include "textbuf.h"
+
+#include <endian.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RANGE_MAGIC   "P1RG"
+#define RANGE_VERSION 1
+
+static int parseField(RangeQuery* q, const char* name)
+{
+        /* <series>[.<stat>] or <energy>, returns -1 if unknown */
+        const char* dot=strchr(name,'.');
+        const size_t len=dot?(size_t)(dot-name):strlen(name);
+        int i;
+        q->stat=STAT_AVG;
+        for (i=0;i<SERIES_COUNT;i++)
+        {
+                if (strlen(seriesNames[i])!=len || strncmp(name,seriesNames[i],len)) continue;
+                q->field=i;
+                q->energy=0;
+                if (!dot) return 0;
+                for (q->stat=0;q->stat<STAT_COUNT;q->stat++)
+                {
+                        if (!strcmp(dot+1,statNames[q->stat])) return 0;
+                }
+                return -1;
+        }
+        for (i=0;i<ENERGY_COUNT;i++)
+        {
+                if (strcmp(name,energyNames[i])) continue;
+                q->field=i;
+                q->energy=1;
+                return 0;
+        }
+        return -1;
+}
+
+const char* rangeQueryInit(RangeQuery* q, const HistoryStore* s, const char* args, const double now)
+{
+        char field[32], format[8];
+        double to;
+        int t;
+        memset(q,0,sizeof(*q));
+        strcpy(format,"csv");
+        if (sscanf(args,"%31s %lf %lf %lf %7s",field,&q->from,&to,&q->step,format)<4)
+        {
+                return "usage: range <field> <from> <to> <step> [csv|bin]";
+        }
+        if (parseField(q,field)) return "unknown field, run 'help' for an overview";
+        if (!strcmp(format,"csv")) q->format=RANGE_CSV;
+        else if (!strcmp(format,"bin")) q->format=RANGE_BINARY;
+        else return "format must be csv or bin";
+        if (q->from<=0) q->from+=now;
+        if (to<=0) to+=now;
+        if (!(q->step>=1) || !(to>q->from)) return "need from < to and a step of at least 1 second";
+        if (!s->files[TIER_RAW].header) return "no history file, use -f";
+
+        /* The coarsest tier whose period the step is a multiple of, from
+         * is moved back to the start of a period so every step holds whole
+         * periods. Otherwise the raw records, from whole seconds. */
+        for (t=TIER_COUNT-1;t>TIER_RAW;t--)
+        {
+                if (q->step>=tierSeconds[t] && fmod(q->step,tierSeconds[t])==0) break;
+        }
+        q->from=t==TIER_RAW?floor(q->from):floor(q->from/tierSeconds[t])*tierSeconds[t];
+        if ((to-q->from)/q->step>RANGE_MAXPOINTS) return "too many values, use a larger step";
+        q->points=ceil((to-q->from)/q->step);
+        q->tier=t;
+        q->file=&s->files[t];
+        q->record=historyFind(q->file,q->from);
+        return 0;
+}
+
+static double aggregate(RangeQuery* q, const double end)
+{
+        /* Combine the records from q->record up to end */
+        const HistoryFile* h=q->file;
+        const uint64_t count=historyCount(h);
+        double value=NAN;
+        double sum=0;
+        double weight=0;
+        /* Records may have been overwritten since the last chunk */
+        if (q->record<historyOldest(h)) q->record=historyOldest(h);
+        for (;q->record<count;q->record++)
+        {
+                const RecordHeader* r=historyRecord(h,q->record);
+                double v;
+                double n=1;
+                if (r->time>=end) break;
+                if (q->tier==TIER_RAW)
+                {
+                        const HistoryRecord* raw=(const HistoryRecord*)r;
+                        v=q->energy?raw->energy[q->field]:raw->power[q->field];
+                } else {
+                        const RollupRecord* rollup=(const RollupRecord*)r;
+                        if (q->energy) v=rollup->last[q->field];
+                        else if (q->stat==STAT_MIN) v=rollup->min[q->field];
+                        else if (q->stat==STAT_MAX) v=rollup->max[q->field];
+                        else {
+                                v=rollup->mean[q->field];
+                                n=rollup->samples;
+                        }
+                }
+                if (isnan(v)) continue;
+                if (q->energy) value=v;
+                else if (q->stat==STAT_MIN) value=(v<value || isnan(value))?v:value;
+                else if (q->stat==STAT_MAX) value=(v>value || isnan(value))?v:value;
+                else {
+                        sum+=v*n;
+                        weight+=n;
+                }
+        }
+        if (!q->energy && q->stat==STAT_AVG && weight>0) value=sum/weight;
+        return value;
+}
+
+static void putLe32(char* p, const uint32_t v)
+{
+        const uint32_t le=htole32(v);
+        memcpy(p,&le,4);
+}
+
+static void putLe64(char* p, const double v)
+{
+        uint64_t bits;
+        memcpy(&bits,&v,8);
+        bits=htole64(bits);
+        memcpy(p,&bits,8);
+}
+
+static int writeHeader(const RangeQuery* q, char* buffer)
+{
+        memcpy(buffer,RANGE_MAGIC,4);
+        putLe32(buffer+4,RANGE_VERSION);
+        putLe32(buffer+8,q->points);
+        putLe32(buffer+12,q->energy?8:4);
+        putLe64(buffer+16,q->from);
+        putLe64(buffer+24,q->step);
+        return 32;
+}
+
+static int fillCsv(RangeQuery* q, char* buffer, const int size)
+{
+        /* The 0 that ends the text is not part of the reply */
+        TextBuf text;
+        textBufInit(&text,buffer,size);
+        if (!q->headerDone)
+        {
+                textBufString(&text,"time,");
+                if (q->energy) textBufString(&text,energyNames[q->field]);
+                else textBufPrintf(&text,"%s.%s",seriesNames[q->field],statNames[q->stat]);
+                textBufString(&text,"\n");
+                q->headerDone=1;
+        }
+        while (q->next<q->points && text.len+RANGE_MAXLINE<size)
+        {
+                const double start=q->from+(double)q->next*q->step;
+                const double v=aggregate(q,start+q->step);
+                /* Empty if there is no data */
+                textBufNumber(&text,start);
+                textBufString(&text,",");
+                if (!isnan(v)) textBufNumber(&text,v);
+                textBufString(&text,"\n");
+                q->next++;
+        }
+        return text.len;
+}
+
+int rangeQueryFill(RangeQuery* q, char* buffer, const int size)
+{
+        int len=0;
+        if (q->format==RANGE_CSV) return fillCsv(q,buffer,size);
+        if (!q->headerDone)
+        {
+                len=writeHeader(q,buffer);
+                q->headerDone=1;
+        }
+        while (q->next<q->points && len+RANGE_MAXLINE<=size)
+        {
+                const double start=q->from+(double)q->next*q->step;
+                const double v=aggregate(q,start+q->step);
+                if (q->energy)
+                {
+                        putLe64(buffer+len,v);
+                        len+=8;
+                } else {
+                        const float f=v;
+                        uint32_t bits;
+                        memcpy(&bits,&f,4);
+                        putLe32(buffer+len,bits);
+                        len+=4;
+                }
+                q->next++;
+        }
+        return len;
+}
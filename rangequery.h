@@ -0,0 +1,59 @@
+#ifndef RANGEQUERY_H
+#define RANGEQUERY_H
+
+#include "historyfile.h"
+#include "timeseries.h"
+
+/* Range query on the stored history: the values of one field from a start
+   to an end time, one value per step. A value aggregates the records in its
+   step: the mean, minimum or maximum power, or the last meter reading. The
+   records are read from the coarsest tier with whole periods per step; from
+   is moved back to the start of a period of that tier, and the times in the
+   reply start there.
+
+   The reply is produced in chunks while it is written to the client, so a
+   long range is never held in memory. It is CSV, a header line followed by
+   lines of time and value (empty if there is no data), or binary: a 32 byte
+   header followed by the values, all little endian:
+      0  "P1RG"
+      4  uint32 version, 1
+      8  uint32 number of values
+     12  uint32 size of a value: 4 (float) for power, 8 (double) for meter
+         readings
+     16  double time of the first value, seconds since the epoch
+     24  double step, seconds
+     32  values, NAN if there is no data
+ */
+
+#define RANGE_MAXPOINTS 1000000
+#define RANGE_MAXLINE   64      /* Longest CSV line or header */
+
+enum RangeFormat { RANGE_CSV, RANGE_BINARY };
+
+typedef struct
+{
+        const HistoryFile* file;        /* Tier the values are read from */
+        enum HistoryTier tier;
+        int              field;         /* HistorySeries or EnergyCounter */
+        int              energy;        /* field is an EnergyCounter */
+        enum WindowStat  stat;
+        enum RangeFormat format;
+        double           from;
+        double           step;
+        uint32_t         points;
+        uint32_t         next;          /* Next value to produce */
+        uint64_t         record;        /* Next record to read */
+        int              headerDone;
+} RangeQuery;
+
+/* Set up a query from "<field> <from> <to> <step> [csv|bin]". The field is
+   <series>[.avg|.min|.max] or a meter reading; times are seconds since the
+   epoch, or relative to now when not positive. Returns 0, or an error
+   message. */
+const char* rangeQueryInit(RangeQuery* q, const HistoryStore* s, const char* args, const double now);
+
+/* Write the next part of the reply, at most size bytes (more than
+   RANGE_MAXLINE). Returns the number of bytes written, 0 at the end. */
+int rangeQueryFill(RangeQuery* q, char* buffer, const int size);
+
+#endif // RANGEQUERY_H
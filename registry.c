@@ -0,0 +1,68 @@
+#include "registry.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t hashName(const char* name, const size_t len)
+{
+        /* FNV-1a */
+        uint32_t h=2166136261u;
+        size_t i;
+        for (i=0;i<len;i++)
+        {
+                h^=(unsigned char)name[i];
+                h*=16777619u;
+        }
+        return h;
+}
+
+int registryInit(CommandRegistry* r, const unsigned maxEntries)
+{
+        /* Keep the load factor at or below 50%, so probe sequences stay short */
+        uint32_t size=8;
+        while (size<2*maxEntries) size<<=1;
+        r->slots=calloc(size,sizeof(RegistryEntry));
+        if (!r->slots) return -1;
+        r->mask=size-1;
+        r->count=0;
+        return 0;
+}
+
+void registryFree(CommandRegistry* r)
+{
+        free(r->slots);
+        r->slots=0;
+        r->mask=0;
+        r->count=0;
+}
+
+int registryAdd(CommandRegistry* r, const char* name, const enum CommandKind kind, const void* entry)
+{
+        const size_t len=strlen(name);
+        const uint32_t h=hashName(name,len);
+        uint32_t i;
+        if (2*(r->count+1)>r->mask+1) return -1;
+        for (i=h&r->mask; r->slots[i].name; i=(i+1)&r->mask)
+        {
+                if (r->slots[i].hash==h && strcmp(r->slots[i].name,name)==0) return -1;
+        }
+        r->slots[i].name=name;
+        r->slots[i].hash=h;
+        r->slots[i].kind=kind;
+        r->slots[i].entry=entry;
+        r->count++;
+        return 0;
+}
+
+const RegistryEntry* registryFind(const CommandRegistry* r, const char* name, const size_t len)
+{
+        const uint32_t h=hashName(name,len);
+        uint32_t i;
+        if (!r->slots) return 0;
+        for (i=h&r->mask; r->slots[i].name; i=(i+1)&r->mask)
+        {
+                const RegistryEntry* e=&r->slots[i];
+                if (e->hash==h && strncmp(e->name,name,len)==0 && e->name[len]=='\0') return e;
+        }
+        return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hash table mapping command names (including SunSpec register numbers, as
+   text) to their handler. It is filled once at startup, lookups take constant
+   time regardless of the number of commands.
+ */
+
+enum CommandKind { CMD_P1, CMD_P1MAP, CMD_COMBINED, CMD_SUNSPEC, CMD_WINDOW };
+
+typedef struct
+{
+        const char*      name;   /* 0 for an empty slot */
+        uint32_t         hash;
+        enum CommandKind kind;
+        const void*      entry;  /* Command, CommandMap, CombinedCommand, SunSpecValue or WindowCommand */
+} RegistryEntry;
+
+typedef struct
+{
+        RegistryEntry* slots;
+        uint32_t       mask;     /* Number of slots - 1, slots is a power of 2 */
+        unsigned       count;
+} CommandRegistry;
+
+int registryInit(CommandRegistry* r, const unsigned maxEntries);
+void registryFree(CommandRegistry* r);
+
+/* Returns 0 on success, -1 if the name is already present or the table is full */
+int registryAdd(CommandRegistry* r, const char* name, const enum CommandKind kind, const void* entry);
+
+const RegistryEntry* registryFind(const CommandRegistry* r, const char* name, const size_t len);
+
+#endif // REGISTRY_H
@@ -0,0 +1,752 @@
+#define _GNU_SOURCE /* ptsname */
+
+#include "replay.h"
+#include "interface.h"
+#include "histogram.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_UDPSOCKETS  64   /* Each has at most one query outstanding */
+#define REPLAY_MAXCLIENTS  64
+#define REPLAY_MODBUSCONNS 4
+#define REPLAY_SENT        1024 /* Telegrams remembered, to match arrivals */
+#define REPLAY_PENDING     1024 /* TCP queries waiting for their answer */
+#define REPLAY_BUFSIZE     16384
+#define REPLAY_LINESIZE    4096 /* Query, answer or built in telegram */
+#define REPLAY_TIMEOUT     1.0  /* s until a query is counted as lost, also the time to drain */
+#define REPLAY_STARTUP     5.0  /* s the program may take to answer */
+#define REPLAY_REGISTERS   65536
+
+typedef struct
+{
+        char*  data;
+        int*   start;           /* count+1 offsets, telegram i ends where i+1 starts */
+        int    count;
+} TelegramSet;
+
+typedef struct
+{
+        char   crc[4];
+        double time;            /* Last byte written */
+} SentTelegram;
+
+/* Receives the telegram stream over TCP */
+typedef struct
+{
+        int           fd;
+        char          buffer[REPLAY_BUFSIZE];
+        int           len;
+        unsigned long next;     /* Sequence number of the next telegram expected */
+        unsigned long received;
+        unsigned long unmatched;
+} StreamClient;
+
+typedef struct
+{
+        int    fd;
+        double sent;            /* 0 if no query is outstanding */
+} UdpClient;
+
+typedef struct
+{
+        int           fd;
+        unsigned char rx[2*MODBUS_FRAMESIZE];
+        int           len;
+} ModbusPeer;
+
+typedef struct
+{
+        const ReplayOptions* o;
+        TelegramSet   telegrams;
+        uint16_t*     registers;
+        pid_t         pid;
+
+        /* Telegrams to the pty */
+        int           pty;
+        int           ptySlave; /* Kept open so the pty stays up while the program reopens it */
+        int           current;  /* Telegram being written, or next */
+        int           written;  /* Bytes of it written, -1 if none is being written */
+        SentTelegram  sent[REPLAY_SENT];
+        unsigned long telegramsWritten;
+        unsigned long telegramsSkipped; /* Due while the previous one was still being written */
+
+        int           modbusListen;
+        ModbusPeer    modbus[REPLAY_MODBUSCONNS];
+        unsigned long modbusRequests;
+
+        UdpClient     udp[REPLAY_UDPSOCKETS];
+        int           udpNext;
+        unsigned long udpCommand;
+        unsigned long udpSent;
+        unsigned long udpAnswered;
+        unsigned long udpLost;
+        unsigned long udpBusy;  /* Not sent, every socket was waiting */
+
+        int           tcp;      /* Query connection */
+        char          tcpBuffer[REPLAY_BUFSIZE];
+        double        tcpPending[REPLAY_PENDING];
+        unsigned long tcpCommand;
+        unsigned long tcpSent;
+        unsigned long tcpAnswered;
+        unsigned long tcpBusy;
+
+        StreamClient* streams;
+
+        Histogram     delivery;
+        Histogram     udpLatency;
+        Histogram     tcpLatency;
+} Replay;
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void recordSeconds(Histogram* h, const double seconds)
+{
+        histogramRecord(h,seconds>0?seconds*1e9:0);
+}
+
+static int addTelegrams(TelegramSet* t, const char* data, const int len)
+{
+        /* Split captured data into telegrams: from '/' up to the end of the
+         * line with the '!'. Data outside telegrams is left out. */
+        int pos=0;
+        int total=0;
+        int max=len/16+2;
+        t->data=malloc(len+1);
+        t->start=malloc(max*sizeof(int));
+        t->count=0;
+        if (!t->data || !t->start) return -1;
+        while (pos<len)
+        {
+                const char* slash=memchr(data+pos,'/',len-pos);
+                if (!slash) break;
+                const char* bang=memchr(slash,'!',data+len-slash);
+                if (!bang) break;
+                const char* end=memchr(bang,'\n',data+len-bang);
+                if (!end) break;
+                const int telegramLen=end+1-slash;
+                if (t->count+1>=max) break;
+                t->start[t->count++]=total;
+                memcpy(t->data+total,slash,telegramLen);
+                total+=telegramLen;
+                pos=end+1-data;
+        }
+        t->start[t->count]=total;
+        return t->count?0:-1;
+}
+
+static int loadTelegrams(Replay* r)
+{
+        const ReplayOptions* o=r->o;
+        if (!o->telegramFile)
+        {
+                /* The built in telegram, with its CRC computed */
+                char telegram[REPLAY_LINESIZE];
+                const char* bang=strchr(o->defaultTelegram,'!');
+                if (!bang || bang-o->defaultTelegram+8>(int)sizeof(telegram)) return -1;
+                const int len=bang+1-o->defaultTelegram;
+                memcpy(telegram,o->defaultTelegram,len);
+                sprintf(telegram+len,"%04X\r\n",p1Crc16(0,o->defaultTelegram,len));
+                return addTelegrams(&r->telegrams,telegram,strlen(telegram));
+        }
+        FILE* f=fopen(o->telegramFile,"r");
+        if (!f)
+        {
+                perror(o->telegramFile);
+                return -1;
+        }
+        fseek(f,0,SEEK_END);
+        const long size=ftell(f);
+        rewind(f);
+        char* data=malloc(size+1);
+        const int ok=data && fread(data,1,size,f)==(size_t)size;
+        fclose(f);
+        const int result=ok?addTelegrams(&r->telegrams,data,size):-1;
+        free(data);
+        if (result) fprintf(stderr,"%s: no telegrams found\n",o->telegramFile);
+        return result;
+}
+
+static void defaultRegisters(uint16_t* regs)
+{
+        /* "SunS", a common model, inverter model 103 where params[] expect
+         * it, and the end marker. Values are made up, scale factors 0. */
+        const SunSpecValue* ssv;
+        int i;
+        regs[40000]=0x5375;
+        regs[40001]=0x6e53;
+        regs[40002]=1;
+        regs[40003]=65;
+        regs[40069]=103;
+        regs[40070]=50;
+        regs[40121]=0xFFFF;
+        for (ssv=getParam(0); ssv->valueFieldNr; ssv++)
+        {
+                const int address=ssv->valueFieldNr-1;
+                for (i=0;i<ssv->valueLength;i++) regs[address+i]=0;
+                regs[address+ssv->valueLength-1]=(ssv->valueFieldNr-40070)*10;
+        }
+        for (ssv=getParam(0); ssv->valueFieldNr; ssv++) regs[ssv->valueFieldNr-1+ssv->scaleFieldOffset]=0;
+}
+
+static int loadRegisters(Replay* r)
+{
+        char line[1024];
+        int lineNr=0;
+        r->registers=calloc(REPLAY_REGISTERS,sizeof(uint16_t));
+        if (!r->registers) return -1;
+        if (!r->o->registerFile)
+        {
+                defaultRegisters(r->registers);
+                return 0;
+        }
+        FILE* f=fopen(r->o->registerFile,"r");
+        if (!f)
+        {
+                perror(r->o->registerFile);
+                return -1;
+        }
+        while (fgets(line,sizeof(line),f))
+        {
+                char* p=line;
+                char* end;
+                char* hash=strchr(line,'#');
+                lineNr++;
+                if (hash) *hash='\0';
+                long address=strtol(p,&end,0);
+                if (end==p) continue;
+                for (p=end;;p=end)
+                {
+                        const long value=strtol(p,&end,0);
+                        if (end==p) break;
+                        if (address<0 || address>=REPLAY_REGISTERS)
+                        {
+                                fprintf(stderr,"%s:%i: address out of range\n",r->o->registerFile,lineNr);
+                                fclose(f);
+                                return -1;
+                        }
+                        r->registers[address++]=value;
+                }
+        }
+        fclose(f);
+        return 0;
+}
+
+static int openPty(Replay* r, char* name, const int size)
+{
+        /* The program makes the slave raw as well, it is made raw here
+         * already so nothing written before is changed */
+        struct termios t;
+        r->pty=posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK);
+        if (r->pty<0 || grantpt(r->pty) || unlockpt(r->pty))
+        {
+                perror("pty");
+                return -1;
+        }
+        snprintf(name,size,"%s",ptsname(r->pty));
+        r->ptySlave=open(name,O_RDWR|O_NOCTTY);
+        if (r->ptySlave<0 || tcgetattr(r->ptySlave,&t))
+        {
+                perror(name);
+                return -1;
+        }
+        cfmakeraw(&t);
+        tcsetattr(r->ptySlave,TCSANOW,&t);
+        return 0;
+}
+
+static int listenLocal(const int port)
+{
+        struct sockaddr_in6 addr;
+        int on=1;
+        const int fd=socket(AF_INET6,SOCK_STREAM|SOCK_NONBLOCK,0);
+        if (fd<0) return -1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        memset(&addr,0,sizeof(addr));
+        addr.sin6_family=AF_INET6;
+        addr.sin6_addr=in6addr_loopback;
+        addr.sin6_port=htons(port);
+        if (bind(fd,(struct sockaddr*)&addr,sizeof(addr)) || listen(fd,16))
+        {
+                perror("fake modbus server");
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+static int connectLocal(const int port, const int type)
+{
+        struct sockaddr_in6 addr;
+        const int fd=socket(AF_INET6,type,0);
+        if (fd<0) return -1;
+        memset(&addr,0,sizeof(addr));
+        addr.sin6_family=AF_INET6;
+        addr.sin6_addr=in6addr_loopback;
+        addr.sin6_port=htons(port);
+        if (connect(fd,(struct sockaddr*)&addr,sizeof(addr)))
+        {
+                close(fd);
+                return -1;
+        }
+        fcntl(fd,F_SETFL,O_NONBLOCK);
+        return fd;
+}
+
+static pid_t startProgram(const ReplayOptions* o, const char* ptyName)
+{
+        char port[16], modbusPort[16], period[16];
+        const int periodMs=1000/o->speed;
+        const pid_t pid=fork();
+        if (pid) return pid;
+        snprintf(port,sizeof(port),"%i",o->port);
+        snprintf(modbusPort,sizeof(modbusPort),"%i",o->port+1);
+        snprintf(period,sizeof(period),"%i",periodMs<MODBUS_MINPERIOD?MODBUS_MINPERIOD:periodMs);
+        execl(o->binary,o->binary,"-s",ptyName,"-p",port,"-H","bench=::1","-P",modbusPort,"-i",period,(char*)0);
+        perror(o->binary);
+        _exit(127);
+}
+
+static double cpuSeconds(const pid_t pid)
+{
+        /* User and system time of the process, from /proc/<pid>/stat */
+        char path[32], line[1024];
+        unsigned long utime=0, stime=0;
+        snprintf(path,sizeof(path),"/proc/%i/stat",pid);
+        FILE* f=fopen(path,"r");
+        if (!f) return 0;
+        const char* p=fgets(line,sizeof(line),f)?strrchr(line,')'):0;
+        fclose(f);
+        /* After the name: state ppid pgrp session tty tpgid flags minflt
+         * cminflt majflt cmajflt utime stime */
+        if (p) sscanf(p+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",&utime,&stime);
+        return (utime+stime)/(double)sysconf(_SC_CLK_TCK);
+}
+
+static int waitForProgram(Replay* r)
+{
+        /* Until it answers a UDP query */
+        const double deadline=now()+REPLAY_STARTUP;
+        char reply[REPLAY_LINESIZE];
+        while (now()<deadline)
+        {
+                struct pollfd p={ r->udp[0].fd, POLLIN, 0 };
+                send(r->udp[0].fd,"test",4,0);
+                if (poll(&p,1,100)==1 && recv(r->udp[0].fd,reply,sizeof(reply),0)>0) return 0;
+                if (waitpid(r->pid,0,WNOHANG)==r->pid)
+                {
+                        r->pid=0;
+                        break;
+                }
+        }
+        fprintf(stderr,"%s does not answer on port %i\n",r->o->binary,r->o->port);
+        return -1;
+}
+
+static long heapInUse(const Replay* r)
+{
+        /* Heap of the program as its 'memory' command tells, -1 if unknown */
+        char reply[REPLAY_LINESIZE];
+        size_t used, mapped;
+        long heap=-1;
+        const int fd=connectLocal(r->o->port,SOCK_DGRAM);
+        if (fd<0) return -1;
+        struct pollfd p={ fd, POLLIN, 0 };
+        const int n=send(fd,"memory",6,0)==6 && poll(&p,1,REPLAY_TIMEOUT*1000)==1?recv(fd,reply,sizeof(reply)-1,0):-1;
+        if (n>0)
+        {
+                reply[n]='\0';
+                if (sscanf(reply,"heap %zu bytes in use, %zu mapped",&used,&mapped)==2) heap=used+mapped;
+        }
+        close(fd);
+        return heap;
+}
+
+static void flushPty(Replay* r, const double t)
+{
+        /* Continue writing the current telegram, when it is complete
+         * remember when, by its CRC */
+        const char* telegram=r->telegrams.data+r->telegrams.start[r->current];
+        const int len=r->telegrams.start[r->current+1]-r->telegrams.start[r->current];
+        if (r->written<0) return;
+        const int n=write(r->pty,telegram+r->written,len-r->written);
+        if (n>0) r->written+=n;
+        if (r->written<len) return;
+        SentTelegram* s=&r->sent[r->telegramsWritten%REPLAY_SENT];
+        const char* bang=memchr(telegram,'!',len);
+        memset(s->crc,0,sizeof(s->crc));
+        memcpy(s->crc,bang+1,telegram+len-bang-1<4?telegram+len-bang-1:4);
+        s->time=t;
+        r->telegramsWritten++;
+        r->written=-1;
+        r->current=(r->current+1)%r->telegrams.count;
+}
+
+static void startTelegram(Replay* r, const double t)
+{
+        if (r->written>=0)
+        {
+                r->telegramsSkipped++;
+                return;
+        }
+        r->written=0;
+        flushPty(r,t);
+}
+
+static void handleModbus(Replay* r, ModbusPeer* m)
+{
+        /* Answer read requests (function 3 or 4) from the register image,
+         * anything else with an exception */
+        const int n=read(m->fd,m->rx+m->len,sizeof(m->rx)-m->len);
+        if (n<=0)
+        {
+                if (n<0 && errno==EAGAIN) return;
+                close(m->fd);
+                m->fd=-1;
+                return;
+        }
+        m->len+=n;
+        while (m->len>=8)
+        {
+                unsigned char reply[MODBUS_FRAMESIZE];
+                const int frameLen=6+((m->rx[4]<<8)|m->rx[5]);
+                if (frameLen>(int)sizeof(m->rx))
+                {
+                        m->len=0;
+                        return;
+                }
+                if (m->len<frameLen) return;
+                const int fc=m->rx[7];
+                const int address=(m->rx[8]<<8)|m->rx[9];
+                const int count=(m->rx[10]<<8)|m->rx[11];
+                int len=9;
+                int i;
+                memcpy(reply,m->rx,7);
+                reply[7]=fc;
+                if ((fc==3 || fc==4) && count>=1 && count<=125 && address+count<=REPLAY_REGISTERS)
+                {
+                        reply[8]=2*count;
+                        for (i=0;i<count;i++)
+                        {
+                                reply[len++]=r->registers[address+i]>>8;
+                                reply[len++]=r->registers[address+i]&0xff;
+                        }
+                } else {
+                        reply[7]=fc|0x80;
+                        reply[8]=2;     /* Illegal data address */
+                }
+                reply[4]=(len-6)>>8;
+                reply[5]=(len-6)&0xff;
+                send(m->fd,reply,len,MSG_NOSIGNAL);
+                r->modbusRequests++;
+                m->len-=frameLen;
+                memmove(m->rx,m->rx+frameLen,m->len);
+        }
+}
+
+static void acceptModbus(Replay* r)
+{
+        int i;
+        const int fd=accept(r->modbusListen,0,0);
+        if (fd<0) return;
+        for (i=0;i<REPLAY_MODBUSCONNS && r->modbus[i].fd>=0;i++);
+        if (i==REPLAY_MODBUSCONNS)
+        {
+                close(fd);
+                return;
+        }
+        fcntl(fd,F_SETFL,O_NONBLOCK);
+        r->modbus[i].fd=fd;
+        r->modbus[i].len=0;
+}
+
+static void readStream(Replay* r, StreamClient* c, const double t)
+{
+        /* Telegrams end with the line holding the '!' and the CRC. Each is
+         * matched to the first one written since the previous match with
+         * the same CRC, so dropped telegrams are skipped. */
+        const int n=read(c->fd,c->buffer+c->len,sizeof(c->buffer)-c->len);
+        char* bang;
+        char* end;
+        if (n<=0) return;
+        c->len+=n;
+        while ((bang=memchr(c->buffer,'!',c->len)) && (end=memchr(bang,'\n',c->buffer+c->len-bang)))
+        {
+                unsigned long seq;
+                for (seq=c->next;seq<r->telegramsWritten;seq++)
+                {
+                        if (seq+REPLAY_SENT<r->telegramsWritten) continue;
+                        if (end-bang>4 && !memcmp(r->sent[seq%REPLAY_SENT].crc,bang+1,4)) break;
+                }
+                if (seq<r->telegramsWritten)
+                {
+                        recordSeconds(&r->delivery,t-r->sent[seq%REPLAY_SENT].time);
+                        c->next=seq+1;
+                        c->received++;
+                } else {
+                        c->unmatched++;
+                }
+                c->len-=end+1-c->buffer;
+                memmove(c->buffer,end+1,c->len);
+        }
+        if (c->len==sizeof(c->buffer)) c->len=0;
+}
+
+static const char* nextCommand(const ReplayOptions* o, unsigned long* index)
+{
+        int count;
+        for (count=0;o->commands[count];count++);
+        return o->commands[(*index)++%count];
+}
+
+static void sendUdp(Replay* r, const double t)
+{
+        int i;
+        for (i=0;i<REPLAY_UDPSOCKETS;i++)
+        {
+                UdpClient* u=&r->udp[(r->udpNext+i)%REPLAY_UDPSOCKETS];
+                if (u->sent) continue;
+                const char* command=nextCommand(r->o,&r->udpCommand);
+                if (send(u->fd,command,strlen(command),0)<0) return;
+                u->sent=t;
+                r->udpSent++;
+                r->udpNext=(r->udpNext+i+1)%REPLAY_UDPSOCKETS;
+                return;
+        }
+        r->udpBusy++;
+}
+
+static void readUdp(Replay* r, UdpClient* u, const double t)
+{
+        char reply[REPLAY_LINESIZE];
+        if (recv(u->fd,reply,sizeof(reply),0)<0 || !u->sent) return;
+        recordSeconds(&r->udpLatency,t-u->sent);
+        r->udpAnswered++;
+        u->sent=0;
+}
+
+static void sendTcp(Replay* r, const double t)
+{
+        /* Queries are pipelined, the answers come in order */
+        char line[REPLAY_LINESIZE];
+        if (r->tcpSent-r->tcpAnswered==REPLAY_PENDING)
+        {
+                r->tcpBusy++;
+                return;
+        }
+        const int len=snprintf(line,sizeof(line),"%s\n",nextCommand(r->o,&r->tcpCommand));
+        if (send(r->tcp,line,len,MSG_NOSIGNAL)!=len)
+        {
+                r->tcpBusy++;
+                return;
+        }
+        r->tcpPending[r->tcpSent++%REPLAY_PENDING]=t;
+}
+
+static void readTcp(Replay* r, const double t)
+{
+        /* Each newline completes the oldest query, so commands with
+         * answers of several lines are not counted right */
+        const int n=read(r->tcp,r->tcpBuffer,sizeof(r->tcpBuffer));
+        int i;
+        for (i=0;i<n;i++)
+        {
+                if (r->tcpBuffer[i]!='\n' || r->tcpAnswered==r->tcpSent) continue;
+                recordSeconds(&r->tcpLatency,t-r->tcpPending[r->tcpAnswered++%REPLAY_PENDING]);
+        }
+}
+
+static void expireUdp(Replay* r, const double t)
+{
+        int i;
+        for (i=0;i<REPLAY_UDPSOCKETS;i++)
+        {
+                if (!r->udp[i].sent || t-r->udp[i].sent<REPLAY_TIMEOUT) continue;
+                r->udp[i].sent=0;
+                r->udpLost++;
+        }
+}
+
+static void runLoop(Replay* r, const double end, const int sending)
+{
+        /* Until end, serve the fake modbus server and read what arrives;
+         * when sending also write telegrams and queries when they are due */
+        const ReplayOptions* o=r->o;
+        struct pollfd fds[2+REPLAY_MODBUSCONNS+REPLAY_UDPSOCKETS+REPLAY_MAXCLIENTS+1];
+        double nextTelegram=now(), nextUdp=nextTelegram, nextTcp=nextTelegram;
+        int i;
+        for (;;)
+        {
+                double t=now();
+                if (t>=end) return;
+                int n=0;
+                double wake=end;
+                if (sending)
+                {
+                        if (t>=nextTelegram)
+                        {
+                                startTelegram(r,t);
+                                nextTelegram+=1/o->speed;
+                        }
+                        while (o->udpRate>0 && t>=nextUdp)
+                        {
+                                sendUdp(r,t);
+                                nextUdp+=1/o->udpRate;
+                        }
+                        while (o->tcpRate>0 && r->tcp>=0 && t>=nextTcp)
+                        {
+                                sendTcp(r,t);
+                                nextTcp+=1/o->tcpRate;
+                        }
+                        if (nextTelegram<wake) wake=nextTelegram;
+                        if (o->udpRate>0 && nextUdp<wake) wake=nextUdp;
+                        if (o->tcpRate>0 && nextTcp<wake) wake=nextTcp;
+                }
+                expireUdp(r,t);
+
+                /* Same order in fds as handled below */
+                fds[n++]=(struct pollfd){ r->pty, r->written>=0?POLLOUT:0, 0 };
+                fds[n++]=(struct pollfd){ r->modbusListen, POLLIN, 0 };
+                for (i=0;i<REPLAY_MODBUSCONNS;i++) fds[n++]=(struct pollfd){ r->modbus[i].fd, POLLIN, 0 };
+                for (i=0;i<REPLAY_UDPSOCKETS;i++) fds[n++]=(struct pollfd){ r->udp[i].fd, POLLIN, 0 };
+                for (i=0;i<o->tcpClients;i++) fds[n++]=(struct pollfd){ r->streams[i].fd, POLLIN, 0 };
+                fds[n++]=(struct pollfd){ r->tcp, POLLIN, 0 };
+                const int timeout=(wake-t)*1000+1;
+                if (poll(fds,n,timeout)<=0) continue;
+                t=now();
+                n=0;
+                if (fds[n++].revents) flushPty(r,t);
+                if (fds[n++].revents) acceptModbus(r);
+                for (i=0;i<REPLAY_MODBUSCONNS;i++) if (fds[n++].revents) handleModbus(r,&r->modbus[i]);
+                for (i=0;i<REPLAY_UDPSOCKETS;i++) if (fds[n++].revents) readUdp(r,&r->udp[i],t);
+                for (i=0;i<o->tcpClients;i++) if (fds[n++].revents) readStream(r,&r->streams[i],t);
+                if (fds[n++].revents) readTcp(r,t);
+        }
+}
+
+static void printHistogram(const char* name, const Histogram* h)
+{
+        printf("%-10s n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n",name,
+                        (unsigned long long)h->count,histogramMean(h)/1000,histogramPercentile(h,50)/1000.,
+                        histogramPercentile(h,90)/1000.,histogramPercentile(h,99)/1000.,
+                        histogramPercentile(h,99.9)/1000.,h->max/1000.);
+}
+
+static void report(const Replay* r, const double elapsed, const double cpu, const struct rusage* usage, const long heapStart, const long heapEnd)
+{
+        const ReplayOptions* o=r->o;
+        unsigned long received=0, unmatched=0;
+        int i;
+        for (i=0;i<o->tcpClients;i++)
+        {
+                received+=r->streams[i].received;
+                unmatched+=r->streams[i].unmatched;
+        }
+        printf("replayed %.1f s at %gx: %lu telegrams written (%.1f/s), %lu skipped while the pty was full\n",
+                        elapsed,o->speed,r->telegramsWritten,r->telegramsWritten/elapsed,r->telegramsSkipped);
+        printf("telegrams received by %i TCP clients: %lu, %lu not matched\n",o->tcpClients,received,unmatched);
+        printHistogram("telegram",&r->delivery);
+        printf("udp queries: %lu sent (%.1f/s), %lu answered, %lu lost, %lu not sent as all sockets waited\n",
+                        r->udpSent,r->udpSent/elapsed,r->udpAnswered,r->udpLost,r->udpBusy);
+        printHistogram("udp",&r->udpLatency);
+        printf("tcp queries: %lu sent (%.1f/s), %lu answered, %lu not sent\n",
+                        r->tcpSent,r->tcpSent/elapsed,r->tcpAnswered,r->tcpBusy);
+        printHistogram("tcp",&r->tcpLatency);
+        printf("modbus requests answered: %lu\n",r->modbusRequests);
+        printf("cpu: %.2f s, %.3f ms per telegram, max rss %li kB\n",
+                        cpu,r->telegramsWritten?cpu*1000/r->telegramsWritten:0.,usage->ru_maxrss);
+        if (heapStart>=0 && heapEnd>=0)
+        {
+                printf("heap: %li bytes in use when measuring started, %li at the end, %s\n",heapStart,heapEnd,
+                                heapEnd>heapStart?"GREW in the steady state":"no growth");
+        } else {
+                printf("heap: unknown, the program has no 'memory' command\n");
+        }
+}
+
+int replayRun(const ReplayOptions* o)
+{
+        char ptyName[64];
+        struct rusage usage;
+        int result=-1;
+        int i;
+        Replay* r=calloc(1,sizeof(Replay));
+        if (!r) return -1;
+        r->o=o;
+        r->pty=r->ptySlave=r->modbusListen=r->tcp=-1;
+        r->written=-1;
+        memset(&usage,0,sizeof(usage));
+        for (i=0;i<REPLAY_MODBUSCONNS;i++) r->modbus[i].fd=-1;
+        for (i=0;i<REPLAY_UDPSOCKETS;i++) r->udp[i].fd=-1;
+        r->streams=calloc(o->tcpClients,sizeof(StreamClient));
+        for (i=0;r->streams && i<o->tcpClients;i++) r->streams[i].fd=-1;
+        if (!r->streams || loadTelegrams(r) || loadRegisters(r) || openPty(r,ptyName,sizeof(ptyName))) goto out;
+        if ((r->modbusListen=listenLocal(o->port+1))<0) goto out;
+
+        r->pid=startProgram(o,ptyName);
+        if (r->pid<0) goto out;
+        for (i=0;i<REPLAY_UDPSOCKETS;i++)
+        {
+                if ((r->udp[i].fd=connectLocal(o->port,SOCK_DGRAM))<0) goto out;
+        }
+        if (waitForProgram(r)) goto out;
+        for (i=0;i<o->tcpClients;i++)
+        {
+                if ((r->streams[i].fd=connectLocal(o->port,SOCK_STREAM))<0) goto out;
+        }
+        if (o->tcpRate>0 && (r->tcp=connectLocal(o->port,SOCK_STREAM))<0) goto out;
+
+        /* Settle, so the modbus connection is up, then measure */
+        runLoop(r,now()+0.5,0);
+        const long heapStart=heapInUse(r);
+        const double cpuStart=cpuSeconds(r->pid);
+        const double start=now();
+        runLoop(r,start+o->duration,1);
+        const double elapsed=now()-start;
+        runLoop(r,now()+REPLAY_TIMEOUT,0);
+        const double cpu=cpuSeconds(r->pid)-cpuStart;
+        const long heapEnd=heapInUse(r);
+        kill(r->pid,SIGTERM);
+        wait4(r->pid,0,0,&usage);
+        r->pid=0;
+        report(r,elapsed,cpu,&usage,heapStart,heapEnd);
+        /* Allocating once running is a failure */
+        result=heapEnd>heapStart && heapStart>=0?1:0;
+out:
+        if (r->pid>0)
+        {
+                kill(r->pid,SIGTERM);
+                waitpid(r->pid,0,0);
+        }
+        for (i=0;i<REPLAY_MODBUSCONNS;i++) if (r->modbus[i].fd>=0) close(r->modbus[i].fd);
+        for (i=0;i<REPLAY_UDPSOCKETS;i++) if (r->udp[i].fd>=0) close(r->udp[i].fd);
+        for (i=0;r->streams && i<o->tcpClients;i++) if (r->streams[i].fd>=0) close(r->streams[i].fd);
+        if (r->tcp>=0) close(r->tcp);
+        if (r->modbusListen>=0) close(r->modbusListen);
+        if (r->ptySlave>=0) close(r->ptySlave);
+        if (r->pty>=0) close(r->pty);
+        free(r->streams);
+        free(r->registers);
+        free(r->telegrams.data);
+        free(r->telegrams.start);
+        free(r);
+        return result;
+}
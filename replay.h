@@ -0,0 +1,44 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/* Replay harness for the benchmark: runs the measurement program without a
+   smart meter or inverter, and measures it from the outside.
+
+   Telegrams, as captured from a meter and concatenated in a file, are
+   written to a pseudo terminal that the program reads as its serial device,
+   one per second times the speed, over and over. A fake Modbus TCP server
+   answers the polls from a register image. Meanwhile UDP queries and TCP
+   queries are sent at the requested rates, and TCP clients receive the
+   telegram stream.
+
+   Reported are the number of telegrams and queries, the latency of each
+   (for telegrams: from writing the last byte to the pty to the end of the
+   telegram arriving at a TCP client), the CPU time the program used per
+   telegram, and whether its heap grew while measuring: once running it
+   should not allocate.
+
+   A register image file has lines "<address> <value> [<value>...]" setting
+   consecutive registers from the (0 based) address on; numbers may be
+   hexadecimal with 0x, # starts a comment.
+ */
+
+typedef struct
+{
+        const char*  binary;            /* The measurement program */
+        const char*  telegramFile;      /* 0 to replay defaultTelegram */
+        const char*  defaultTelegram;   /* Without CRC, it is added */
+        const char*  registerFile;      /* 0 for a built in SunSpec image */
+        double       speed;             /* 1 is one telegram per second */
+        double       duration;          /* s */
+        double       udpRate;           /* Queries per second */
+        double       tcpRate;           /* Queries per second, over one TCP connection */
+        int          tcpClients;        /* Connections receiving telegrams */
+        int          port;              /* Of the program, the fake Modbus server uses port+1 */
+        const char** commands;          /* Queries, used in turn */
+} ReplayOptions;
+
+/* Returns 0 if the run completed, 1 if the heap of the program grew, -1
+   if the run failed */
+int replayRun(const ReplayOptions* o);
+
+#endif // REPLAY_H
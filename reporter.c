@@ -1,4 +1,16 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include "interface.h"
+#include "p1telegram.h"
+#include "registry.h"
+#include "modbus.h"
+#include "fanout.h"
+#include "rangequery.h"
+#include "textbuf.h"
+#include "metrics.h"
+#include "histogram.h"
+#include "ingest.h"
+#include "pool.h"
+#include "handover.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -11,263 +23,393 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/timerfd.h>
 #include <netdb.h>
 
 #include <termios.h>
 #include <syslog.h>
+#include <malloc.h>
 
 #define BUFFSIZE 4096
-#define FIELDBUFSIZE 512
-
-#define handle_error(msg) \
-        do { perror(msg); return -1; } while (0)
+#define HISTORYSIZE 86400 /* Samples kept in memory, a day of telegrams at one per second */
+#define SUBSCRIBE_MAXFIELDS 16
+#define SUBSCRIBE_NAMESIZE  48
+#define SUBSCRIBE_INTERVAL  60  /* s, default */
+#define UDP_BATCH  32           /* Queries read and answered per wakeup */
+#define UDP_RCVBUF (1<<20)      /* Receive buffer asked for, capped by net.core.rmem_max */
 
 void Die(char *mess) { perror(mess); exit(1); }
 
-struct ModbusRequest
+static void logTime(int line)
 {
-        uint16_t transactionId;
-        uint16_t protocolId;
-        uint16_t length;
-        uint8_t  unitId;
-        uint8_t  functionCode;
-        uint16_t referenceNumber;
-        uint16_t wordCount;
-};
+        struct timespec now;
+        if (clock_gettime(CLOCK_REALTIME, &now) == -1) return;
+        fprintf(stderr,"===== line %i %li.%9li\n",line,now.tv_sec,now.tv_nsec);
+}
 
+static void printHelp(const InitializationData* id, const P1Telegram* p1, TextBuf* out);
 
-enum DataComplete { INCOMPLETE, COMPLETE, COMPLETE_WITH_ERROR };
+static void testCmd(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        textBufPrintf(out,"Hoi, dit is een test %s %s %i",__FUNCTION__,__FILE__,__LINE__);
+}
 
-enum ModBusStatus { NO_CONNECTION, WAIT_FOR_CONNECTION, WAIT_FOR_SEND_REQ, WAIT_FOR_REPLY };
+static void returnPowerCurUse(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        const double power=p1->value[P1_POWER_USED_L1]+p1->value[P1_POWER_USED_L2]+p1->value[P1_POWER_USED_L3];
+        textBufNumber(out,power*1000.);
+}
 
-static void logTime(int line)
+static void returnPowerCurProd(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
 {
-        struct timespec now;
-        if (clock_gettime(CLOCK_REALTIME, &now) == -1) return;
-        fprintf(stderr,"===== line %i %li.%9li\n",line,now.tv_sec,now.tv_nsec);
+        const double power=p1->value[P1_POWER_PRODUCED_L1]+p1->value[P1_POWER_PRODUCED_L2]+p1->value[P1_POWER_PRODUCED_L3];
+        textBufNumber(out,power*1000.);
 }
 
-static void printHelp(const InitializationData* id, const char* p1data, char* buffer);
+static void returnPowerCurNet(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        double power=0;
+        power+=p1->value[P1_POWER_USED_L1]+p1->value[P1_POWER_USED_L2]+p1->value[P1_POWER_USED_L3];
+        power-=p1->value[P1_POWER_PRODUCED_L1]+p1->value[P1_POWER_PRODUCED_L2]+p1->value[P1_POWER_PRODUCED_L3];
+        textBufNumber(out,power*1000.);
+}
 
-static void getField(const char* p1data, const char* field, char* buffer)
+static void returnNetSinceStart(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
 {
-        const char* c=strstr(p1data,field);
-        if (!c)
-        {
-                *buffer='\0';
-                return;
-        }
-        const char* n=strchr(c,'\n');
-        int size=n?n-c:strlen(c);
-        if (size>=FIELDBUFSIZE) size=FIELDBUFSIZE-1;
-        memcpy(buffer,c,size);
-        buffer[size]='\0';
+        const double totalPowerUsed     = p1->value[P1_USED_TARIFF1]+p1->value[P1_USED_TARIFF2];
+        const double totalPowerProduced = p1->value[P1_PRODUCED_TARIFF1]+p1->value[P1_PRODUCED_TARIFF2];
+        textBufNumber(out,totalPowerUsed-totalPowerProduced);
+}
+
+static void returnTotalSinceStart(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        textBufNumber(out,p1->value[P1_USED_TARIFF1]+p1->value[P1_USED_TARIFF2]);
 }
 
-static void testCmd(const InitializationData* id, const char* p1data, char* buffer)
+static void returnTotalProducedSinceStart(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
 {
-        sprintf(buffer,"Hoi, dit is een test %s %s %i",__FUNCTION__,__FILE__,__LINE__);
+        textBufNumber(out,p1->value[P1_PRODUCED_TARIFF1]+p1->value[P1_PRODUCED_TARIFF2]);
 }
 
-static double getP1Value(const char* p1data, const char* field)
+static void totalGas(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
 {
-        double f=NAN;
-        const char* c=strstr(p1data,field);
-        if (!c) return f;
-        /* Find open brace before the newline */
-        const char *newline=strchr(c,'\n'), *openbrace=strchr(c,'(');
-        if (newline && openbrace && openbrace<newline)
+        /* Gas field is special: first field is timestamp of measurement, second is actual field */
+        textBufNumber(out,p1->value[P1_GAS]);
+}
+
+static void voltage(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        textBufNumber(out,p1->value[P1_VOLTAGE_L1]);
+}
+
+static void showAll(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
+{
+        /* The telegram itself, not copied */
+        textBufRefer(out,p1->raw,p1->rawLen);
+}
+
+static int selectedDevice(const Measurements* m, const int defaultDevice)
+{
+        return m->device==DEVICE_DEFAULT?defaultDevice:m->device;
+}
+
+static double sunSpecValue(const Measurements* m, const int device, const int nr)
+{
+        /* Value of SunSpec field nr of one device, or summed over all devices
+         * that have data */
+        int i;
+        if (device!=DEVICE_SUM)
         {
-                f=atof(openbrace+1);
+                if (device<0 || device>=m->modbusCount) return NAN;
+                return getSunSpecValue(m->modbus[device].activeValues,nr);
         }
-        return f;
+        double sum=NAN;
+        for (i=0;i<m->modbusCount;i++)
+        {
+                const double v=getSunSpecValue(m->modbus[i].activeValues,nr);
+                if (isnan(v)) continue;
+                sum=isnan(sum)?v:sum+v;
+        }
+        return sum;
 }
 
-static float toFloat(const char* p_field)
+static struct timespec modbusUpdateTime(const Measurements* m, const int device)
 {
-        float f=0.;
-        const char* num=strchr(p_field,'(');
-        if (num && *++num)
+        /* Time of the last reply of a device, or the latest one of all */
+        struct timespec latest={0,0};
+        int i;
+        for (i=0;i<m->modbusCount;i++)
         {
-                f=atof(num);
+                const struct timespec t=m->modbus[i].updateTime;
+                if (device!=DEVICE_SUM && i!=device) continue;
+                if (t.tv_sec>latest.tv_sec || (t.tv_sec==latest.tv_sec && t.tv_nsec>latest.tv_nsec)) latest=t;
         }
-        return f;
+        return latest;
+}
+
+static void netConsumption(const Measurements* m, TextBuf* out)
+{
+        const P1Telegram* p1=m->p1;
+        double power=0;
+        /* Actual consumption reported by P1 */
+        power+=p1->value[P1_POWER_USED];
+        /* Or if not, actual production reported by P1 */
+        power-=p1->value[P1_POWER_PRODUCED];
+        const double sunSpecProd=sunSpecValue(m,selectedDevice(m,DEVICE_SUM),40084);
+        power*=1000;
+        power+=sunSpecProd;
+        textBufNumber(out,power);
 }
 
-static void compute10SAvg(const InitializationData* id, const char* p1data, char* buffer)
-{
-        char tmpbuf[FIELDBUFSIZE];
-        float power=0;
-        getField(p1data,"1-0:21.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:41.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:61.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        sprintf(buffer,"%f",power*1000.);
+/* Answers that only change with the data: rendered once per telegram or
+ * modbus reply, then the same bytes are served until the data changes */
+typedef struct
+{
+        char            text[BUFFSIZE];
+        int             len;
+        int             valid;
+        struct timespec p1Time;
+        struct timespec modbusTime;
+} CachedAnswer;
+
+static CachedAnswer jsonCache;
+static CachedAnswer helpCache;
+
+static int sameTime(const struct timespec a, const struct timespec b)
+{
+        return a.tv_sec==b.tv_sec && a.tv_nsec==b.tv_nsec;
 }
 
-static void returnPowerCurUse(const InitializationData* id, const char* p1data, char* buffer)
+static void jsonField(TextBuf* out, const char* name, const double value, const char* separator)
 {
-        compute10SAvg(id,p1data,buffer);
+        /* NAN has no JSON form, it is given as null */
+        textBufPrintf(out,"\"%s\":",name);
+        if (isnan(value)) textBufString(out,"null");
+        else textBufNumber(out,value);
+        textBufString(out,separator);
 }
 
-static void returnPowerCurProd(const InitializationData* id, const char* p1data, char* buffer)
-{
-        char tmpbuf[FIELDBUFSIZE];
-        float power=0;
-        getField(p1data,"1-0:22.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:42.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:62.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        sprintf(buffer,"%f",power*1000.);
+static void renderJson(const Measurements* m, const int device, const struct timespec modbusTime, TextBuf* out)
+{
+        const P1Telegram* p1=m->p1;
+        /* Get energy used/produced, unit Wh */
+        const double p1ConsumedTariff1=1000.*p1Value(p1,P1_USED_TARIFF1);
+        const double p1ConsumedTariff2=1000.*p1Value(p1,P1_USED_TARIFF2);
+        const double p1ProducedTariff1=1000.*p1Value(p1,P1_PRODUCED_TARIFF1);
+        const double p1ProducedTariff2=1000.*p1Value(p1,P1_PRODUCED_TARIFF2);
+        const double sunSpecProduced  =sunSpecValue(m,device,40094);
+        /* Get power, unit W */
+        const double p1Consuming      =1000.*p1Value(p1,P1_POWER_USED);
+        const double p1Producing      =1000.*p1Value(p1,P1_POWER_PRODUCED);
+        const double sunSpecProducing =sunSpecValue(m,device,40084);
+        textBufString(out,"{ \"energy\": { \"unit\":\"Wh\",");
+        jsonField(out,"p1consumedtariff1",p1ConsumedTariff1,",");
+        jsonField(out,"p1consumedtariff2",p1ConsumedTariff2,",");
+        jsonField(out,"p1producedtariff1",p1ProducedTariff1,",");
+        jsonField(out,"p1producedtariff2",p1ProducedTariff2,",");
+        jsonField(out,"sunspecproduced",sunSpecProduced,"");
+        textBufString(out,"}, \"power\": { \"unit\":\"W\",");
+        jsonField(out,"p1consuming",p1Consuming,",");
+        jsonField(out,"p1producing",p1Producing,",");
+        jsonField(out,"sunspecproducing",sunSpecProducing,",");
+        jsonField(out,"netconsuming",p1Consuming+sunSpecProducing-p1Producing,"");
+        textBufPrintf(out,"}, \"p1timestamp\":%li.%09li,",m->p1UpdateTime.tv_sec,m->p1UpdateTime.tv_nsec);
+        textBufPrintf(out,"\"modbustimestamp\":%li.%09li ",modbusTime.tv_sec,modbusTime.tv_nsec);
+        textBufString(out,"}");
 }
 
-static void returnPowerCurNet(const InitializationData* id, const char* p1data, char* buffer)
-{
-        char tmpbuf[FIELDBUFSIZE];
-        float power=0;
-        getField(p1data,"1-0:21.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:41.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:61.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        getField(p1data,"1-0:22.7.0",tmpbuf);
-        power-=toFloat(tmpbuf);
-        getField(p1data,"1-0:42.7.0",tmpbuf);
-        power-=toFloat(tmpbuf);
-        getField(p1data,"1-0:62.7.0",tmpbuf);
-        power-=toFloat(tmpbuf);
-        sprintf(buffer,"%f",power*1000.);
+static void jsonOutput(const Measurements* m, TextBuf* out)
+{
+        /* The sum over all devices, the default, is cached */
+        const int device=selectedDevice(m,DEVICE_SUM);
+        const struct timespec modbusTime=modbusUpdateTime(m,device);
+        CachedAnswer* cache=&jsonCache;
+        if (device!=DEVICE_SUM)
+        {
+                renderJson(m,device,modbusTime,out);
+                return;
+        }
+        if (!cache->valid || !sameTime(cache->p1Time,m->p1UpdateTime) || !sameTime(cache->modbusTime,modbusTime))
+        {
+                TextBuf text;
+                textBufInit(&text,cache->text,sizeof(cache->text));
+                renderJson(m,device,modbusTime,&text);
+                cache->len=text.len;
+                cache->p1Time=m->p1UpdateTime;
+                cache->modbusTime=modbusTime;
+                cache->valid=1;
+        }
+        textBufRefer(out,cache->text,cache->len);
 }
 
-static void returnNetSinceStart(const InitializationData* id, const char* p1data, char* buffer)
-{
-        char tmpbuf[FIELDBUFSIZE];
-        getField(p1data,"1-0:1.8.1",tmpbuf);
-        const float totalPowerUsed1     = toFloat(tmpbuf);
-        getField(p1data,"1-0:1.8.2",tmpbuf);
-        const float totalPowerUsed2     = toFloat(tmpbuf);
-        getField(p1data,"1-0:2.8.1",tmpbuf);
-        const float totalPowerProduced1 = toFloat(tmpbuf);
-        getField(p1data,"1-0:2.8.2",tmpbuf);
-        const float totalPowerProduced2 = toFloat(tmpbuf);
-        sprintf(buffer,"%f",totalPowerUsed1+totalPowerUsed2-totalPowerProduced1-totalPowerProduced2);
+static void modbusRate(const Measurements* m, TextBuf* out)
+{
+        const int device=selectedDevice(m,0);
+        if (device<0 || device>=m->modbusCount)
+        {
+                textBufString(out,"no such modbus device");
+                return;
+        }
+        const ModbusClient* c=&m->modbus[device];
+        textBufPrintf(out,"requested %.2f/s, period %i ms, achieved %.2f/s, overruns %lu",
+                        c->requestedPeriodMs?1000./c->requestedPeriodMs:0.,c->periodMs,modbusAchievedRate(c),c->overruns);
 }
 
-static void returnTotalSinceStart(const InitializationData* id, const char* p1data, char* buffer)
+static void listDevices(const Measurements* m, TextBuf* out)
 {
-        char tmpbuf[FIELDBUFSIZE];
-        getField(p1data,"1-0:1.8.1",tmpbuf);
-        const float totalPower1=toFloat(tmpbuf);
-        getField(p1data,"1-0:1.8.2",tmpbuf);
-        const float totalPower2=toFloat(tmpbuf);
-        sprintf(buffer,"%f",totalPower1+totalPower2);
+        static const char* statusNames[]={ "disconnected", "connecting", "connected" };
+        int i;
+        for (i=0;i<m->modbusCount;i++)
+        {
+                const ModbusClient* c=&m->modbus[i];
+                int j;
+                textBufPrintf(out,"%i %s unit %i %s replies %lu errors %lu updated %li.%09li models",
+                                i,c->config->name,c->config->unitId,statusNames[c->status],c->replies,c->errors,
+                                c->updateTime.tv_sec,c->updateTime.tv_nsec);
+                for (j=0;j<c->modelCount;j++)
+                {
+                        textBufPrintf(out," %i@%i",c->models[j].id,c->models[j].address);
+                }
+                textBufString(out,"\n");
+        }
+        if (i==0) textBufString(out,"no modbus devices");
 }
 
-static void returnTotalProducedSinceStart(const InitializationData* id, const char* p1data, char* buffer)
+static void windowStat(const Measurements* m, const int series, const enum Window window, const enum WindowStat stat, TextBuf* out)
 {
-        char tmpbuf[FIELDBUFSIZE];
-        getField(p1data,"1-0:2.8.1",tmpbuf);
-        const float totalPower1=toFloat(tmpbuf);
-        getField(p1data,"1-0:2.8.2",tmpbuf);
-        const float totalPower2=toFloat(tmpbuf);
-        sprintf(buffer,"%f",totalPower1+totalPower2);
+        const double val=timeSeriesStat(m->history,series,window,stat);
+        if (isnan(val)) textBufString(out,"no data");
+        else textBufNumber(out,val);
 }
 
-static void totalGas(const InitializationData* id, const char* p1data, char* buffer)
+static void compute10SAvg(const Measurements* m, TextBuf* out)
 {
-        char tmpbuf[FIELDBUFSIZE];
-        const char *brace1=0, *brace2=0;
-        float value=0;
-        getField(p1data,"0-1:24.2.1",tmpbuf);
-        /* Gas field is special: first field is timestamp of measurement, second is actual field */
-        brace1=strchr(tmpbuf,')');
-        if (brace1) brace2=strchr(brace1,'(');
-        if (brace2 && *(brace2+1)) value=atof(brace2+1);
-        sprintf(buffer,"%f",value);
+        windowStat(m,SERIES_USE,WINDOW_10S,STAT_AVG,out);
 }
 
-static void voltage(const InitializationData* id, const char* p1data, char* buffer)
+static void computeLastDayAvg(const Measurements* m, TextBuf* out)
 {
-        char tmpbuf[FIELDBUFSIZE];
-        getField(p1data,"1-0:32.7.0",tmpbuf);
-        const float voltage=toFloat(tmpbuf);
-        sprintf(buffer,"%f",voltage);
+        windowStat(m,SERIES_USE,WINDOW_24H,STAT_AVG,out);
 }
 
-static float value(const char* p1data, const char* field, const float scale)
+static void sampleMeasurements(const Measurements* m, double* values, HistoryRecord* r)
 {
-        char tmpbuf[FIELDBUFSIZE];
-        getField(p1data,field,tmpbuf);
-        return toFloat(tmpbuf) * scale;
+        /* Values of the HistorySeries and the meter readings from the
+         * latest data */
+        const P1Telegram* p1=m->p1;
+        const double sunSpec=sunSpecValue(m,DEVICE_SUM,40084);
+        int i;
+        values[SERIES_USE]=(p1->value[P1_POWER_USED_L1]+p1->value[P1_POWER_USED_L2]+p1->value[P1_POWER_USED_L3])*1000.;
+        values[SERIES_PROD]=(p1->value[P1_POWER_PRODUCED_L1]+p1->value[P1_POWER_PRODUCED_L2]+p1->value[P1_POWER_PRODUCED_L3])*1000.;
+        values[SERIES_NET]=values[SERIES_USE]-values[SERIES_PROD];
+        values[SERIES_SUNSPEC]=sunSpec;
+        values[SERIES_CONSUMPTION]=values[SERIES_NET]+(isnan(sunSpec)?0:sunSpec);
+
+        memset(r,0,sizeof(*r));
+        r->h.time=m->p1UpdateTime.tv_sec+m->p1UpdateTime.tv_nsec*1e-9;
+        for (i=0;i<SERIES_COUNT;i++) r->power[i]=values[i];
+        r->energy[ENERGY_USED_TARIFF1]=p1Value(p1,P1_USED_TARIFF1);
+        r->energy[ENERGY_USED_TARIFF2]=p1Value(p1,P1_USED_TARIFF2);
+        r->energy[ENERGY_PRODUCED_TARIFF1]=p1Value(p1,P1_PRODUCED_TARIFF1);
+        r->energy[ENERGY_PRODUCED_TARIFF2]=p1Value(p1,P1_PRODUCED_TARIFF2);
+        r->energy[ENERGY_SUNSPEC]=sunSpecValue(m,DEVICE_SUM,40094);
+        r->energy[ENERGY_GAS]=p1Value(p1,P1_GAS);
 }
 
-static void showAll(const InitializationData* id, const char* p1data, char* buffer)
+static void storageInfo(const Measurements* m, TextBuf* out)
 {
-        memcpy(buffer,p1data,BUFFSIZE);       
+        int t;
+        if (!m->store->files[TIER_RAW].header)
+        {
+                textBufString(out,"no history file, use -f");
+                return;
+        }
+        for (t=0;t<TIER_COUNT;t++)
+        {
+                const HistoryFile* h=&m->store->files[t];
+                const uint64_t oldest=historyOldest(h);
+                const uint64_t count=historyCount(h);
+                textBufPrintf(out,"%s%s records %llu capacity %u",t?"\n":"",tierNames[t],(unsigned long long)(count-oldest),h->header->capacity);
+                if (count>oldest)
+                {
+                        textBufPrintf(out," oldest %.3f newest %.3f",historyRecord(h,oldest)->time,historyRecord(h,count-1)->time);
+                }
+        }
 }
 
-static void netConsumption(const char* p1data, const uint16_t* modbusData, const struct timespec modbusUpdateTime, const struct timespec p1UpdateTime, char* buffer)
+/* Always on timing of the hot paths, in ns, shown by 'stats' */
+#define COMMANDKINDS (CMD_WINDOW+1)
+
+typedef struct
 {
-        char tmpbuf[FIELDBUFSIZE];
-        double power=0;
-        /* Actual consumption reported by P1 */
-        getField(p1data,"1-0:1.7.0",tmpbuf);
-        power+=toFloat(tmpbuf);
-        /* Or if not, actual production reported by P1 */
-        getField(p1data,"1-0:2.7.0",tmpbuf);
-        power-=toFloat(tmpbuf);
-        SunSpecValue* ssv=getParam(40084);
-        const uint16_t* data=modbusData+ssv->valueFieldNr-modbusBase;
-        const double sunSpecProd=ssv->calcFn(data,ssv->scaleFieldOffset);
-        power*=1000;
-        power+=sunSpecProd;
-        sprintf(buffer,"%f",power);
+        Histogram serial;       /* From the first byte of a telegram to its end */
+        Histogram parse;
+        Histogram publish;      /* Copying a telegram to the TCP clients and subscribers */
+        Histogram query[COMMANDKINDS];  /* Answering one command, by kind */
+        Histogram wakeups;      /* Event loop wakeups per second, a count */
+} HotPathStats;
+
+static HotPathStats stats;
+
+static const char* queryStatNames[COMMANDKINDS]={ "query.p1", "query.p1field", "query.combined", "query.sunspec", "query.window" };
+
+static void histogramLine(TextBuf* out, const char* name, const Histogram* h, const double scale)
+{
+        /* Count, mean, percentiles and maximum, values divided by scale */
+        static const double percentiles[]={ 50, 90, 99, 99.9 };
+        unsigned i;
+        textBufPrintf(out,"%s n=%llu mean=%.1f",name,(unsigned long long)h->count,histogramMean(h)/scale);
+        for (i=0;i<sizeof(percentiles)/sizeof(percentiles[0]);i++)
+        {
+                textBufPrintf(out," p%g=%.1f",percentiles[i],histogramPercentile(h,percentiles[i])/scale);
+        }
+        textBufPrintf(out," max=%.1f\n",h->max/scale);
 }
 
-static void jsonOutput(const char* p1data, const uint16_t* modbusData, const struct timespec modbusUpdateTime, const struct timespec p1UpdateTime, char* buffer)
+/* Pools of the steady state, for 'memory' and the metrics page */
+#define MEMORY_MAXPOOLS 4
+static const Pool* memoryPools[MEMORY_MAXPOOLS];
+static int memoryPoolCount;
+
+static void showMemory(const Measurements* m, TextBuf* out)
 {
-        /* Get energy used/produced, unit Wh */
-        int offset=0;
-        const double p1ConsumedTariff1=1000.*getP1Value(p1data,"1-0:1.8.1");
-        const double p1ConsumedTariff2=1000.*getP1Value(p1data,"1-0:1.8.2");
-        const double p1ProducedTariff1=1000.*getP1Value(p1data,"1-0:2.8.1");
-        const double p1ProducedTariff2=1000.*getP1Value(p1data,"1-0:2.8.2");
-        const double sunSpecProduced  =getSunSpecValue(modbusData,40094);
-        /* Get power, unit W */
-        const double p1Consuming      =1000.*getP1Value(p1data,"1-0:1.7.0");
-        const double p1Producing      =1000.*getP1Value(p1data,"1-0:2.7.0");
-        const double sunSpecProducing =getSunSpecValue(modbusData,40084);
-        offset+=sprintf(buffer+offset,"{ \"energy\": { \"unit\":\"Wh\",");
-        offset+=sprintf(buffer+offset,"\"p1consumedtariff1\":%F,",p1ConsumedTariff1);
-        offset+=sprintf(buffer+offset,"\"p1consumedtariff2\":%F,",p1ConsumedTariff2);
-        offset+=sprintf(buffer+offset,"\"p1producedtariff1\":%F,",p1ProducedTariff1);
-        offset+=sprintf(buffer+offset,"\"p1producedtariff2\":%F,",p1ProducedTariff2);
-        offset+=sprintf(buffer+offset,"\"sunspecproduced\":%F",sunSpecProduced);
-        offset+=sprintf(buffer+offset,"}, \"power\": { \"unit\":\"W\",");
-        offset+=sprintf(buffer+offset,"\"p1consuming\":%F,",p1Consuming);
-        offset+=sprintf(buffer+offset,"\"p1producing\":%F,",p1Producing);
-        offset+=sprintf(buffer+offset,"\"sunspecproducing\":%F,",sunSpecProducing);
-        offset+=sprintf(buffer+offset,"\"netconsuming\":%F",p1Consuming+sunSpecProducing-p1Producing);
-        offset+=sprintf(buffer+offset,"}, \"p1timestamp\":%li.%09li,",p1UpdateTime.tv_sec,p1UpdateTime.tv_nsec);
-        offset+=sprintf(buffer+offset,"\"modbustimestamp\":%li.%09li ",modbusUpdateTime.tv_sec,modbusUpdateTime.tv_nsec);
-        offset+=sprintf(buffer+offset,"}");
+        /* After startup the heap should not grow, everything that comes and
+         * goes is in the pools */
+        const struct mallinfo2 heap=mallinfo2();
+        int i;
+        textBufPrintf(out,"heap %zu bytes in use, %zu mapped\n",heap.uordblks,heap.hblkhd);
+        for (i=0;i<memoryPoolCount;i++)
+        {
+                const Pool* p=memoryPools[i];
+                textBufPrintf(out,"%s %i used, high-water %i of %i blocks of %zu bytes, exhausted %lu\n",
+                                p->name,p->used,p->highWater,p->blocks,p->blockSize,p->exhausted);
+        }
 }
 
-static void computeLastDayAvg(const InitializationData* id, char* buffer)
+static void showStats(const Measurements* m, TextBuf* out)
 {
-        strcpy(buffer,"last day avg: not implemented");
+        char name[MODBUS_NAMESIZE+8];
+        int i;
+        textBufString(out,"times in us, wakeups per second\n");
+        histogramLine(out,"serial",&stats.serial,1000);
+        histogramLine(out,"parse",&stats.parse,1000);
+        histogramLine(out,"publish",&stats.publish,1000);
+        for (i=0;i<COMMANDKINDS;i++) histogramLine(out,queryStatNames[i],&stats.query[i],1000);
+        for (i=0;i<m->modbusCount;i++)
+        {
+                snprintf(name,sizeof(name),"modbus.%s",m->modbus[i].config->name);
+                histogramLine(out,name,&m->modbus[i].latency,1000);
+        }
+        histogramLine(out,"wakeups",&stats.wakeups,1);
 }
 
-typedef void(*ComputeFn)(const InitializationData* id, const char* p1data, char* buffer);
-typedef void(*ComputeFnP1Modbus)(const char* p1data, const uint16_t* modbusData,  const struct timespec modbusUpdateTime, const struct timespec p1UpdateTime, char* buffer);
+typedef void(*ComputeFn)(const InitializationData* id, const P1Telegram* p1, TextBuf* out);
+typedef void(*ComputeFnP1Modbus)(const Measurements* m, TextBuf* out);
 
 /* Requires specific functionality, with only P1 data */
 typedef struct 
@@ -285,18 +427,26 @@ typedef struct
         const char* description;
 } CombinedCommand;
 
+/* Average, minimum or maximum of a history series over a window, named
+ * <series>.<stat>.<window> */
+typedef struct
+{
+        int             series;
+        enum Window     window;
+        enum WindowStat stat;
+} WindowCommand;
+
 /* Extract direct value from P1 telegram */
 typedef struct
 {
-        const char* fnName;
-        const char* fieldName;
-        const char* description;
-        float       scale;
+        const char*  fnName;
+        enum P1Field field;
+        const char*  description;
+        float        scale;
 } CommandMap;
 
 const Command cmd[] = {
         { "help",         printHelp                     , "show this help"},
-        { "10s",          compute10SAvg                 , "current power usage" },
         { "test",         testCmd                       , "simple test command" },
         { "volt",         voltage                       , "voltage L1" },
         { "gas",          totalGas                      , "total gas used" },
@@ -314,6 +464,13 @@ const Command cmd[] = {
 const CombinedCommand combinedCmd[] = {
         { "consumption", netConsumption, "Consumption: Net P1 usage - SunSpec production (W)" },
         { "json", jsonOutput, "json output of relevant fields" },
+        { "modbusrate", modbusRate, "SunSpec poll rate: requested and achieved" },
+        { "devices", listDevices, "SunSpec devices and their state" },
+        { "10s", compute10SAvg, "average power usage over the last 10s (W)" },
+        { "lastday", computeLastDayAvg, "average power usage over the last 24h (W)" },
+        { "storage", storageInfo, "records in the history file" },
+        { "stats", showStats, "latency percentiles of serial reads, parsing, queries and modbus" },
+        { "memory", showMemory, "heap in use, and use and high-water mark of the memory pools" },
 /*        { "production",  netProduction , "Production reported by SunSpec (W)" },
         { "consumption", 0, 0 },
           { "production", 0, 0 }, */
@@ -321,30 +478,39 @@ const CombinedCommand combinedCmd[] = {
 };
 
 const CommandMap cmdMap[] = {
-        { "VL1",          "1-0:32.7.0", "Voltage L1"                              ,1    },
-        { "VL2",          "1-0:52.7.0", "Voltage L2"                              ,1    },
-        { "VL3",          "1-0:72.7.0", "Voltage L3"                              ,1    },
-        { "PL1+",         "1-0:21.7.0", "Power L1 consumption"                    ,1000 },
-        { "PL2+",         "1-0:41.7.0", "Power L2 consumption"                    ,1000 },
-        { "PL3+",         "1-0:61.7.0", "Power L3 consumption"                    ,1000 },
-        { "PL1-",         "1-0:22.7.0", "Power L1 production"                     ,1000 },
-        { "PL2-",         "1-0:42.7.0", "Power L2 production"                     ,1000 },
-        { "PL3-",         "1-0:62.7.0", "Power L3 production"                     ,1000 },
-        { "gastime",      "0-1:24.2.1", "Time when gas measurement took place"    ,1    },
-        { "usagetariff1", "1-0:1.8.1",  "Total Electricity usage tariff 1"        ,1    },
-        { "usagetariff2", "1-0:1.8.2",  "Total Electricity usage tariff 2"        ,1    },
-        { "timestamp",    "0-0:1.0.0",  "Timestamp when telegram was measured"    ,1    },
+        { "VL1",          P1_VOLTAGE_L1,        "Voltage L1"                              ,1    },
+        { "VL2",          P1_VOLTAGE_L2,        "Voltage L2"                              ,1    },
+        { "VL3",          P1_VOLTAGE_L3,        "Voltage L3"                              ,1    },
+        { "PL1+",         P1_POWER_USED_L1,     "Power L1 consumption"                    ,1000 },
+        { "PL2+",         P1_POWER_USED_L2,     "Power L2 consumption"                    ,1000 },
+        { "PL3+",         P1_POWER_USED_L3,     "Power L3 consumption"                    ,1000 },
+        { "PL1-",         P1_POWER_PRODUCED_L1, "Power L1 production"                     ,1000 },
+        { "PL2-",         P1_POWER_PRODUCED_L2, "Power L2 production"                     ,1000 },
+        { "PL3-",         P1_POWER_PRODUCED_L3, "Power L3 production"                     ,1000 },
+        { "gastime",      P1_GAS_TIME,          "Time when gas measurement took place"    ,1    },
+        { "usagetariff1", P1_USED_TARIFF1,      "Total Electricity usage tariff 1"        ,1    },
+        { "usagetariff2", P1_USED_TARIFF2,      "Total Electricity usage tariff 2"        ,1    },
+        { "timestamp",    P1_TIMESTAMP,         "Timestamp when telegram was measured"    ,1    },
         { 0,0,0,0 }
 };
 
-static void printHelp(const InitializationData* id, const char* p1data, char* buffer)
+static void printHelp(const InitializationData* id, const P1Telegram* p1, TextBuf* out)
 {
-        int offset=0;
+        /* Only depends on the tables, rendered once */
+        TextBuf text;
         const Command*   cmd1;
         const CommandMap* cmd2;
         const SunSpecValue* ssv;
         char format[32];
-        offset+=sprintf(buffer+offset,"\nP1 commands:\n");
+        int i;
+        if (helpCache.valid)
+        {
+                textBufRefer(out,helpCache.text,helpCache.len);
+                return;
+        }
+        textBufInit(&text,helpCache.text,sizeof(helpCache.text));
+        textBufString(&text,"\nSeveral commands separated by commas are answered together, e.g. VL1,VL2,40084\n");
+        textBufString(&text,"P1 commands:\n");
 
         int width=0;
         for(cmd1=cmd;cmd1->fnName;cmd1++)
@@ -361,69 +527,245 @@ static void printHelp(const InitializationData* id, const char* p1data, char* bu
         sprintf(format,"%%-%is %%s\n",width);
         for(cmd1=cmd;cmd1->fnName;cmd1++)
         {
-                offset+=sprintf(buffer+offset,format,cmd1->fnName,cmd1->description);
+                textBufPrintf(&text,format,cmd1->fnName,cmd1->description);
         }
         for(cmd2=cmdMap;cmd2->fnName;cmd2++)
         {
-                offset+=sprintf(buffer+offset,format,cmd2->fnName,cmd2->description);
+                textBufPrintf(&text,format,cmd2->fnName,cmd2->description);
         }
-        offset+=sprintf(buffer+offset,"SunSpec commands:\n");
+        textBufString(&text,"SunSpec commands, by field or description, prefix with <device name or index>: or sum: to select device:\n");
         sprintf(format,"%%-%is %%-4s %%s\n",width);
-        offset+=sprintf(buffer+offset,format,"Field","Unit","Description");
+        textBufPrintf(&text,format,"Field","Unit","Description");
         sprintf(format,"%%-%ii %%-4s %%s\n",width);
         for (ssv=getParam(0); ssv->valueFieldNr;ssv++)
         {
-                offset+=sprintf(buffer+offset,format,ssv->valueFieldNr,ssv->unit,ssv->description);
+                textBufPrintf(&text,format,ssv->valueFieldNr,ssv->unit,ssv->description);
         }
+        textBufString(&text,"History commands: <series>.<avg|min|max>.<window> (W), e.g. use.avg.15m\n");
+        textBufString(&text,"Series:");
+        for (i=0;i<SERIES_COUNT;i++) textBufPrintf(&text," %s",seriesNames[i]);
+        textBufString(&text,"\nWindows:");
+        for (i=0;i<WINDOW_COUNT;i++) textBufPrintf(&text," %s",windowNames[i]);
+        textBufString(&text,"\nOn TCP, stored history: range <series>[.avg|.min|.max]|<meter> <from> <to> <step> [csv|bin]\n");
+        textBufString(&text,"On TCP, records after telegrams: subscribe <command>[,<command>...] [delta=<change>] [interval=<seconds>], unsubscribe\n");
+        textBufString(&text,"Meters:");
+        for (i=0;i<ENERGY_COUNT;i++) textBufPrintf(&text," %s",energyNames[i]);
+        textBufString(&text,"\n");
+        helpCache.len=text.len;
+        helpCache.valid=1;
+        textBufRefer(out,helpCache.text,helpCache.len);
 }
 
-void handleCommand(const InitializationData* id, const uint16_t* modbusData, const char* p1data, const struct timespec modbusUpdateTime, const struct timespec p1UpdateTime, char* buffer)
+static CommandRegistry registry;
+static char* sunSpecCmdNames=0;
+static WindowCommand* windowCmds=0;
+static char* windowCmdNames=0;
+
+#define SUNSPECNAMESIZE 8
+#define SUNSPECPOINTSIZE 32     /* Point name, the description up to a space */
+#define WINDOWCMDCOUNT (SERIES_COUNT*STAT_COUNT*WINDOW_COUNT)
+#define WINDOWNAMESIZE 24
+
+int initCommandRegistry()
 {
+        /* Put all commands in one hash table, so a command is found with a
+         * single lookup instead of walking each table in turn. SunSpec
+         * fields are registered by their register number as text */
         const Command*   command;
         const CommandMap* cmdmap;
         const CombinedCommand* combCmd;
-        char* buf2;
-        for (buf2=buffer; *buf2 ; buf2++)
+        const SunSpecValue* ssv;
+        unsigned count=0, sunSpecCount=0;
+        int error=0;
+
+        for (command=cmd; command->fnName; command++) count++;
+        for (cmdmap=cmdMap; cmdmap->fnName; cmdmap++) count++;
+        for (combCmd=combinedCmd; combCmd->fnName; combCmd++) count++;
+        for (ssv=getParam(0); ssv->valueFieldNr; ssv++) sunSpecCount++;
+
+        if (registryInit(&registry,count+2*sunSpecCount+WINDOWCMDCOUNT)) return -1;
+        if (!(sunSpecCmdNames=malloc(sunSpecCount*(SUNSPECNAMESIZE+SUNSPECPOINTSIZE)))) return -1;
+        if (!(windowCmds=malloc(WINDOWCMDCOUNT*sizeof(WindowCommand)))) return -1;
+        if (!(windowCmdNames=malloc(WINDOWCMDCOUNT*WINDOWNAMESIZE))) return -1;
+
+        for (command=cmd; command->fnName; command++)
+                error|=registryAdd(&registry,command->fnName,CMD_P1,command);
+        for (cmdmap=cmdMap; cmdmap->fnName; cmdmap++)
+                error|=registryAdd(&registry,cmdmap->fnName,CMD_P1MAP,cmdmap);
+        for (combCmd=combinedCmd; combCmd->fnName; combCmd++)
+                error|=registryAdd(&registry,combCmd->fnName,CMD_COMBINED,combCmd);
+        char* name=sunSpecCmdNames;
+        for (ssv=getParam(0); ssv->valueFieldNr; ssv++, name+=SUNSPECNAMESIZE+SUNSPECPOINTSIZE)
         {
-                if (*buf2=='\n') *buf2='\0';
+                snprintf(name,SUNSPECNAMESIZE,"%i",ssv->valueFieldNr);
+                error|=registryAdd(&registry,name,CMD_SUNSPEC,ssv);
+                /* Also by SunSpec point name, e.g. I_AC_Power. A command
+                 * ends at a space, so a note after the name in the
+                 * description is left out. */
+                char* point=name+SUNSPECNAMESIZE;
+                snprintf(point,SUNSPECPOINTSIZE,"%.*s",(int)strcspn(ssv->description," "),ssv->description);
+                error|=registryAdd(&registry,point,CMD_SUNSPEC,ssv);
         }
-        if (id->debug) fprintf(stderr,"Got command '%s'\n",buffer);
-        const int cmdNumber=atoi(buffer);
-        for (command=cmd; command->fnName; command++)
+        /* History aggregates: every combination of series, stat and window */
+        WindowCommand* wcmd=windowCmds;
+        name=windowCmdNames;
+        for (int series=0; series<SERIES_COUNT; series++)
         {
-                if (strcmp(command->fnName, buffer)==0)
+                for (int stat=0; stat<STAT_COUNT; stat++)
                 {
-                        if (id->debug) fprintf(stderr,"Doing command '%s'\n", command->fnName);
-                        return command->computeFunction(id,p1data,buffer);
+                        for (int window=0; window<WINDOW_COUNT; window++, wcmd++, name+=WINDOWNAMESIZE)
+                        {
+                                wcmd->series=series;
+                                wcmd->stat=stat;
+                                wcmd->window=window;
+                                snprintf(name,WINDOWNAMESIZE,"%s.%s.%s",seriesNames[series],statNames[stat],windowNames[window]);
+                                error|=registryAdd(&registry,name,CMD_WINDOW,wcmd);
+                        }
                 }
         }
-        for (cmdmap=cmdMap; cmdmap->fnName; cmdmap++)
+        return error;
+}
+
+const RegistryEntry* findCommand(const char* name, const size_t len)
+{
+        return registryFind(&registry,name,len);
+}
+
+static int findDevice(const Measurements* m, const char* name, const int len)
+{
+        /* Device by name or index, DEVICE_SUM for "sum", -3 if not found */
+        int i;
+        char* end;
+        if (len==3 && strncmp(name,"sum",3)==0) return DEVICE_SUM;
+        for (i=0;i<m->modbusCount;i++)
         {
-                if (strcmp(cmdmap->fnName,buffer)==0)
+                const char* devName=m->modbus[i].config->name;
+                if (strncmp(devName,name,len)==0 && devName[len]=='\0') return i;
+        }
+        i=strtol(name,&end,10);
+        if (end==name+len && i>=0 && i<m->modbusCount) return i;
+        return -3;
+}
+
+static int answerCommand(const InitializationData* id, const Measurements* m, const RegistryEntry* e, TextBuf* out)
+{
+        const P1Telegram* p1=m->p1;
+        switch (e->kind)
+        {
+                case CMD_P1:
+                {
+                        const Command* command=e->entry;
+                        if (id->debug) fprintf(stderr,"Doing command '%s'\n", command->fnName);
+                        command->computeFunction(id,p1,out);
+                        return 0;
+                }
+                case CMD_P1MAP:
                 {
-                        const float val=value(p1data,cmdmap->fieldName,cmdmap->scale);
+                        const CommandMap* cmdmap=e->entry;
+                        const double val=p1->value[cmdmap->field]*cmdmap->scale;
                         if (id->debug) fprintf(stderr,"Doing command '%s'\n", cmdmap->fnName);
-                        sprintf(buffer,"%f",val);
-                        return;
+                        textBufNumber(out,val);
+                        return 0;
+                }
+                case CMD_COMBINED:
+                {
+                        const CombinedCommand* combCmd=e->entry;
+                        combCmd->computeFunction(m,out);
+                        return 0;
+                }
+                case CMD_SUNSPEC:
+                {
+                        const SunSpecValue* ssv=e->entry;
+                        const double val=sunSpecValue(m,selectedDevice(m,0),ssv->valueFieldNr);
+                        if (isnan(val)) break;
+                        if (id->debug) fprintf(stderr,"Doing sunspec cmd %s %f %i %i %i\n", ssv->description,val,ssv->valueFieldNr,modbusBase, ssv->scaleFieldOffset);
+                        textBufNumber(out,val);
+                        return 0;
+                }
+                case CMD_WINDOW:
+                {
+                        const WindowCommand* wcmd=e->entry;
+                        windowStat(m,wcmd->series,wcmd->window,wcmd->stat,out);
+                        return 0;
                 }
         }
-        for (combCmd=combinedCmd;combCmd->fnName;combCmd++)
+        textBufString(out,"not implemented, run 'help' for an overview");
+        return -1;
+}
+
+static int runCommand(const InitializationData* id, const Measurements* measurements, const char* request, const int len, TextBuf* out)
+{
+        /* Answers the len bytes at request, returns -1 if there is no answer */
+        Measurements selection=*measurements;
+        const Measurements* m=&selection;
+        const char* command=request;
+        if (id->debug) fprintf(stderr,"Got command '%.*s'\n",len,request);
+        /* Optional device selection: <device>:<command> */
+        selection.device=DEVICE_DEFAULT;
+        const char* colon=memchr(request,':',len);
+        if (colon)
         {
-                if (strcmp(combCmd->fnName,buffer)==0)
+                selection.device=findDevice(m,request,colon-request);
+                command=colon+1;
+                if (selection.device<DEVICE_DEFAULT)
                 {
-                        return combCmd->computeFunction(p1data,modbusData,modbusUpdateTime,p1UpdateTime,buffer);
+                        textBufString(out,"unknown device, run 'devices' for an overview");
+                        return -1;
                 }
         }
-        SunSpecValue* ssv=getParam(cmdNumber);
-        if (cmdNumber && ssv && modbusData)
+        const RegistryEntry* e=registryFind(&registry,command,len-(command-request));
+        if (!e)
+        {
+                textBufString(out,"not implemented, run 'help' for an overview");
+                return -1;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        const int result=answerCommand(id,m,e,out);
+        histogramRecordSince(&stats.query[e->kind],&start);
+        return result;
+}
+
+static int commandLength(const char* request)
+{
+        /* Up to a comma or the end of the line */
+        return strcspn(request,",\r\n");
+}
+
+void handleCommand(const InitializationData* id, const Measurements* m, const char* request, TextBuf* answer)
+{
+        /* Commands separated by commas are answered in one reply, from the
+         * same data, with the answers separated by commas. A command without
+         * an answer gives an empty field. */
+        char buffer[BUFFSIZE];
+        TextBuf part;
+        int len=commandLength(request);
+        if (request[len]!=',')
         {
-                const uint16_t* data=modbusData+ssv->valueFieldNr-modbusBase;
-                const double val=ssv->calcFn(data,ssv->scaleFieldOffset);
-                if (id->debug) fprintf(stderr,"Doing sunspec cmd %i %s %f %i %i %i\n", cmdNumber,ssv->description,val,ssv->valueFieldNr,modbusBase, ssv->scaleFieldOffset);
-                sprintf(buffer,"%f", val);
+                runCommand(id,m,request,len,answer);
                 return;
         }
-        strcpy(buffer,"not implemented, run 'help' for an overview");
+        for (;;)
+        {
+                while (*request==' ')
+                {
+                        request++;
+                        len--;
+                }
+                textBufInit(&part,buffer,sizeof(buffer));
+                if (runCommand(id,m,request,len,&part)) part.len=0;
+                if (answer->len+part.len+2>answer->size)
+                {
+                        textBufInit(answer,answer->data,answer->size);
+                        textBufString(answer,"reply too long, ask for fewer fields");
+                        return;
+                }
+                textBufAppend(answer,part.text,part.len);
+                if (request[len]!=',') return;
+                textBufString(answer,",");
+                request+=len+1;
+                len=commandLength(request);
+        }
 }
 
 static int setupTcpSocket(const int port)
@@ -452,7 +794,7 @@ static int setupTcpSocket(const int port)
                 Die("Failed to bind server socket");
         }
 
-        const int backlog=5;
+        const int backlog=SOMAXCONN;
         if (listen(sock,backlog)==-1)
         {
                 Die("Failed to set socket into listen mode");
@@ -475,6 +817,10 @@ static int setupUdpSocket(const int port)
         }
         int on=1;
         setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+        /* Room for a burst of queries, and a count of those that did not fit */
+        const int rcvbuf=UDP_RCVBUF;
+        if (setsockopt(sock,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf))==-1) perror("SO_RCVBUF");
+        if (setsockopt(sock,SOL_SOCKET,SO_RXQ_OVFL,&on,sizeof(on))==-1) perror("SO_RXQ_OVFL");
         /* Construct the server sockaddr_in structure */
         memset(&echoserver, 0, sizeof(echoserver));       /* Clear struct */
         echoserver.sin6_family = AF_INET6;                  /* Internet/IP */
@@ -559,508 +905,987 @@ out2:
 
 
 
-static int handleUserQuery(const InitializationData* id, const uint16_t* modbusData, const char* p1data, const struct timespec modbusUpdateTime, const struct timespec p1UpdateTime, const int sock)
+/* UDP queries are read and answered in batches: one recvmmsg takes what
+ * arrived, up to UDP_BATCH datagrams, and one sendmmsg returns the answers.
+ * The buffers are static, they are too large for the stack. */
+typedef struct
 {
-        char buffer[BUFFSIZE];
-        unsigned int echolen;
-        struct sockaddr_in6 echoclient;
-        int received = 0;
-        int len;
-        /* Receive a message from the client */
-        unsigned clientlen = sizeof(struct sockaddr_in6);
-        if ((received = recvfrom(sock, buffer, BUFFSIZE, 0,
-                                        (struct sockaddr *) &echoclient,
-                                        &clientlen)) < 0)
+        struct mmsghdr       in[UDP_BATCH];
+        struct mmsghdr       out[UDP_BATCH];
+        struct iovec         query[UDP_BATCH];
+        struct iovec         answer[UDP_BATCH];
+        struct sockaddr_in6  peer[UDP_BATCH];
+        char                 control[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+        char                 queryText[UDP_BATCH][BUFFSIZE];
+        char                 answerText[UDP_BATCH][BUFFSIZE];
+        unsigned long        queries;           /* Datagrams received */
+        unsigned long        batches;           /* recvmmsg calls that returned datagrams */
+        unsigned long        dropped;           /* By the kernel for a full receive buffer */
+        unsigned long        sendErrors;        /* Answers that could not be sent */
+} UdpQueries;
+
+static UdpQueries udp;
+
+static int handleUserQuery(const InitializationData* id, const Measurements* m, const int sock)
+{
+        int i;
+        for (i=0;i<UDP_BATCH;i++)
+        {
+                struct msghdr* h=&udp.in[i].msg_hdr;
+                udp.query[i].iov_base=udp.queryText[i];
+                udp.query[i].iov_len=BUFFSIZE-1;
+                h->msg_name=&udp.peer[i];
+                h->msg_namelen=sizeof(udp.peer[i]);
+                h->msg_iov=&udp.query[i];
+                h->msg_iovlen=1;
+                h->msg_control=udp.control[i];
+                h->msg_controllen=sizeof(udp.control[i]);
+                h->msg_flags=0;
+        }
+        /* Receive what is there, the socket stays readable for the rest */
+        const int received=recvmmsg(sock,udp.in,UDP_BATCH,MSG_DONTWAIT,0);
+        if (received<0)
         {
+                if (errno==EAGAIN || errno==EINTR) return 0;
                 Die("Failed to receive message");
                 return 1;
         }
-        char ipaddr[400];
-        const char* resIpAddr=inet_ntop(AF_INET6, &echoclient.sin6_addr, ipaddr, 399 );
-        if (resIpAddr)
+        udp.queries+=received;
+        udp.batches++;
+        for (i=0;i<received;i++)
         {
-                if (id->debug) fprintf(stderr, "Client connected: %s\n", resIpAddr);
-        } else {
-                perror("getting ip address");
+                struct msghdr* h=&udp.in[i].msg_hdr;
+                struct cmsghdr* cmsg;
+                udp.queryText[i][udp.in[i].msg_len]='\0';
+                /* The kernel counts the datagrams dropped since the socket was opened */
+                for (cmsg=CMSG_FIRSTHDR(h);cmsg;cmsg=CMSG_NXTHDR(h,cmsg))
+                {
+                        if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SO_RXQ_OVFL)
+                        {
+                                uint32_t dropped;
+                                memcpy(&dropped,CMSG_DATA(cmsg),sizeof(dropped));
+                                udp.dropped=dropped;
+                        }
+                }
+                if (id->debug)
+                {
+                        char ipaddr[INET6_ADDRSTRLEN];
+                        if (inet_ntop(AF_INET6,&udp.peer[i].sin6_addr,ipaddr,sizeof(ipaddr)))
+                        {
+                                fprintf(stderr,"Client connected: %s\n",ipaddr);
+                        } else {
+                                perror("getting ip address");
+                        }
+                }
+                TextBuf answer;
+                textBufInit(&answer,udp.answerText[i],BUFFSIZE);
+                handleCommand(id,m,udp.queryText[i],&answer);
+                udp.answer[i].iov_base=(void*)answer.text;
+                udp.answer[i].iov_len=answer.len;
+                bzero(&udp.out[i],sizeof(udp.out[i]));
+                udp.out[i].msg_hdr.msg_name=&udp.peer[i];
+                udp.out[i].msg_hdr.msg_namelen=h->msg_namelen;
+                udp.out[i].msg_hdr.msg_iov=&udp.answer[i];
+                udp.out[i].msg_hdr.msg_iovlen=1;
         }
-        /* Send the message back to client */
-        handleCommand(id, modbusData, p1data, modbusUpdateTime, p1UpdateTime, buffer);
-        len=strlen(buffer);
-        if (sendto(sock, buffer, len, 0,
-                                (struct sockaddr *) &echoclient,
-                                sizeof(echoclient)) != len)
+        /* Send the answers back, skipping one that fails */
+        i=0;
+        while (i<received)
         {
-                Die("Mismatch in number of echo'd bytes");
-                return 1;
+                const int sent=sendmmsg(sock,udp.out+i,received-i,MSG_DONTWAIT);
+                if (sent>0)
+                {
+                        i+=sent;
+                } else if (sent==-1 && errno==EINTR) {
+                        continue;
+                } else {
+                        if (id->debug) perror("sendmmsg");
+                        udp.sendErrors++;
+                        i++;
+                }
         }
         return 0;
 }
 
+/* What TCP requests are answered from */
+typedef struct
+{
+        const InitializationData* id;
+        const Measurements* m;
+        TimeSeries*         history;
+        Pool*               states;     /* Of the fanout, for replies and subscriptions */
+} TcpContext;
 
+/* Reply to a query command, written in one go */
+typedef struct
+{
+        int  len;
+        int  offset;
+        char text[BUFFSIZE+1];
+} TextReply;
 
-static int acceptConnection(int p_fd, int* p_tcpconnections, const int p_maxconns)
+static int fillText(void* state, char* buffer, const int size)
 {
-        /* Find free connection */
-        int i;
-        int newsock=accept(p_fd,0,0);
-        if (newsock==-1) return -1;
+        TextReply* t=state;
+        const int len=t->len-t->offset<size?t->len-t->offset:size;
+        memcpy(buffer,t->text+t->offset,len);
+        t->offset+=len;
+        return len;
+}
+
+static int fillRange(void* state, char* buffer, const int size)
+{
+        return rangeQueryFill(state,buffer,size);
+}
 
-        for (i=0;i<p_maxconns;i++)
+/* Fields a TCP client subscribed to, and what was last sent */
+typedef struct
+{
+        char   fields[SUBSCRIBE_MAXFIELDS][SUBSCRIBE_NAMESIZE];
+        int    fieldCount;
+        double delta;           /* Change that makes a record to be sent */
+        double interval;        /* Seconds after which a record is sent anyway */
+        double last[SUBSCRIBE_MAXFIELDS];
+        double lastTime;
+} Subscription;
+
+static void subscribe(Pool* states, FanoutClient* c, const char* args, TextBuf* out)
+{
+        /* <command>[,<command>...] [delta=<change>] [interval=<seconds>] */
+        char fields[BUFFSIZE];
+        char option[32];
+        char* field;
+        char* save;
+        int n;
+        Subscription* s=poolAlloc(states);
+        if (!s)
         {
-                if (p_tcpconnections[i]==-1)
-                {
-                        p_tcpconnections[i]=newsock;
-                        break;
+                textBufString(out,"out of memory");
+                return;
+        }
+        memset(s,0,sizeof(*s));
+        s->interval=SUBSCRIBE_INTERVAL;
+        if (sscanf(args,"%4095s%n",fields,&n)!=1)
+        {
+                textBufString(out,"usage: subscribe <command>[,<command>...] [delta=<change>] [interval=<seconds>]");
+                poolRelease(states,s);
+                return;
+        }
+        for (args+=n; sscanf(args," %31s%n",option,&n)==1; args+=n)
+        {
+                if (!strncmp(option,"delta=",6)) s->delta=atof(option+6);
+                else if (!strncmp(option,"interval=",9)) s->interval=atof(option+9);
+                else {
+                        textBufPrintf(out,"unknown option '%s', use delta=<change> or interval=<seconds>",option);
+                        poolRelease(states,s);
+                        return;
                 }
         }
-        if (i==p_maxconns)
+        for (field=strtok_r(fields,",",&save);field;field=strtok_r(0,",",&save))
         {
-                /* Too many open sockets, reject */
-                close(newsock);
-                newsock=-1;
+                const char* colon=strchr(field,':');
+                const char* command=colon?colon+1:field;
+                if (s->fieldCount==SUBSCRIBE_MAXFIELDS || strlen(field)>=SUBSCRIBE_NAMESIZE ||
+                                !registryFind(&registry,command,strlen(command)))
+                {
+                        textBufPrintf(out,"can not subscribe to '%.64s': unknown command, or more than %i fields",field,SUBSCRIBE_MAXFIELDS);
+                        poolRelease(states,s);
+                        return;
+                }
+                strcpy(s->fields[s->fieldCount++],field);
         }
-        return newsock;
+        poolRelease(states,c->subscription);
+        c->subscription=s;
+        textBufPrintf(out,"subscribed to %i fields",s->fieldCount);
 }
 
+static void publishSubscriptions(Fanout* f, const InitializationData* id, const Measurements* m, const double now)
+{
+        /* After each telegram, send subscribers a record of time and answers
+         * when an answer changed more than their delta, or their interval
+         * passed */
+        char recordBuffer[BUFFSIZE];
+        char answerBuffer[BUFFSIZE];
+        TextBuf record;
+        TextBuf answer;
+        double values[SUBSCRIBE_MAXFIELDS];
+        int i, j;
+        for (i=0;i<f->maxClients;i++)
+        {
+                FanoutClient* c=&f->clients[i];
+                Subscription* s=c->subscription;
+                if (c->fd<0 || !s) continue;
+                int changed=now-s->lastTime>=s->interval;
+                textBufInit(&record,recordBuffer,sizeof(recordBuffer));
+                textBufPrintf(&record,"%.3f",now);
+                for (j=0;j<s->fieldCount;j++)
+                {
+                        char* end;
+                        textBufInit(&answer,answerBuffer,sizeof(answerBuffer));
+                        if (runCommand(id,m,s->fields[j],strlen(s->fields[j]),&answer)) textBufInit(&answer,answerBuffer,sizeof(answerBuffer));
+                        /* Numbers are short, a text answer is copied first */
+                        textBufAppend(&answer,"",0);
+                        values[j]=strtod(answer.text,&end);
+                        if (end==answer.text) values[j]=NAN;
+                        if (fabs(values[j]-s->last[j])>s->delta || isnan(values[j])!=isnan(s->last[j])) changed=1;
+                        textBufString(&record,",");
+                        textBufAppend(&record,answer.text,answer.len);
+                }
+                if (!changed) continue;
+                textBufString(&record,"\n");
+                memcpy(s->last,values,sizeof(values));
+                s->lastTime=now;
+                fanoutSend(f,c,record.text,record.len);
+        }
+}
 
-
-static void closeConnection(int p_fd, int* p_tcpconnections, const int p_maxconns)
+static FanoutReply tcpRequest(void* context, FanoutClient* c, const char* line)
 {
-        int i;
-        close(p_fd);
-        for (i=0;i<p_maxconns;i++)
+        /* 'range ...' streams stored history, 'subscribe ...' starts records
+         * after each telegram, other lines are answered as UDP queries. Text
+         * answers end with a newline. */
+        const TcpContext* tcp=context;
+        FanoutReply reply={ 0, 0 };
+        const char* error=0;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME,&now);
+        if (!strncmp(line,"range ",6))
         {
-                if (p_tcpconnections[i]==p_fd)
+                RangeQuery* q=poolAlloc(tcp->states);
+                if (!q) return reply;
+                error=rangeQueryInit(q,tcp->m->store,line+6,now.tv_sec+now.tv_nsec*1e-9);
+                if (!error)
                 {
-                        p_tcpconnections[i]=-1;
-                        return;
+                        reply.fill=fillRange;
+                        reply.state=q;
+                        return reply;
                 }
+                poolRelease(tcp->states,q);
+        }
+        TextReply* t=poolAlloc(tcp->states);
+        TextBuf answer;
+        if (!t) return reply;
+        textBufInit(&answer,t->text,sizeof(t->text));
+        if (error)
+        {
+                textBufString(&answer,error);
+        } else if (!strncmp(line,"subscribe ",10)) {
+                subscribe(tcp->states,c,line+10,&answer);
+        } else if (!strcmp(line,"unsubscribe")) {
+                poolRelease(tcp->states,c->subscription);
+                c->subscription=0;
+                textBufString(&answer,"unsubscribed");
+        } else {
+                timeSeriesExpire(tcp->history,now.tv_sec+now.tv_nsec*1e-9);
+                handleCommand(tcp->id,tcp->m,line,&answer);
         }
+        /* Copies a cached answer, it may change before it is written */
+        textBufString(&answer,"\n");
+        t->len=answer.len;
+        t->offset=0;
+        reply.fill=fillText;
+        reply.state=t;
+        return reply;
 }
 
+/* What the metrics page is rendered from */
+typedef struct
+{
+        const Measurements*  m;
+        const SerialIngest*  ingest;
+        const Fanout*        fanout;
+} MetricsContext;
 
+#define METRICS_LABELSIZE (2*MODBUS_NAMESIZE+16)
 
-static enum DataComplete dataComplete(const char* p_p1data, const int len)
+static void metricHelp(TextBuf* out, const char* name, const char* type, const char* help)
 {
-        /* First find the exclamation mark, start of the signature */
-        const char* excl=strchr(p_p1data,'!');
-        if (excl==0) return INCOMPLETE;
-        /* After the '!', there are 4 digits, CR, LF, so len should be 7 ahead of excl */
-        const char* lf=strchr(excl,'\n');
-        if (!lf || (lf-excl)!=6) return INCOMPLETE;
-        /* Full amount of data read, check the checksum , still to be
-         * implemented ... */
-        
-        return COMPLETE;
+        textBufPrintf(out,"# HELP powermonitor_%s %s\n# TYPE powermonitor_%s %s\n",name,help,name,type);
 }
 
-
-
-static int startModbusConnection(InitializationData* id)
+static void metricSample(TextBuf* out, const char* name, const char* labels, const double value)
 {
-        /* Return value: -1 in case of failure, fd with non-blocking socket in
-         * connecting mode to modbus device */
-        if (id->modbusAddr==0) return -1;
-        int sock=socket(id->ai_family, id->ai_socktype | SOCK_NONBLOCK, id->ai_protocol);
-        if (sock<0) return -1;
-        
-        int conn=connect(sock,id->modbusAddr, id->modbusAddrlen);
-        if (conn==0 || errno==EINPROGRESS) return sock;
+        /* labels is 0, or label="value" pairs */
+        textBufPrintf(out,"powermonitor_%s%s%s%s ",name,labels?"{":"",labels?labels:"",labels?"}":"");
+        textBufNumber(out,value);
+        textBufString(out,"\n");
+}
 
-        close(sock);
-        return -1;
+static void deviceLabel(char* label, const char* name)
+{
+        /* device="<name>", with backslash and double quote escaped */
+        int len=sprintf(label,"device=\"");
+        for (;*name;name++)
+        {
+                if (*name=='\\' || *name=='"') label[len++]='\\';
+                label[len++]=*name;
+        }
+        strcpy(label+len,"\"");
 }
 
+enum ModbusMetric { MM_CONNECTED, MM_CONNECTS, MM_REQUESTS, MM_REPLIES, MM_ERRORS, MM_OVERRUNS,
+        MM_PERIOD, MM_RATE, MM_UPDATETIME, MM_COUNT };
 
+static const struct
+{
+        const char* name;
+        const char* type;
+        const char* help;
+} modbusMetrics[MM_COUNT]={
+        { "modbus_connected",          "gauge",   "1 if the connection to the SunSpec device is up" },
+        { "modbus_connects_total",     "counter", "Connections made to the SunSpec device" },
+        { "modbus_requests_total",     "counter", "Read requests sent" },
+        { "modbus_replies_total",      "counter", "Polls completely answered" },
+        { "modbus_errors_total",       "counter", "Exception replies and connection errors" },
+        { "modbus_overruns_total",     "counter", "Polls due while the previous one was unanswered" },
+        { "modbus_poll_period_seconds","gauge",   "Current poll period, longer than requested when the device can not keep up" },
+        { "modbus_poll_rate",          "gauge",   "Polls answered per second" },
+        { "modbus_update_time_seconds","gauge",   "Time of the last complete poll, seconds since the epoch" },
+};
 
-static int readSerialData(InitializationData* id, const int fd, const int p1size, int* p1TmpCount, char* p1tmpdata)
+static double modbusMetricValue(const ModbusClient* c, const enum ModbusMetric metric)
 {
-        int bytesToRead=p1size-1-*p1TmpCount;
-        if (bytesToRead==0)
+        switch (metric)
         {
-                // Buffer fully read but still nothing, start again
-                *p1TmpCount=0;
-                bytesToRead=p1size-1;
-                syslog(LOG_INFO,"corrupted data read from p1 port");
+                case MM_CONNECTED:  return c->status==CONNECTED;
+                case MM_CONNECTS:   return c->connects;
+                case MM_REQUESTS:   return c->requests;
+                case MM_REPLIES:    return c->replies;
+                case MM_ERRORS:     return c->errors;
+                case MM_OVERRUNS:   return c->overruns;
+                case MM_PERIOD:     return c->periodMs/1000.;
+                case MM_RATE:       return modbusAchievedRate(c);
+                case MM_UPDATETIME: return c->updateTime.tv_sec+c->updateTime.tv_nsec*1e-9;
+                default:            return NAN;
         }
-        int bytesRead=read(fd,p1tmpdata+*p1TmpCount,bytesToRead);
-        if (id->debug) fprintf(stderr,"Got %i bytes from serial port\n",bytesRead);
-        if (bytesRead>0)
-        {
-                *p1TmpCount+=bytesRead;
-                p1tmpdata[*p1TmpCount]='\0';
-                if (dataComplete(p1tmpdata,*p1TmpCount)!=INCOMPLETE)
-                {
-                        return 0;
-                } else {
-                        if (id->debug) fprintf(stderr,"Data not yet complete\n");
-                }
-        } else {
-                /* Something went wrong. Close the serial port and open it again. */
-                int errornr=errno;
-                close(id->serialDeviceFd);
-                const char* msg="P1 serial device closed, reopening";
-                const char* errmsg=strerror(errornr);
-                syslog(LOG_INFO,"%s %s", msg, errmsg);
-
-                id->serialDeviceFd=openP1Device(id->serialDeviceName);
-        }
-        /* Not complete */
-        return 1;
 }
 
+enum PoolMetric { PM_BLOCKS, PM_USED, PM_HIGHWATER, PM_EXHAUSTED, PM_COUNT };
+
+static const struct
+{
+        const char* name;
+        const char* type;
+        const char* help;
+} poolMetrics[PM_COUNT]={
+        { "pool_blocks",            "gauge",   "Blocks of the memory pool, sized at startup" },
+        { "pool_blocks_used",       "gauge",   "Blocks of the memory pool in use" },
+        { "pool_blocks_high_water", "gauge",   "Most blocks of the memory pool used at once" },
+        { "pool_exhausted_total",   "counter", "Allocations refused because all blocks were in use" },
+};
 
+static double poolMetricValue(const Pool* p, const enum PoolMetric metric)
+{
+        switch (metric)
+        {
+                case PM_BLOCKS:    return p->blocks;
+                case PM_USED:      return p->used;
+                case PM_HIGHWATER: return p->highWater;
+                case PM_EXHAUSTED: return p->exhausted;
+                default:           return NAN;
+        }
+}
 
-static enum ModBusStatus readModbusData(const int debug, const int modbusfd, const short revents, const enum ModBusStatus modbusStatus, uint16_t* modbusData, uint16_t** activeModBusData, struct timespec* modbusUpdateTime)
+static void renderMetrics(void* context, TextBuf* out)
 {
-        if (debug)
+        /* Prometheus text exposition format. Values without data are left
+         * out. */
+        const MetricsContext* mc=context;
+        const Measurements* m=mc->m;
+        const CommandMap* cmdmap;
+        const SunSpecValue* ssv;
+        char labels[METRICS_LABELSIZE+64];
+        int i, metric;
+
+        metricHelp(out,"p1_value","gauge","Value from the P1 telegram, in the unit of the command of the same name");
+        for (cmdmap=cmdMap; cmdmap->fnName; cmdmap++)
         {
-                fprintf(stderr,"modbusstatus 3: %i\n", modbusStatus);
+                const double v=p1Value(m->p1,cmdmap->field)*cmdmap->scale;
+                if (isnan(v)) continue;
+                snprintf(labels,sizeof(labels),"field=\"%s\"",cmdmap->fnName);
+                metricSample(out,"p1_value",labels,v);
         }
-        /* Only modify the state somewhere inside this function, so we start
-         * with the original state here */
-        enum ModBusStatus nextStatus=modbusStatus;
-        switch (modbusStatus)
+        metricHelp(out,"p1_telegrams_total","counter","Telegrams received with a valid or no CRC");
+        metricSample(out,"p1_telegrams_total",0,atomic_load(&mc->ingest->telegrams));
+        metricHelp(out,"p1_crc_errors_total","counter","Telegrams dropped because of a wrong CRC");
+        metricSample(out,"p1_crc_errors_total",0,atomic_load(&mc->ingest->crcErrors));
+        metricHelp(out,"p1_telegrams_replaced_total","counter","Telegrams replaced by a newer one before the event loop took them");
+        metricSample(out,"p1_telegrams_replaced_total",0,atomic_load(&mc->ingest->replaced));
+        metricHelp(out,"p1_reopens_total","counter","Times the P1 serial device was opened again after an error");
+        metricSample(out,"p1_reopens_total",0,atomic_load(&mc->ingest->reopens));
+        metricHelp(out,"p1_update_time_seconds","gauge","Time the last telegram was received, seconds since the epoch");
+        metricSample(out,"p1_update_time_seconds",0,m->p1UpdateTime.tv_sec+m->p1UpdateTime.tv_nsec*1e-9);
+
+        if (m->modbusCount)
         {
-                case WAIT_FOR_CONNECTION:
-                        if (revents & POLLOUT)
-                        {
-                                /* connect() finished, check
-                                 * if it succeeeded */
-                                if(debug) fprintf(stderr,"modbus connect returned\n");
-                                const int level=SOL_SOCKET, optname=SO_ERROR;
-                                int optval; socklen_t optlen=sizeof(int);
-                                const int sockoptret=getsockopt(modbusfd,level,optname,&optval,&optlen);
-                                if(debug)
-                                {
-                                        fprintf(stderr,"getsockopt: %i optval %i\n",sockoptret,optval);
-                                        errno=optval;
-                                        perror("connect to solaredge");
-                                }
-                                if (sockoptret==0 && optval==0)
-                                {
-                                        if(debug) fprintf(stderr,"modbus got connected\n");
-                                        /* Success connecting,
-                                         * proceed */
-                                        nextStatus=WAIT_FOR_SEND_REQ;
-                                } else {
-                                        /* Error, close socket
-                                         * */
-                                        close(modbusfd);
-                                        if (debug) fprintf(stderr,"closed modbusfd: fd=%i\n",modbusfd);
-                                        nextStatus=NO_CONNECTION;
-                                }
-                        }
-                        break;
-                case WAIT_FOR_SEND_REQ:
-                        if (revents & POLLOUT)
+                char device[METRICS_LABELSIZE];
+                metricHelp(out,"sunspec_value","gauge","SunSpec inverter value, by register and point name");
+                for (i=0;i<m->modbusCount;i++)
+                {
+                        deviceLabel(device,m->modbus[i].config->name);
+                        for (ssv=getParam(0); ssv->valueFieldNr; ssv++)
                         {
-                                const struct ModbusRequest mbr = { 
-                                        .transactionId=htons(1),
-                                        .protocolId=htons(0),
-                                        .length=htons(6),
-                                        .unitId=1,
-                                        .functionCode=3,
-                                        .referenceNumber=htons(40000),
-                                        .wordCount=htons(modbusRegCount)
-                                };
-                                if (write(modbusfd,&mbr,sizeof(mbr))==sizeof(mbr))
-                                {
-                                        nextStatus=WAIT_FOR_REPLY;
-                                } else {
-                                        close(modbusfd);
-                                        if (debug) fprintf(stderr,"closed modbusfd: fd=%i\n",modbusfd);
-                                        nextStatus=NO_CONNECTION;
-                                }
+                                const double v=getSunSpecValue(m->modbus[i].activeValues,ssv->valueFieldNr);
+                                if (isnan(v)) continue;
+                                snprintf(labels,sizeof(labels),"%s,register=\"%i\",point=\"%s\",unit=\"%s\"",
+                                                device,ssv->valueFieldNr,ssv->description,ssv->unit);
+                                metricSample(out,"sunspec_value",labels,v);
                         }
-                        break;
-                case WAIT_FOR_REPLY:
-                        if (revents & POLLIN)
+                }
+                for (metric=0;metric<MM_COUNT;metric++)
+                {
+                        metricHelp(out,modbusMetrics[metric].name,modbusMetrics[metric].type,modbusMetrics[metric].help);
+                        for (i=0;i<m->modbusCount;i++)
                         {
-                                uint16_t* buf=(*activeModBusData==modbusData)?modbusData+modbusRegCount:modbusData;
-                                const int modbusHeaderSize=9; /* Modbus reply header size, content not relevant for us now */
-                                char tmpbuf[modbusHeaderSize];
-                                if (read(modbusfd,tmpbuf,modbusHeaderSize)!=modbusHeaderSize)
-                                {
-                                        close(modbusfd);
-                                        nextStatus=NO_CONNECTION;
-                                }
-                                if (read(modbusfd,buf,sizeof(uint16_t)*modbusRegCount)==sizeof(uint16_t)*modbusRegCount)
-                                {
-                                        clock_gettime(CLOCK_REALTIME,modbusUpdateTime);
-                                        *activeModBusData=buf;
-                                }
-                                close(modbusfd);
-                                if (debug) fprintf(stderr,"closed modbusfd after read: fd=%i\n",modbusfd);
-                                nextStatus=NO_CONNECTION;
+                                deviceLabel(labels,m->modbus[i].config->name);
+                                metricSample(out,modbusMetrics[metric].name,labels,modbusMetricValue(&m->modbus[i],metric));
                         }
-                        break;
-                default:
-                        break;
+                }
+                metricHelp(out,"modbus_latency_seconds","summary","Time from a request to its reply");
+                for (i=0;i<m->modbusCount;i++)
+                {
+                        deviceLabel(labels,m->modbus[i].config->name);
+                        metricSample(out,"modbus_latency_seconds_sum",labels,m->modbus[i].latency.sum*1e-9);
+                        metricSample(out,"modbus_latency_seconds_count",labels,m->modbus[i].latency.count);
+                }
+        }
+
+        metricHelp(out,"tcp_telegrams_published_total","counter","Telegrams copied to the TCP clients");
+        metricSample(out,"tcp_telegrams_published_total",0,mc->fanout->published);
+        metricHelp(out,"tcp_telegrams_dropped_total","counter","Telegrams dropped for slow TCP clients");
+        metricSample(out,"tcp_telegrams_dropped_total",0,mc->fanout->dropped);
+        metricHelp(out,"tcp_disconnects_total","counter","TCP clients disconnected for being slow");
+        metricSample(out,"tcp_disconnects_total",0,mc->fanout->disconnects);
+        metricHelp(out,"tcp_requests_total","counter","Request lines from TCP clients");
+        metricSample(out,"tcp_requests_total",0,mc->fanout->requests);
+        metricHelp(out,"tcp_requests_busy_total","counter","Request lines answered busy, for lack of memory in the pools");
+        metricSample(out,"tcp_requests_busy_total",0,mc->fanout->busy);
+        metricHelp(out,"tcp_writes_total","counter","Writes to TCP clients, each of all telegrams queued to a client");
+        metricSample(out,"tcp_writes_total",0,mc->fanout->writes);
+
+        metricHelp(out,"udp_queries_total","counter","Query datagrams received");
+        metricSample(out,"udp_queries_total",0,udp.queries);
+        metricHelp(out,"udp_batches_total","counter","Wakeups that read query datagrams, up to 32 at a time");
+        metricSample(out,"udp_batches_total",0,udp.batches);
+        metricHelp(out,"udp_dropped_total","counter","Query datagrams dropped by the kernel for a full receive buffer, known when the next one arrives");
+        metricSample(out,"udp_dropped_total",0,udp.dropped);
+        metricHelp(out,"udp_send_errors_total","counter","Answers that could not be sent");
+        metricSample(out,"udp_send_errors_total",0,udp.sendErrors);
+
+        const struct mallinfo2 heap=mallinfo2();
+        metricHelp(out,"heap_bytes","gauge","Heap in use, does not grow after startup");
+        metricSample(out,"heap_bytes",0,heap.uordblks+heap.hblkhd);
+        for (metric=0;metric<PM_COUNT;metric++)
+        {
+                metricHelp(out,poolMetrics[metric].name,poolMetrics[metric].type,poolMetrics[metric].help);
+                for (i=0;i<memoryPoolCount;i++)
+                {
+                        snprintf(labels,sizeof(labels),"pool=\"%s\"",memoryPools[i]->name);
+                        metricSample(out,poolMetrics[metric].name,labels,poolMetricValue(memoryPools[i],metric));
+                }
         }
-        return nextStatus;
 }
 
+/* Who handles events of an fd registered with epoll: the kind of source, its
+ * index and a generation number. Comparing the generation makes an event
+ * harmless when its fd was closed and the number reused within one
+ * epoll_wait result. */
+enum EventSource { EV_UDP, EV_LISTEN, EV_INGEST, EV_MODBUS_TIMER, EV_MODBUS, EV_CLIENT, EV_METRICS_LISTEN, EV_METRICS, EV_SIGNAL };
 
+#define EVENT_TAG(kind,index,generation) (((uint64_t)(generation)<<32)|((uint64_t)(index)<<8)|(kind))
+#define EVENT_KIND(tag)       ((enum EventSource)((tag)&0xff))
+#define EVENT_INDEX(tag)      ((int)(((tag)>>8)&0xffffff))
+#define EVENT_GENERATION(tag) ((uint32_t)((tag)>>32))
 
-static int setupModbusTimer(const int timeout)
-{
-        int fd=-1;
-        struct itimerspec new_value;
-        struct timespec now;
-        uint64_t exp, tot_exp;
-        ssize_t s;
+#define MAXEVENTS 64
 
+static void watchFd(const int epfd, const int fd, const uint32_t events, const uint64_t tag)
+{
+        struct epoll_event ev;
+        ev.events=events;
+        ev.data.u64=tag;
+        if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)==-1) perror("epoll_ctl");
+}
 
-        if (clock_gettime(CLOCK_REALTIME, &now) == -1)
-                handle_error("clock_gettime");
+static void watchModbus(const int epfd, const ModbusClient* c, const int index, uint32_t* generation)
+{
+        /* Register the socket once after it was created. Edge triggered, so
+         * nothing changes when the client switches between reading and
+         * writing; the client reads and writes until EAGAIN. */
+        if (c->fd<0 || *generation==(uint32_t)c->sockets) return;
+        *generation=c->sockets;
+        watchFd(epfd,c->fd,EPOLLIN|EPOLLOUT|EPOLLET,EVENT_TAG(EV_MODBUS,index,c->sockets));
+}
 
-        /* Create a CLOCK_REALTIME absolute timer with initial expiration 1s
-         * from now, and interval as specified in argument */
+static void raiseFileLimit(const int maxConns)
+{
+        /* Every TCP client needs an fd, raise the soft limit as far as needed
+         * and allowed */
+        struct rlimit limit;
+        const rlim_t needed=maxConns+64;
+        if (getrlimit(RLIMIT_NOFILE,&limit)==-1 || limit.rlim_cur>=needed) return;
+        limit.rlim_cur=(limit.rlim_max!=RLIM_INFINITY && limit.rlim_max<needed)?limit.rlim_max:needed;
+        if (setrlimit(RLIMIT_NOFILE,&limit)==-1) perror("setrlimit");
+}
 
-        new_value.it_value.tv_sec = now.tv_sec+1;
-        new_value.it_value.tv_nsec = now.tv_nsec;
-        new_value.it_interval.tv_sec = timeout;
-        new_value.it_interval.tv_nsec = 0;
+static int adoptSocket(Handover* h, const enum HandoverType type, const unsigned port)
+{
+        /* The socket of the previous instance, if it is still for port */
+        HandoverRecord r;
+        struct sockaddr_in6 addr;
+        socklen_t len=sizeof(addr);
+        if (!h || !handoverFind(h,type,&r)) return -1;
+        if (getsockname(r.fd,(struct sockaddr*)&addr,&len)==-1 || addr.sin6_family!=AF_INET6 || ntohs(addr.sin6_port)!=port)
+        {
+                close(r.fd);
+                return -1;
+        }
+        return r.fd;
+}
 
-        fd = timerfd_create(CLOCK_REALTIME, 0);
-        if (fd == -1)
-                handle_error("timerfd_create");
+static int adoptSerialDevice(Handover* h, const char* deviceName, const char** pending, int* pendingLen)
+{
+        /* The serial device of the previous instance, if it is the same
+         * device, and what was read after the last telegram */
+        HandoverRecord r;
+        if (!h || !deviceName || !handoverFind(h,HANDOVER_SERIAL,&r)) return -1;
+        const size_t nameLen=strnlen(r.data,r.len);
+        if (nameLen==r.len || strcmp(r.data,deviceName))
+        {
+                close(r.fd);
+                return -1;
+        }
+        *pending=r.data+nameLen+1;
+        *pendingLen=r.len-nameLen-1;
+        return r.fd;
+}
 
-        if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &new_value, NULL) == -1)
-                handle_error("timerfd_settime");
+static void handoverHistory(Handover* h, const TimeSeries* ts)
+{
+        /* The number of series, then for each sample its time and a value
+         * per series */
+        const uint32_t seriesCount=ts->seriesCount;
+        const size_t sampleSize=sizeof(double)+seriesCount*sizeof(float);
+        const uint32_t len=sizeof(seriesCount)+ts->size*sampleSize;
+        char* data=malloc(len);
+        uint32_t n, s;
+        if (!data) return;
+        memcpy(data,&seriesCount,sizeof(seriesCount));
+        char* p=data+sizeof(seriesCount);
+        for (n=ts->head-ts->size;n!=ts->head;n++)
+        {
+                const uint32_t pos=n%ts->capacity;
+                memcpy(p,&ts->time[pos],sizeof(double));
+                p+=sizeof(double);
+                for (s=0;s<seriesCount;s++,p+=sizeof(float)) memcpy(p,&ts->values[(size_t)s*ts->capacity+pos],sizeof(float));
+        }
+        handoverPut(h,HANDOVER_SAMPLES,-1,data,len);
+        free(data);
+}
 
-        return fd;
+static void restoreHistory(TimeSeries* ts, const HandoverRecord* r)
+{
+        uint32_t seriesCount, s;
+        if (r->len<sizeof(seriesCount)) return;
+        memcpy(&seriesCount,r->data,sizeof(seriesCount));
+        if (seriesCount!=(uint32_t)ts->seriesCount)
+        {
+                syslog(LOG_INFO,"Samples of %u series handed over instead of %i, time windows start empty",seriesCount,ts->seriesCount);
+                return;
+        }
+        const size_t sampleSize=sizeof(double)+seriesCount*sizeof(float);
+        const char* p;
+        double values[seriesCount];
+        for (p=r->data+sizeof(seriesCount);p+sampleSize<=r->data+r->len;p+=sampleSize)
+        {
+                double time;
+                float value;
+                memcpy(&time,p,sizeof(time));
+                for (s=0;s<seriesCount;s++)
+                {
+                        memcpy(&value,p+sizeof(double)+s*sizeof(float),sizeof(value));
+                        values[s]=value;
+                }
+                timeSeriesAppend(ts,time,values);
+        }
 }
 
+static void resume(Handover* h, Fanout* f, TimeSeries* history, const int epfd)
+{
+        /* Take over the clients of the previous instance, what was queued to
+         * them is sent first, and the samples of the time windows */
+        HandoverRecord r;
+        FanoutClient* c=0;
+        int clients=0;
+        while (handoverNext(h,&r))
+        {
+                switch (r.type)
+                {
+                        case HANDOVER_CLIENT:
+                                c=fanoutAdopt(f,&r);
+                                if (!c) break;
+                                clients++;
+                                watchFd(epfd,c->fd,EPOLLIN|EPOLLOUT|EPOLLET,EVENT_TAG(EV_CLIENT,c-f->clients,c->generation));
+                                break;
+                        case HANDOVER_QUEUED:
+                                if (c && c->fd>=0) fanoutSend(f,c,r.data,r.len);
+                                break;
+                        case HANDOVER_SUBSCRIPTION:
+                                if (c && c->fd>=0 && r.len==sizeof(Subscription) && (c->subscription=poolAlloc(&f->states)))
+                                {
+                                        memcpy(c->subscription,r.data,r.len);
+                                }
+                                break;
+                        case HANDOVER_SAMPLES:
+                                restoreHistory(history,&r);
+                                break;
+                }
+        }
+        syslog(LOG_INFO,"Reloaded, %i TCP clients and %u samples taken over",clients,history->size);
+}
 
+static void reload(const InitializationData* id, const int udpsock, const int tcpsock, const int metricssock,
+                SerialIngest* ingest, const P1Snapshot* snapshot, Fanout* fanout, const TimeSeries* history)
+{
+        /* Execute the program again, continuing with the sockets, clients,
+         * serial device and samples of this instance. The ingest thread is
+         * paused, so the serial data read stays as it is. Returns only if
+         * the exec failed. Metrics clients, clients in the middle of a reply
+         * and modbus connections are closed on the exec, and connect again.
+         * The periods of the history store being rolled up need no handover,
+         * the new instance rebuilds them from the raw records when it opens
+         * the store. */
+        Handover h;
+        syslog(LOG_INFO,"Reloading");
+        if (handoverCreate(&h)) return;
+        handoverPut(&h,HANDOVER_UDP,udpsock,0,0);
+        handoverPut(&h,HANDOVER_LISTEN,tcpsock,0,0);
+        if (metricssock>=0) handoverPut(&h,HANDOVER_METRICS,metricssock,0,0);
+        if (ingest->deviceName && ingest->fd>=0)
+        {
+                const size_t nameLen=strlen(ingest->deviceName)+1;
+                char serial[nameLen+ingest->count];
+                memcpy(serial,ingest->deviceName,nameLen);
+                memcpy(serial+nameLen,ingest->buffer,ingest->count);
+                handoverPut(&h,HANDOVER_SERIAL,ingest->fd,serial,sizeof(serial));
+        }
+        if (snapshot->received.tv_sec)
+        {
+                char telegram[sizeof(struct timespec)+INGEST_BUFSIZE];
+                memcpy(telegram,&snapshot->received,sizeof(struct timespec));
+                memcpy(telegram+sizeof(struct timespec),snapshot->telegram.raw,snapshot->telegram.rawLen);
+                handoverPut(&h,HANDOVER_TELEGRAM,-1,telegram,sizeof(struct timespec)+snapshot->telegram.rawLen);
+        }
+        fanoutHandover(fanout,&h,sizeof(Subscription));
+        handoverHistory(&h,history);
+        handoverExec(&h,id->argv);
+}
 
 int reporter(InitializationData* id) {
-        const int udpsock=setupUdpSocket(id->port);
-        const int tcpsock=setupTcpSocket(id->port);
-        const int maxConns=50;
-        const int p1size=BUFFSIZE;
+        /* After a reload the sockets of the previous instance are used */
+        int udpsock=adoptSocket(id->handover,HANDOVER_UDP,id->port);
+        if (udpsock<0) udpsock=setupUdpSocket(id->port);
+        int tcpsock=adoptSocket(id->handover,HANDOVER_LISTEN,id->port);
+        if (tcpsock<0) tcpsock=setupTcpSocket(id->port);
+        int metricssock=adoptSocket(id->handover,HANDOVER_METRICS,id->metricsPort);
+        if (metricssock<0 && id->metricsPort) metricssock=setupTcpSocket(id->metricsPort);
+        const int maxConns=id->maxConns;
         int i;
-        int gotNewP1=0;
-        int p1TmpCount=0;
-        int timerfd=-1;
-
-        struct timespec p1UpdateTime, modbusUpdateTime;
-        bzero(&p1UpdateTime,sizeof(struct timespec));
-        bzero(&modbusUpdateTime,sizeof(struct timespec));
 
-        enum ModBusStatus modbusStatus=NO_CONNECTION;
+        Measurements measurements;
+        bzero(&measurements,sizeof(measurements));
 
         const int syslogopt=0;
         const int syslogfacility=0;
 
-
-
-        /* Setup arrays for modbus data. We have two arrays (allocated as one
-         * big of 2 * modbusRegCount), one is active, the other is to load
-         * data into with read(2). In case the read succeeds, we switch the
-         * active pointer to the new buffer, alternatively, the active pointer
-         * becomes 0. Then we always have either valid data or no data */
-
-        uint16_t* modbusData = malloc(2*sizeof(uint16_t)*modbusRegCount);
-        if (!modbusData)
+        const int epfd=epoll_create1(EPOLL_CLOEXEC);
+        if (epfd==-1) Die("epoll_create1");
+
+        /* Modbus clients, one per device. Each keeps two buffers for
+         * register data. One is active, the other is to load data into. When
+         * a reply is complete, we switch the active pointer to the new
+         * buffer. Then we always have either valid data or no data */
+        const int modbusCount=id->modbusDeviceCount;
+        ModbusClient* modbus=malloc((modbusCount+1)*sizeof(ModbusClient));
+        uint32_t* modbusGeneration=calloc(modbusCount+1,sizeof(uint32_t));
+        if (!modbus || !modbusGeneration)
         {
                 perror("malloc, exiting");
                 exit(1);
         }
-
-        uint16_t *activeModBusData=0; 
-
-
-        if (id->modbusAddr)
+        for (i=0;i<modbusCount;i++)
         {
-                /* In case we have modbus active, setup the timer, to
-                 * specified # of seconds */ 
-                timerfd=setupModbusTimer(1);
+                if (modbusInit(&modbus[i],&id->modbusDevices[i],id->debug))
+                {
+                        perror("malloc, exiting");
+                        exit(1);
+                }
+                /* Setup the poll timer */
+                if (modbusStartTimer(&modbus[i],id->modbusPeriodMs)) exit(1);
+                watchFd(epfd,modbus[i].timerfd,EPOLLIN|EPOLLET,EVENT_TAG(EV_MODBUS_TIMER,i,0));
         }
 
         openlog("powermonitor",syslogopt,syslogfacility);
 
-        int* tcpconnections=malloc(maxConns*sizeof(int));
-        for (i=0;i<maxConns;i++) tcpconnections[i]=-1;
+        if (initCommandRegistry())
+        {
+                fprintf(stderr,"Failed to setup command table, exiting\n");
+                exit(1);
+        }
 
-        char* p1data=malloc(p1size);
-        char* p1tmpdata=malloc(p1size);
-        sprintf(p1data,"Uninitialized\n");
-        sprintf(p1tmpdata,"Uninitialized\n");
-        struct pollfd* pfd=malloc((maxConns+3)*sizeof(struct pollfd));
-        struct pollfd pollData; /* Object used for preparing contents of pollfd array */
+        /* TCP clients that get a copy of each telegram */
+        Fanout fanout;
+        /* A reply state or a subscription, whichever is larger */
+        size_t stateSize=sizeof(TextReply);
+        if (sizeof(RangeQuery)>stateSize) stateSize=sizeof(RangeQuery);
+        if (sizeof(Subscription)>stateSize) stateSize=sizeof(Subscription);
+        if (fanoutInit(&fanout,maxConns,id->tcpQueueLen,id->tcpQueuePolicy,stateSize,id->debug))
+        {
+                perror("malloc, exiting");
+                exit(1);
+        }
+        raiseFileLimit(maxConns);
+        TcpContext tcpContext;
+        fanout.onRequest=tcpRequest;
+        fanout.context=&tcpContext;
+
+        /* Prometheus scrapes, if wanted */
+        MetricsContext metricsContext;
+        MetricsServer metrics;
+        if (metricsInit(&metrics,renderMetrics,&metricsContext,id->debug))
+        {
+                perror("malloc, exiting");
+                exit(1);
+        }
 
-        if (id->debug) fprintf(stderr,"tcpsocket=%i udpsock=%i serialfd=%i\n",tcpsock,udpsock,id->serialDeviceFd);
-        int modbusfd=-1;
+        /* Recent samples, for averages over time windows */
+        TimeSeries history;
+        if (timeSeriesInit(&history,SERIES_COUNT,HISTORYSIZE))
+        {
+                perror("malloc, exiting");
+                exit(1);
+        }
+        double sample[SERIES_COUNT];
+        HistoryRecord record;
+
+        /* Record for each telegram on disk, if wanted */
+        HistoryStore store;
+        bzero(&store,sizeof(store));
+        if (id->historyFile && historyStoreOpen(&store,id->historyFile,id->historyDays)) exit(1);
+
+        /* Telegrams are read and parsed by a thread of their own, the
+         * event loop holds the latest until it takes the next */
+        SerialIngest ingest;
+        const char* pending=0;
+        int pendingLen=0;
+        HandoverRecord telegram={0};
+        int serialFd=id->serialDeviceFd;
+        if (id->handover)
+        {
+                /* Continue with the serial device, the data read and the
+                 * latest telegram of the previous instance */
+                serialFd=adoptSerialDevice(id->handover,id->serialDeviceName,&pending,&pendingLen);
+                if (serialFd<0 && id->serialDeviceName) serialFd=openP1Device(id->serialDeviceName);
+                if (!handoverFind(id->handover,HANDOVER_TELEGRAM,&telegram) || telegram.len<sizeof(struct timespec)) telegram.len=0;
+        }
+        if (ingestInit(&ingest,id->serialDeviceName,serialFd,id->debug)) exit(1);
+        if (telegram.len)
+        {
+                struct timespec received;
+                memcpy(&received,telegram.data,sizeof(received));
+                ingestRestore(&ingest,telegram.data+sizeof(received),telegram.len-sizeof(received),&received,pending,pendingLen);
+        } else {
+                ingestRestore(&ingest,0,0,0,pending,pendingLen);
+        }
+        if (ingestRun(&ingest)) exit(1);
+        const P1Snapshot* snapshot=&ingest.slots[ingest.reading];
+        measurements.p1=&snapshot->telegram;
+        measurements.p1UpdateTime=snapshot->received;
+        measurements.modbus=modbus;
+        measurements.modbusCount=modbusCount;
+        measurements.device=DEVICE_DEFAULT;
+        measurements.history=&history;
+        measurements.store=&store;
+        tcpContext.id=id;
+        tcpContext.m=&measurements;
+        tcpContext.history=&history;
+        tcpContext.states=&fanout.states;
+        memoryPools[memoryPoolCount++]=&fanout.telegrams;
+        memoryPools[memoryPoolCount++]=&fanout.chunks;
+        memoryPools[memoryPoolCount++]=&fanout.states;
+        metricsContext.m=&measurements;
+        metricsContext.ingest=&ingest;
+        metricsContext.fanout=&fanout;
+        struct epoll_event events[MAXEVENTS];
+        struct timespec wakeup, start;
+        time_t wakeupSecond=0;
+        unsigned long wakeups=0;
+        int reloadRequested=0;
+
+        if (id->debug) fprintf(stderr,"tcpsocket=%i udpsock=%i serialfd=%i\n",tcpsock,udpsock,serialFd);
+
+        /* SIGHUP is blocked since main started, it is read from a signalfd
+         * and makes the program reload */
+        sigset_t hangup;
+        sigemptyset(&hangup);
+        sigaddset(&hangup,SIGHUP);
+        const int sigfd=signalfd(-1,&hangup,SFD_NONBLOCK|SFD_CLOEXEC);
+        if (sigfd==-1) Die("signalfd");
+
+        /* Level triggered. UDP queries are read in batches of up to
+         * UDP_BATCH per wakeup, what is left keeps the socket readable. A
+         * connection is accepted per wakeup. The ingest thread reads the
+         * serial device and wakes the loop through its eventfd, which is
+         * cleared when the latest telegram is taken. */
+        watchFd(epfd,udpsock,EPOLLIN,EVENT_TAG(EV_UDP,0,0));
+        watchFd(epfd,tcpsock,EPOLLIN,EVENT_TAG(EV_LISTEN,0,0));
+        watchFd(epfd,ingest.eventfd,EPOLLIN,EVENT_TAG(EV_INGEST,0,0));
+        if (metricssock>=0) watchFd(epfd,metricssock,EPOLLIN,EVENT_TAG(EV_METRICS_LISTEN,0,0));
+        watchFd(epfd,sigfd,EPOLLIN,EVENT_TAG(EV_SIGNAL,0,0));
+
+        if (id->handover)
+        {
+                resume(id->handover,&fanout,&history,epfd);
+                handoverClose(id->handover);
+        }
 
         while (1)
         {
-                int wroteDataToTcp=0;
-                int p=0;
-                int modbuspollpos=-1;
-                int timerfdpollpos=-1;
-                int p1DevicePollPos=-1;
-                int tcpConnectionOffset=0;
-                /* Prepare array pfd */
                 if (id->debug) logTime(__LINE__);
-                pollData.fd=udpsock,pollData.events=POLLIN, pollData.revents=0; /* UDP socket for command handling */
-                pfd[p++]=pollData;
-                pollData.fd=tcpsock,pollData.events=POLLIN, pollData.revents=0; /* TCP socket to accept connections from */
-                pfd[p++]=pollData;
-                if (id->serialDeviceFd>=0)
+                const int eventCount=epoll_wait(epfd,events,MAXEVENTS,-1);
+                if (eventCount==-1)
                 {
-                        pollData.fd=id->serialDeviceFd,pollData.events=POLLIN, pollData.revents=0; /* Serial fd */
-                        p1DevicePollPos=p;   
-                        pfd[p++]=pollData;
-                }
-                if (timerfd>=0)
-                {
-                        if (id->debug) fprintf(stderr,"adding timerfd %i\n", timerfd);
-                        timerfdpollpos=p;
-                        pollData.fd=timerfd, pollData.events=POLLIN, pollData.revents=0; /* modbus timer fd */
-                        pfd[p++]=pollData;
-                }
-                switch (modbusStatus)
-                {
-                        case WAIT_FOR_REPLY:
-                                if (id->debug) fprintf(stderr,"modbus waitforreply\n");
-                                modbuspollpos=p;
-                                pollData.fd=modbusfd; pollData.events=POLLIN, pollData.revents=0;
-                                pfd[p++]=pollData;
-                                break;
-                        case WAIT_FOR_SEND_REQ:
-                                if (id->debug) fprintf(stderr,"modbus waitforsend\n");
-                                modbuspollpos=p;
-                                pollData.fd=modbusfd; pollData.events=POLLOUT, pollData.revents=0;
-                                pfd[p++]=pollData;
-                                break;
-                        case WAIT_FOR_CONNECTION:
-                                if (id->debug) fprintf(stderr,"modbus waitforconnection\n");
-                                modbuspollpos=p;
-                                pollData.fd=modbusfd; pollData.events=POLLOUT, pollData.revents=0;
-                                pfd[p++]=pollData;
-                                break;
-                        default:
-                                break;
-                }
-                if (id->debug)
-                {
-                        fprintf(stderr,"modbusstatus a: %i, p=%i\n", modbusStatus,p);
+                        if (errno==EINTR) continue;
+                        perror("epoll_wait");
+                        return -1;
                 }
-                for (i=0;i<maxConns && gotNewP1;i++)
+                /* Wakeups per second, seconds without any count as 0 */
+                clock_gettime(CLOCK_MONOTONIC,&wakeup);
+                if (wakeup.tv_sec!=wakeupSecond)
                 {
-                        /* TCP sockets to write data on */
-                        if (tcpconnections[i]!=-1)
+                        if (wakeupSecond)
                         {
-                                pollData.fd=tcpconnections[i],pollData.events=(gotNewP1?POLLOUT:0)|POLLIN, pollData.revents=0;
-                                pfd[p++]=pollData;
+                                histogramRecord(&stats.wakeups,wakeups);
+                                histogramRecordN(&stats.wakeups,0,wakeup.tv_sec-wakeupSecond-1);
                         }
+                        wakeupSecond=wakeup.tv_sec;
+                        wakeups=0;
                 }
-
-                /* Poll invocation */
-                for (int j=0;id->debug && j<p; ++j)
-                {
-                        fprintf(stderr,"poll %i fd %i events %i\n", j, pfd[j].fd, pfd[j].events);
-                }
-                const int pollResult=poll(pfd,p,-1);
-                for (int j=0;id->debug && j<p; ++j)
-                {
-                        fprintf(stderr,"poll %i fd %i revents %i\n", j, pfd[j].fd, pfd[j].revents);
-                }
-                if (pollResult==0) continue;
-                if (pollResult==-1)
-                {
-                        perror("poll");
-                        return -1;
-                }
-                /* Handle events */
-                tcpConnectionOffset++;
-                /* Read UDP command */
-                if (pfd[0].revents & POLLIN)
-                {
-                        handleUserQuery(id,activeModBusData,p1data,modbusUpdateTime,p1UpdateTime,pfd[0].fd);
-                }
-                tcpConnectionOffset++;
-                /* Accept new tcp connection */
-                if (pfd[1].revents & POLLIN)
-                {
-                        const int newsock=acceptConnection(pfd[1].fd,tcpconnections,maxConns);
-                        if (id->debug) fprintf(stderr,"accepted new tcp connection, fd=%i\n",newsock);
-                }
-                tcpConnectionOffset++;
-                /* Read P1 data from Serial port */
-                if (p1DevicePollPos>=0)
+                wakeups++;
+                for (i=0;i<eventCount;i++)
                 {
-                        tcpConnectionOffset++;
-                        if (pfd[2].revents & POLLIN)
+                        const uint64_t tag=events[i].data.u64;
+                        const int index=EVENT_INDEX(tag);
+                        const uint32_t revents=events[i].events;
+                        if (id->debug) fprintf(stderr,"event kind %i index %i events %x\n",EVENT_KIND(tag),index,events[i].events);
+                        switch (EVENT_KIND(tag))
                         {
-                                if (readSerialData(id, pfd[2].fd, p1size, &p1TmpCount, p1tmpdata)==0)
+                                case EV_UDP:
                                 {
-                                        /* Succesful read, so swap the two buffers */
-                                        gotNewP1=p1TmpCount;
-                                        char* tmp=p1tmpdata;
-                                        p1tmpdata=p1data;
-                                        p1data=tmp;
-                                        p1TmpCount=0;
-                                        clock_gettime(CLOCK_REALTIME,&p1UpdateTime);
-                                        if (id->debug) fprintf(stderr,"Data complete, swapping\n");
-                                        if (id->debug) fprintf(stderr,"Data:\n%s\n",p1data);
+                                        /* Read UDP command, on up to date windows */
+                                        struct timespec now;
+                                        clock_gettime(CLOCK_REALTIME,&now);
+                                        timeSeriesExpire(&history,now.tv_sec+now.tv_nsec*1e-9);
+                                        handleUserQuery(id,&measurements,udpsock);
+                                        break;
                                 }
-                        }
-                }
-                /* Read timer event, if enabled */
-                if (timerfdpollpos>=0)
-                {
-                        tcpConnectionOffset++;
-                        if (pfd[timerfdpollpos].revents & POLLIN)
-                        {
-                                uint64_t val;
-                                int r=read(pfd[timerfdpollpos].fd,&val,sizeof(uint64_t));
-                                if (modbusStatus==NO_CONNECTION)
+                                case EV_LISTEN:
+                                {
+                                        /* Accept new tcp connection */
+                                        const FanoutClient* c=fanoutAccept(&fanout,tcpsock);
+                                        if (id->debug) fprintf(stderr,"accepted new tcp connection, fd=%i\n",c?c->fd:-1);
+                                        if (c) watchFd(epfd,c->fd,EPOLLIN|EPOLLOUT|EPOLLET,
+                                                        EVENT_TAG(EV_CLIENT,c-fanout.clients,c->generation));
+                                        break;
+                                }
+                                case EV_INGEST:
+                                {
+                                        /* A telegram was read and parsed, the
+                                         * one before it may now be reused */
+                                        const P1Snapshot* latest=ingestTake(&ingest);
+                                        if (!latest) break;
+                                        snapshot=latest;
+                                        metrics.stale=1;
+                                        histogramRecordInterval(&stats.serial,&snapshot->start,&snapshot->end);
+                                        histogramRecordInterval(&stats.parse,&snapshot->end,&snapshot->parsed);
+                                        clock_gettime(CLOCK_MONOTONIC,&start);
+                                        measurements.p1=&snapshot->telegram;
+                                        measurements.p1UpdateTime=snapshot->received;
+                                        fanoutPublish(&fanout,snapshot->telegram.raw,snapshot->telegram.rawLen);
+                                        sampleMeasurements(&measurements,sample,&record);
+                                        timeSeriesAppend(&history,record.h.time,sample);
+                                        if (store.files[TIER_RAW].header) historyStoreAppend(&store,&record);
+                                        publishSubscriptions(&fanout,id,&measurements,record.h.time);
+                                        histogramRecordSince(&stats.publish,&start);
+                                        break;
+                                }
+                                case EV_MODBUS_TIMER:
+                                        modbusTimerExpired(&modbus[index]);
+                                        watchModbus(epfd,&modbus[index],index,&modbusGeneration[index]);
+                                        break;
+                                case EV_MODBUS:
+                                        /* Skip events of a connection that was replaced */
+                                        if ((uint32_t)modbus[index].sockets!=EVENT_GENERATION(tag) || modbus[index].fd<0) break;
+                                        modbusHandleEvents(&modbus[index],revents);
+                                        metrics.stale=1;
+                                        watchModbus(epfd,&modbus[index],index,&modbusGeneration[index]);
+                                        break;
+                                case EV_CLIENT:
+                                {
+                                        /* Skip clients closed, or replaced, since the event */
+                                        FanoutClient* c=&fanout.clients[index];
+                                        if (c->fd>=0 && c->generation==EVENT_GENERATION(tag))
+                                        {
+                                                fanoutHandleEvents(&fanout,c,revents);
+                                        }
+                                        break;
+                                }
+                                case EV_METRICS_LISTEN:
                                 {
-                                        modbusfd=startModbusConnection(id);
-                                        if (modbusfd>=0) modbusStatus=WAIT_FOR_CONNECTION;
-                                        if (id->debug) fprintf(stderr,"Initiated new modbus connection: %i\n",modbusfd);
+                                        const MetricsClient* c=metricsAccept(&metrics,metricssock);
+                                        if (id->debug) fprintf(stderr,"accepted new metrics connection, fd=%i\n",c?c->fd:-1);
+                                        if (c) watchFd(epfd,c->fd,EPOLLIN|EPOLLOUT|EPOLLET,
+                                                        EVENT_TAG(EV_METRICS,c-metrics.clients,c->generation));
+                                        break;
+                                }
+                                case EV_METRICS:
+                                {
+                                        MetricsClient* c=&metrics.clients[index];
+                                        if (c->fd>=0 && c->generation==EVENT_GENERATION(tag))
+                                        {
+                                                metricsHandleEvents(&metrics,c,revents);
+                                        }
+                                        break;
+                                }
+                                case EV_SIGNAL:
+                                {
+                                        struct signalfd_siginfo info;
+                                        while (read(sigfd,&info,sizeof(info))==sizeof(info)) reloadRequested=1;
+                                        break;
                                 }
                         }
                 }
-                /* Handle modbus data */
-                if (modbuspollpos>=0)
-                {
-                        modbusStatus=
-                                readModbusData(id->debug, pfd[modbuspollpos].fd,
-                                                pfd[modbuspollpos].revents,
-                                                modbusStatus,modbusData,&activeModBusData,
-                                                &modbusUpdateTime);
-                        tcpConnectionOffset++;
-                }
-                /* Handle tcp connections */
-                for (i=tcpConnectionOffset;i<p;i++)
+                /* Reload when the telegrams published are handled, the new
+                 * instance continues after the latest */
+                if (reloadRequested)
                 {
-                        if (pfd[i].revents & POLLHUP)
-                        {
-                                closeConnection(pfd[i].fd,tcpconnections,maxConns);
-                        }
-                        if (pfd[i].revents & POLLIN)
-                        {
-                                char buffer[1024];
-                                if (read(pfd[i].fd,buffer,1024)==0)
-                                        closeConnection(pfd[i].fd,tcpconnections,maxConns);
-                        }
-                        if (pfd[i].revents & POLLOUT)
-                        {
-                                wroteDataToTcp=1;
-                                int written=write(pfd[i].fd,p1data,gotNewP1);
-                                if (written<gotNewP1) closeConnection(pfd[i].fd,tcpconnections,maxConns);
-                        }
+                        ingestPause(&ingest);
+                        if (ingestPending(&ingest)) continue;
+                        reload(id,udpsock,tcpsock,metricssock,&ingest,snapshot,&fanout,&history);
+                        reloadRequested=0;
+                        if (ingestRun(&ingest)) exit(1);
                 }
-                if (wroteDataToTcp) gotNewP1=0;
         }
         closelog();
-        free(pfd);
-        free(p1tmpdata);
-        free(p1data);
-        free(tcpconnections);
+        ingestStop(&ingest);
+        fanoutFree(&fanout);
+        metricsFree(&metrics);
+        timeSeriesFree(&history);
+        historyStoreClose(&store);
+        for (i=0;i<modbusCount;i++) modbusFree(&modbus[i]);
+        free(modbusGeneration);
+        free(modbus);
+        close(sigfd);
+        close(epfd);
         return 0;
 }
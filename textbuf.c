@@ -0,0 +1,139 @@
+#include "textbuf.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const double pow10Table[NUMBER_DECIMALS+1]={ 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+/* Scaled values are kept below 2^53, so they are exact in a double and
+   in 64 bit integers. Larger values get fewer decimals. */
+#define NUMBER_FASTLIMIT 9e15
+
+void textBufInit(TextBuf* t, char* data, const int size)
+{
+        t->data=data;
+        t->size=size;
+        t->len=0;
+        t->truncated=0;
+        t->text=data;
+        data[0]='\0';
+}
+
+void textBufAppend(TextBuf* t, const char* s, int len)
+{
+        if (t->text!=t->data)
+        {
+                /* Copy the text referred to first */
+                const char* ref=t->text;
+                const int refLen=t->len;
+                t->text=t->data;
+                t->len=0;
+                textBufAppend(t,ref,refLen);
+        }
+        if (len>t->size-1-t->len)
+        {
+                len=t->size-1-t->len;
+                t->truncated=1;
+        }
+        memcpy(t->data+t->len,s,len);
+        t->len+=len;
+        t->data[t->len]='\0';
+}
+
+void textBufString(TextBuf* t, const char* s)
+{
+        textBufAppend(t,s,strlen(s));
+}
+
+void textBufPrintf(TextBuf* t, const char* format, ...)
+{
+        va_list args;
+        if (t->text!=t->data) textBufAppend(t,"",0);
+        va_start(args,format);
+        const int room=t->size-t->len;
+        const int len=vsnprintf(t->data+t->len,room,format,args);
+        va_end(args);
+        if (len<0) return;
+        if (len>=room)
+        {
+                t->len=t->size-1;
+                t->truncated=1;
+        } else {
+                t->len+=len;
+        }
+}
+
+void textBufNumber(TextBuf* t, const double v)
+{
+        char number[NUMBER_MAXLEN];
+        textBufAppend(t,number,formatNumber(number,v));
+}
+
+void textBufRefer(TextBuf* t, const char* s, const int len)
+{
+        t->text=s;
+        t->len=len;
+        t->truncated=0;
+}
+
+int formatNumber(char* out, const double v)
+{
+        const double a=fabs(v);
+        char digits[24];
+        int len=0;
+        int n=0;
+        int k;
+        int maxDecimals=NUMBER_DECIMALS;
+        long long r=0;
+        if (isnan(v))
+        {
+                strcpy(out,"nan");
+                return 3;
+        }
+        if (isinf(v))
+        {
+                strcpy(out,v<0?"-inf":"inf");
+                return v<0?4:3;
+        }
+        if (a>=NUMBER_FASTLIMIT)
+        {
+                /* Rare, the shortest %g form that reads back as v */
+                int precision;
+                for (precision=15;precision<17;precision++)
+                {
+                        len=snprintf(out,NUMBER_MAXLEN,"%.*g",precision,v);
+                        if (strtod(out,0)==v) return len;
+                }
+                return snprintf(out,NUMBER_MAXLEN,"%.17g",v);
+        }
+        /* The fewest decimals that give v exactly, else as many as fit */
+        while (maxDecimals>0 && a*pow10Table[maxDecimals]>=NUMBER_FASTLIMIT) maxDecimals--;
+        for (k=0;k<=maxDecimals;k++)
+        {
+                r=llround(a*pow10Table[k]);
+                if (r/pow10Table[k]==a) break;
+        }
+        if (k>maxDecimals) k=maxDecimals;
+        while (k>0 && r%10==0)
+        {
+                r/=10;
+                k--;
+        }
+        /* Digits in reverse, with at least one before the point */
+        do
+        {
+                digits[n++]='0'+r%10;
+                r/=10;
+        } while (r || n<=k);
+        if (v<0 && (n>1 || digits[0]!='0')) out[len++]='-';
+        while (n)
+        {
+                if (n==k) out[len++]='.';
+                out[len++]=digits[--n];
+        }
+        out[len]='\0';
+        return len;
+}
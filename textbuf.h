@@ -0,0 +1,41 @@
+#ifndef TEXTBUF_H
+#define TEXTBUF_H
+
+/* Bounded text output for answers. Appending never writes past the buffer:
+   what does not fit is cut off and truncated is set, the text stays 0
+   terminated. Numbers are formatted without printf where possible.
+
+   An answer may also refer to text kept elsewhere, such as a cached
+   rendering or the telegram, instead of copying it. The result is always
+   text and len.
+ */
+
+#define NUMBER_MAXLEN   32      /* formatNumber output, with the 0 */
+#define NUMBER_DECIMALS 6
+
+typedef struct
+{
+        char*       data;
+        int         size;
+        int         len;
+        int         truncated;
+        const char* text;       /* data, or the text referred to */
+} TextBuf;
+
+void textBufInit(TextBuf* t, char* data, const int size);
+void textBufAppend(TextBuf* t, const char* s, const int len);
+void textBufString(TextBuf* t, const char* s);
+void textBufPrintf(TextBuf* t, const char* format, ...) __attribute__((format(printf,2,3)));
+void textBufNumber(TextBuf* t, const double v);
+
+/* Make the text the len bytes at s, without copying them. They must stay
+   valid while the text is used. Appending copies them first. */
+void textBufRefer(TextBuf* t, const char* s, const int len);
+
+/* Shortest decimal form of v with at most NUMBER_DECIMALS decimals: v
+   exactly when that is enough, else v rounded to NUMBER_DECIMALS decimals
+   (halves away from zero), without trailing zeros. "nan", "inf" or "-inf"
+   for those. Returns the length. */
+int formatNumber(char* out, const double v);
+
+#endif // TEXTBUF_H
@@ -0,0 +1,179 @@
+#include "timeseries.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+const int windowSeconds[WINDOW_COUNT]={ 10, 60, 15*60, 3600, 24*3600 };
+const char* windowNames[WINDOW_COUNT]={ "10s", "1m", "15m", "1h", "24h" };
+const char* statNames[STAT_COUNT]={ "avg", "min", "max" };
+
+static int queueInit(SampleQueue* q, const uint32_t capacity)
+{
+        q->seq=malloc(capacity*sizeof(uint32_t));
+        q->capacity=capacity;
+        q->first=0;
+        q->count=0;
+        return q->seq?0:-1;
+}
+
+static uint32_t queueFront(const SampleQueue* q)
+{
+        return q->seq[q->first];
+}
+
+static uint32_t queueBack(const SampleQueue* q)
+{
+        return q->seq[(q->first+q->count-1)%q->capacity];
+}
+
+static void queuePopFront(SampleQueue* q)
+{
+        q->first=(q->first+1)%q->capacity;
+        q->count--;
+}
+
+static void queuePushBack(SampleQueue* q, const uint32_t seq)
+{
+        /* A full queue only happens with more samples than expected in the
+         * window, the oldest candidate is dropped then */
+        if (q->count==q->capacity) queuePopFront(q);
+        q->seq[(q->first+q->count)%q->capacity]=seq;
+        q->count++;
+}
+
+int timeSeriesInit(TimeSeries* ts, const int seriesCount, const uint32_t capacity)
+{
+        int s, w;
+        memset(ts,0,sizeof(*ts));
+        ts->seriesCount=seriesCount;
+        ts->capacity=capacity;
+        ts->time=malloc(capacity*sizeof(double));
+        ts->values=malloc((size_t)seriesCount*capacity*sizeof(float));
+        ts->aggregates=calloc(seriesCount*WINDOW_COUNT,sizeof(WindowAggregate));
+        if (!ts->time || !ts->values || !ts->aggregates) return -1;
+        for (s=0;s<seriesCount;s++)
+        {
+                for (w=0;w<WINDOW_COUNT;w++)
+                {
+                        /* Room for two samples per second, the ring limits
+                         * the samples in any window anyway */
+                        WindowAggregate* a=&ts->aggregates[s*WINDOW_COUNT+w];
+                        uint32_t queueSize=2*windowSeconds[w]+16;
+                        if (queueSize>capacity) queueSize=capacity;
+                        if (queueInit(&a->minQueue,queueSize) || queueInit(&a->maxQueue,queueSize)) return -1;
+                }
+        }
+        return 0;
+}
+
+void timeSeriesFree(TimeSeries* ts)
+{
+        int i;
+        for (i=0;ts->aggregates && i<ts->seriesCount*WINDOW_COUNT;i++)
+        {
+                free(ts->aggregates[i].minQueue.seq);
+                free(ts->aggregates[i].maxQueue.seq);
+        }
+        free(ts->aggregates);
+        free(ts->values);
+        free(ts->time);
+        ts->aggregates=0;
+        ts->values=0;
+        ts->time=0;
+}
+
+static float value(const TimeSeries* ts, const int series, const uint32_t seq)
+{
+        return ts->values[(size_t)series*ts->capacity+seq%ts->capacity];
+}
+
+static void removeOldest(TimeSeries* ts, const int w)
+{
+        /* The oldest sample of window w leaves it */
+        const uint32_t seq=ts->tail[w];
+        int s;
+        for (s=0;s<ts->seriesCount;s++)
+        {
+                WindowAggregate* a=&ts->aggregates[s*WINDOW_COUNT+w];
+                const float v=value(ts,s,seq);
+                if (isnan(v)) continue;
+                a->count--;
+                a->sum=a->count?a->sum-v:0; /* No rounding errors left behind */
+                if (a->minQueue.count && queueFront(&a->minQueue)==seq) queuePopFront(&a->minQueue);
+                if (a->maxQueue.count && queueFront(&a->maxQueue)==seq) queuePopFront(&a->maxQueue);
+        }
+        ts->tail[w]++;
+}
+
+static void expire(TimeSeries* ts, const double now, const int makeRoom)
+{
+        /* Samples older than the window leave it, and with makeRoom also the
+         * sample that is about to be overwritten */
+        int w;
+        for (w=0;w<WINDOW_COUNT;w++)
+        {
+                while (ts->tail[w]!=ts->head)
+                {
+                        const uint32_t inWindow=ts->head-ts->tail[w];
+                        if (!(makeRoom && inWindow>=ts->capacity) && ts->time[ts->tail[w]%ts->capacity]>now-windowSeconds[w]) break;
+                        removeOldest(ts,w);
+                }
+        }
+}
+
+void timeSeriesExpire(TimeSeries* ts, const double now)
+{
+        expire(ts,now,0);
+}
+
+void timeSeriesAppend(TimeSeries* ts, const double time, const double* values)
+{
+        const uint32_t seq=ts->head;
+        const uint32_t pos=seq%ts->capacity;
+        int s, w;
+        expire(ts,time,1);
+        ts->time[pos]=time;
+        for (s=0;s<ts->seriesCount;s++)
+        {
+                const float v=values[s];
+                ts->values[(size_t)s*ts->capacity+pos]=v;
+                if (isnan(v)) continue;
+                for (w=0;w<WINDOW_COUNT;w++)
+                {
+                        WindowAggregate* a=&ts->aggregates[s*WINDOW_COUNT+w];
+                        a->sum+=v;
+                        a->count++;
+                        /* Samples that can never be the minimum or maximum
+                         * again, as a newer sample is lower or higher */
+                        while (a->minQueue.count && value(ts,s,queueBack(&a->minQueue))>=v) a->minQueue.count--;
+                        queuePushBack(&a->minQueue,seq);
+                        while (a->maxQueue.count && value(ts,s,queueBack(&a->maxQueue))<=v) a->maxQueue.count--;
+                        queuePushBack(&a->maxQueue,seq);
+                }
+        }
+        ts->head++;
+        if (ts->size<ts->capacity) ts->size++;
+}
+
+double timeSeriesStat(const TimeSeries* ts, const int series, const enum Window window, const enum WindowStat stat)
+{
+        const WindowAggregate* a=&ts->aggregates[series*WINDOW_COUNT+window];
+        if (a->count==0) return NAN;
+        switch (stat)
+        {
+                case STAT_AVG:
+                        return a->sum/a->count;
+                case STAT_MIN:
+                        return value(ts,series,queueFront(&a->minQueue));
+                case STAT_MAX:
+                        return value(ts,series,queueFront(&a->maxQueue));
+                default:
+                        return NAN;
+        }
+}
+
+uint32_t timeSeriesCount(const TimeSeries* ts, const int series, const enum Window window)
+{
+        return ts->aggregates[series*WINDOW_COUNT+window].count;
+}
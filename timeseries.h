@@ -0,0 +1,70 @@
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <stdint.h>
+
+/* Recent samples of a number of series, kept in a ring of fixed size: one
+   time column and one float column per series. For each series and each
+   window (10s up to 24h) a running sum and count are kept, plus monotonic
+   queues of sample numbers for the minimum and maximum. A sample is added to
+   these when it arrives and removed when it leaves the window, so averages,
+   minimums and maximums are available without going through the samples.
+
+   NAN values are stored, but not counted in the aggregates.
+ */
+
+enum Window { WINDOW_10S, WINDOW_1M, WINDOW_15M, WINDOW_1H, WINDOW_24H, WINDOW_COUNT };
+
+enum WindowStat { STAT_AVG, STAT_MIN, STAT_MAX, STAT_COUNT };
+
+extern const int windowSeconds[WINDOW_COUNT];
+extern const char* windowNames[WINDOW_COUNT];
+extern const char* statNames[STAT_COUNT];
+
+/* Sample numbers, oldest first. Sample numbers wrap, they are compared by
+   their distance to the newest sample. */
+typedef struct
+{
+        uint32_t* seq;
+        uint32_t  capacity;
+        uint32_t  first;
+        uint32_t  count;
+} SampleQueue;
+
+typedef struct
+{
+        double      sum;
+        uint32_t    count;
+        SampleQueue minQueue;   /* Values increase from first to last */
+        SampleQueue maxQueue;   /* Values decrease from first to last */
+} WindowAggregate;
+
+typedef struct
+{
+        int              seriesCount;
+        uint32_t         capacity;
+        uint32_t         head;          /* Number of the next sample */
+        uint32_t         size;          /* Samples in the ring */
+        double*          time;          /* Seconds, CLOCK_REALTIME */
+        float*           values;        /* Series s at values+s*capacity */
+        uint32_t         tail[WINDOW_COUNT];    /* Oldest sample in each window */
+        WindowAggregate* aggregates;    /* Series s, window w at [s*WINDOW_COUNT+w] */
+} TimeSeries;
+
+/* Returns -1 if no memory is available */
+int timeSeriesInit(TimeSeries* ts, const int seriesCount, const uint32_t capacity);
+void timeSeriesFree(TimeSeries* ts);
+
+/* Add a sample with a value for each series, time must not decrease */
+void timeSeriesAppend(TimeSeries* ts, const double time, const double* values);
+
+/* Remove samples that are no longer in their window at time now */
+void timeSeriesExpire(TimeSeries* ts, const double now);
+
+/* Aggregate of a series over a window, NAN if there are no samples */
+double timeSeriesStat(const TimeSeries* ts, const int series, const enum Window window, const enum WindowStat stat);
+
+/* Number of samples of a series in a window */
+uint32_t timeSeriesCount(const TimeSeries* ts, const int series, const enum Window window);
+
+#endif // TIMESERIES_H